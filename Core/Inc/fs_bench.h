@@ -0,0 +1,62 @@
+/*
+ * fs_bench.h
+ *
+ * Side-by-side benchmark of ChaN FatFs and Eremex FAT.
+ * Both stacks run the same workloads over the same SPI flash.
+ */
+
+#ifndef INC_FS_BENCH_H_
+#define INC_FS_BENCH_H_
+
+#include <stdint.h>
+#include "../Middleware/Fat/fs_media.h"
+#include "../Middleware/Spi_Flash/spi_flash.h"
+
+#define FS_BENCH_SAMPLES	256		// latency samples kept per workload
+#define FS_BENCH_MAX_CHUNK	4096	// max request size
+
+typedef enum {
+	FS_BENCH_CREATE,		// small file create + write
+	FS_BENCH_LIST,			// directory listing
+	FS_BENCH_DELETE,		// small file delete
+	FS_BENCH_SEQ_WRITE,		// large sequential write
+	FS_BENCH_SEQ_READ,		// large sequential read
+	FS_BENCH_OVERWRITE,		// random overwrite inside the large file
+	FS_BENCH_COUNT
+} FsBenchWorkload;
+
+typedef struct {
+	uint32_t (*clock)(void);	// time source
+	uint32_t clock_hz;			// clock ticks per second
+	fs_media_t* media;			// Eremex FAT media over the flash
+	uint32_t media_sectors;		// Eremex FAT volume size in SEC_SIZE sectors
+	uint32_t small_files;		// files in create/delete workloads
+	uint32_t small_size;		// bytes per small file and per overwrite
+	uint32_t large_size;		// size of the sequential file
+	uint32_t chunk;				// sequential request size
+	uint32_t lists;				// directory listing passes
+	uint32_t overwrites;		// random overwrites
+} FsBenchConfig;
+
+typedef struct {
+	int error;					// first error, 0 on success
+	uint32_t ops;
+	uint32_t bytes;
+	uint32_t ticks;				// whole workload time
+	uint32_t p50, p90, p99, max;// per operation latency in ticks
+	flash_stats_t flash;		// flash operations done by the workload
+} FsBenchResult;
+
+typedef struct {
+	const char* name;
+	uint32_t ram_static;		// file system objects and buffers
+	uint32_t ram_heap;			// allocated at mount
+	FsBenchResult result[FS_BENCH_COUNT];
+} FsBenchReport;
+
+void fs_bench_default_config(FsBenchConfig* cfg);
+int fs_bench_run_chan(const FsBenchConfig* cfg, FsBenchReport* rep);
+int fs_bench_run_eremex(const FsBenchConfig* cfg, FsBenchReport* rep);
+void fs_bench_print(const FsBenchConfig* cfg, const FsBenchReport* rep);
+
+#endif /* INC_FS_BENCH_H_ */
@@ -0,0 +1,511 @@
+/*
+ * fs_bench.c
+ *
+ * Side-by-side benchmark of ChaN FatFs and Eremex FAT.
+ *
+ * Each stack formats the flash, mounts it and runs the same workload
+ * list through a small set of file operations. Flash operations are
+ * counted by the SPI flash driver which is shared by both stacks, so
+ * the numbers are comparable. The benchmark destroys flash content.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "fs_bench.h"
+#include "ff.h"
+#include "../Middleware/Fat/fx_file.h"
+
+/* File operations of one stack. Only one file is open at a time. */
+typedef struct {
+	int (*format)(const FsBenchConfig* cfg);
+	int (*mount)(const FsBenchConfig* cfg);
+	int (*unmount)(void);
+	int (*mkdir)(const char* path);
+	int (*open)(const char* path, int create);
+	int (*close)(void);
+	int (*seek)(uint32_t offset);
+	int (*write)(const void* buf, uint32_t size);
+	int (*read)(void* buf, uint32_t size);
+	int (*remove)(const char* path);
+	int (*list)(const char* path, uint32_t* count);
+} FsBenchOps;
+
+static const char* const workload_names[FS_BENCH_COUNT] = {
+	"create", "list", "delete", "seq write", "seq read", "overwrite"
+};
+
+static uint8_t bench_buf[FS_BENCH_MAX_CHUNK];
+static uint32_t samples[FS_BENCH_SAMPLES];
+static uint32_t nsamples;
+
+/*-----------------------------------------------------------------------*/
+/* ChaN FatFs                                                            */
+/*-----------------------------------------------------------------------*/
+
+static FATFS chan_fs;
+static FIL chan_file;
+static DIR chan_dir;
+
+static int chan_error(FRESULT res)
+{
+	return (res == FR_OK) ? 0 : EIO;
+}
+
+static int chan_format(const FsBenchConfig* cfg)
+{
+	return chan_error(f_mkfs("", FM_FAT, 0, bench_buf, sizeof(bench_buf)));
+}
+
+static int chan_mount(const FsBenchConfig* cfg)
+{
+	return chan_error(f_mount(&chan_fs, "", 1));
+}
+
+static int chan_unmount(void)
+{
+	return chan_error(f_mount(NULL, "", 0));
+}
+
+static int chan_mkdir(const char* path)
+{
+	return chan_error(f_mkdir(path));
+}
+
+static int chan_open(const char* path, int create)
+{
+	BYTE mode = FA_READ | FA_WRITE | (create ? FA_CREATE_ALWAYS : FA_OPEN_EXISTING);
+
+	return chan_error(f_open(&chan_file, path, mode));
+}
+
+static int chan_close(void)
+{
+	return chan_error(f_close(&chan_file));
+}
+
+static int chan_seek(uint32_t offset)
+{
+	return chan_error(f_lseek(&chan_file, offset));
+}
+
+static int chan_write(const void* buf, uint32_t size)
+{
+	UINT done;
+	FRESULT res = f_write(&chan_file, buf, size, &done);
+
+	if (res == FR_OK && done != size)
+		return ENOSPC;
+	return chan_error(res);
+}
+
+static int chan_read(void* buf, uint32_t size)
+{
+	UINT done;
+	FRESULT res = f_read(&chan_file, buf, size, &done);
+
+	if (res == FR_OK && done != size)
+		return EIO;
+	return chan_error(res);
+}
+
+static int chan_remove(const char* path)
+{
+	return chan_error(f_unlink(path));
+}
+
+static int chan_list(const char* path, uint32_t* count)
+{
+	FILINFO fno;
+	FRESULT res;
+
+	*count = 0;
+	res = f_opendir(&chan_dir, path);
+	while (res == FR_OK)
+	{
+		res = f_readdir(&chan_dir, &fno);
+		if (res != FR_OK || fno.fname[0] == 0)
+			break;
+		(*count)++;
+	}
+	f_closedir(&chan_dir);
+	return chan_error(res);
+}
+
+static const FsBenchOps chan_ops = {
+	chan_format, chan_mount, chan_unmount, chan_mkdir, chan_open, chan_close,
+	chan_seek, chan_write, chan_read, chan_remove, chan_list
+};
+
+/*-----------------------------------------------------------------------*/
+/* Eremex FAT                                                            */
+/*-----------------------------------------------------------------------*/
+
+static fs_vol_t fx_vol;
+static fs_file_t fx_file;
+static fs_dir_t fx_dir;
+static fs_media_t* fx_media;
+static uint32_t fx_heap;
+
+/* Counts memory taken by the volume at mount. */
+static void* fx_alloc(size_t size)
+{
+	fx_heap += size;
+	return malloc(size);
+}
+
+static int fx_format(const FsBenchConfig* cfg)
+{
+	fx_media = cfg->media;
+	return fatfs_format(cfg->media, cfg->media_sectors, bench_buf);
+}
+
+static int fx_mount(const FsBenchConfig* cfg)
+{
+	fx_heap = 0;
+	memset(&fx_vol, 0, sizeof(fx_vol));
+	return fs_volume_open(cfg->media, &fx_vol, 0, fx_alloc);
+}
+
+static int fx_unmount(void)
+{
+	return fs_volume_close(&fx_vol);
+}
+
+static int fx_mkdir(const char* path)
+{
+	return fs_dir_create(&fx_vol, (char*)path);
+}
+
+static int fx_open(const char* path, int create)
+{
+	int error;
+
+	if (create)
+	{
+		error = fs_file_create(&fx_vol, (char*)path);
+		if (error && error != EEXIST)
+			return error;
+	}
+	error = fs_file_open(&fx_vol, &fx_file, (char*)path, 0);
+	if (!error && create)
+		error = fs_file_trunc(&fx_file, 0);
+	return error;
+}
+
+static int fx_close(void)
+{
+	return fs_file_close(&fx_file);
+}
+
+static int fx_seek(uint32_t offset)
+{
+	return fs_file_seek(&fx_file, offset, SEEK_SET);
+}
+
+static int fx_write(const void* buf, uint32_t size)
+{
+	size_t done;
+	int error = fs_file_write(&fx_file, (void*)buf, size, &done);
+
+	if (!error && done != size)
+		return ENOSPC;
+	return error;
+}
+
+static int fx_read(void* buf, uint32_t size)
+{
+	size_t done;
+	int error = fs_file_read(&fx_file, buf, size, &done);
+
+	if (!error && done != size)
+		return EIO;
+	return error;
+}
+
+static int fx_remove(const char* path)
+{
+	return fs_file_delete(&fx_vol, (char*)path);
+}
+
+static int fx_list(const char* path, uint32_t* count)
+{
+	fs_dir_entry_t entries[FS_DIR_BATCH];
+	int n, error;
+
+	*count = 0;
+	error = fs_dir_open(&fx_vol, (char*)path, &fx_dir);
+	while (!error)
+	{
+		error = fs_dir_read_entries(&fx_dir, entries, FS_DIR_BATCH, &n);
+		if (error || n == 0)
+			break;
+		*count += n;
+	}
+	fs_dir_close(&fx_dir);
+	return (error == ENOENT) ? 0 : error;
+}
+
+/* Push the volume state to the media, the next workload starts clean. */
+static int fx_sync(void)
+{
+	int error;
+
+	fs_media_lock(fx_media);
+	error = fatfs_sync(&fx_vol.fmp);
+	fs_media_unlock(fx_media);
+	return error;
+}
+
+static const FsBenchOps fx_ops = {
+	fx_format, fx_mount, fx_unmount, fx_mkdir, fx_open, fx_close,
+	fx_seek, fx_write, fx_read, fx_remove, fx_list
+};
+
+/*-----------------------------------------------------------------------*/
+/* Workloads                                                             */
+/*-----------------------------------------------------------------------*/
+
+static void sample(uint32_t ticks)
+{
+	if (nsamples < FS_BENCH_SAMPLES)
+		samples[nsamples++] = ticks;
+}
+
+static int compare_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(uint32_t pct)
+{
+	return samples[(nsamples - 1) * pct / 100];
+}
+
+static void small_name(char* path, uint32_t i)
+{
+	sprintf(path, "/bench/f%03lu.dat", (unsigned long)i);
+}
+
+/* Simple LCG, the same offsets are used for both stacks. */
+static uint32_t next_rand(uint32_t* seed)
+{
+	*seed = *seed * 1103515245u + 12345u;
+	return *seed >> 8;
+}
+
+static int run_workload(const FsBenchOps* ops, const FsBenchConfig* cfg, FsBenchWorkload w, FsBenchResult* r)
+{
+	char path[32];
+	uint32_t i, t, n, seed = 1;
+	int error = 0;
+
+	switch (w)
+	{
+	case FS_BENCH_CREATE:
+		for (i = 0; i < cfg->small_files && !error; i++)
+		{
+			small_name(path, i);
+			t = cfg->clock();
+			error = ops->open(path, 1);
+			if (!error)
+			{
+				error = ops->write(bench_buf, cfg->small_size);
+				ops->close();
+			}
+			sample(cfg->clock() - t);
+			r->bytes += cfg->small_size;
+		}
+		break;
+
+	case FS_BENCH_LIST:
+		for (i = 0; i < cfg->lists && !error; i++)
+		{
+			t = cfg->clock();
+			error = ops->list("/bench", &n);
+			sample(cfg->clock() - t);
+			if (!error && n < cfg->small_files)
+				error = ENOENT;
+		}
+		break;
+
+	case FS_BENCH_DELETE:
+		for (i = 0; i < cfg->small_files && !error; i++)
+		{
+			small_name(path, i);
+			t = cfg->clock();
+			error = ops->remove(path);
+			sample(cfg->clock() - t);
+		}
+		break;
+
+	case FS_BENCH_SEQ_WRITE:
+	case FS_BENCH_SEQ_READ:
+		error = ops->open("/bench/large.dat", w == FS_BENCH_SEQ_WRITE);
+		for (i = 0; i < cfg->large_size && !error; i += cfg->chunk)
+		{
+			t = cfg->clock();
+			if (w == FS_BENCH_SEQ_WRITE)
+				error = ops->write(bench_buf, cfg->chunk);
+			else
+				error = ops->read(bench_buf, cfg->chunk);
+			sample(cfg->clock() - t);
+			r->bytes += cfg->chunk;
+		}
+		if (!error)
+			error = ops->close();
+		break;
+
+	case FS_BENCH_OVERWRITE:
+		error = ops->open("/bench/large.dat", 0);
+		for (i = 0; i < cfg->overwrites && !error; i++)
+		{
+			n = next_rand(&seed) % (cfg->large_size - cfg->small_size);
+			t = cfg->clock();
+			error = ops->seek(n);
+			if (!error)
+				error = ops->write(bench_buf, cfg->small_size);
+			sample(cfg->clock() - t);
+			r->bytes += cfg->small_size;
+		}
+		if (!error)
+			error = ops->close();
+		break;
+
+	default:
+		error = EINVAL;
+	}
+
+	r->ops = nsamples;
+	return error;
+}
+
+static int run_all(const FsBenchOps* ops, const FsBenchConfig* cfg, FsBenchReport* rep)
+{
+	flash_stats_t before, after;
+	FsBenchResult* r;
+	uint32_t t;
+	int w, error;
+
+	memset(rep->result, 0, sizeof(rep->result));
+	for (t = 0; t < sizeof(bench_buf); t++)
+		bench_buf[t] = (uint8_t)t;
+
+	if (cfg->chunk == 0 || cfg->chunk > FS_BENCH_MAX_CHUNK ||
+		cfg->small_size > FS_BENCH_MAX_CHUNK || cfg->large_size <= cfg->small_size)
+		return EINVAL;
+
+	error = ops->format(cfg);
+	if (!error)
+		error = ops->mount(cfg);
+	if (!error)
+		error = ops->mkdir("/bench");
+	if (error)
+		return error;
+
+	for (w = 0; w < FS_BENCH_COUNT; w++)
+	{
+		r = &rep->result[w];
+		nsamples = 0;
+		fx_flash_get_stats(&before);
+		t = cfg->clock();
+
+		r->error = run_workload(ops, cfg, (FsBenchWorkload)w, r);
+		if (ops == &fx_ops && !r->error)
+			r->error = fx_sync();
+
+		r->ticks = cfg->clock() - t;
+		fx_flash_get_stats(&after);
+		r->flash.reads = after.reads - before.reads;
+		r->flash.read_bytes = after.read_bytes - before.read_bytes;
+		r->flash.programs = after.programs - before.programs;
+		r->flash.erases = after.erases - before.erases;
+		r->flash.block_erases = after.block_erases - before.block_erases;
+
+		if (nsamples)
+		{
+			qsort(samples, nsamples, sizeof(samples[0]), compare_u32);
+			r->p50 = percentile(50);
+			r->p90 = percentile(90);
+			r->p99 = percentile(99);
+			r->max = samples[nsamples - 1];
+		}
+		if (r->error && !error)
+			error = r->error;
+	}
+
+	ops->unmount();
+	return error;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Public interface                                                      */
+/*-----------------------------------------------------------------------*/
+
+void fs_bench_default_config(FsBenchConfig* cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->small_files = 32;
+	cfg->small_size = 512;
+	cfg->large_size = 256 * 1024;
+	cfg->chunk = 4096;
+	cfg->lists = 8;
+	cfg->overwrites = 64;
+}
+
+int fs_bench_run_chan(const FsBenchConfig* cfg, FsBenchReport* rep)
+{
+	rep->name = "ChaN FatFs";
+	/* Objects used by the benchmark, LFN buffer and FATFS_FLASH sector cache. */
+	rep->ram_static = sizeof(FATFS) + sizeof(FIL) + sizeof(DIR) + SPI_FLASH_SEC_SIZE;
+#if _USE_LFN == 1
+	rep->ram_static += (_MAX_LFN + 1) * sizeof(WCHAR);
+#endif
+	rep->ram_heap = 0;
+	return run_all(&chan_ops, cfg, rep);
+}
+
+int fs_bench_run_eremex(const FsBenchConfig* cfg, FsBenchReport* rep)
+{
+	int error;
+
+	if (!cfg->media)
+		return EINVAL;
+
+	rep->name = "Eremex FAT";
+	rep->ram_static = sizeof(fs_vol_t) + sizeof(fs_file_t) + sizeof(fs_dir_t);
+	error = run_all(&fx_ops, cfg, rep);
+	rep->ram_heap = fx_heap;
+	return error;
+}
+
+void fs_bench_print(const FsBenchConfig* cfg, const FsBenchReport* rep)
+{
+	const FsBenchResult* r;
+	uint32_t kbps;
+	int w;
+
+	printf("\r\n=== %s: RAM static %lu, heap %lu bytes ===\r\n", rep->name,
+	       (unsigned long)rep->ram_static, (unsigned long)rep->ram_heap);
+	printf("%-10s %5s %8s %8s %6s %6s %6s %6s %7s %7s %7s\r\n", "workload", "ops", "ticks",
+	       "KB/s", "p50", "p90", "p99", "max", "reads", "progs", "erases");
+
+	for (w = 0; w < FS_BENCH_COUNT; w++)
+	{
+		r = &rep->result[w];
+		kbps = r->ticks ? (uint32_t)((uint64_t)r->bytes * cfg->clock_hz / r->ticks / 1024) : 0;
+		printf("%-10s %5lu %8lu %8lu %6lu %6lu %6lu %6lu %7lu %7lu %7lu", workload_names[w],
+		       (unsigned long)r->ops, (unsigned long)r->ticks, (unsigned long)kbps,
+		       (unsigned long)r->p50, (unsigned long)r->p90, (unsigned long)r->p99,
+		       (unsigned long)r->max, (unsigned long)r->flash.reads,
+		       (unsigned long)r->flash.programs, (unsigned long)r->flash.erases);
+		if (r->error)
+			printf(" error %d", r->error);
+		printf("\r\n");
+	}
+	printf("latency in ticks, %lu ticks per second\r\n", (unsigned long)cfg->clock_hz);
+}
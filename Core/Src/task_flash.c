@@ -1,6 +1,10 @@
 #include <fs_data.h>
 #include "task_flash.h"
 #include "../../FATFS/App/fatfs.h"
+#ifdef FS_BENCH
+#include "fs_bench.h"
+#include "../../Middleware/FATFS_FLASH/FATFS_FLASH.h"
+#endif
 
 extern SPI_HandleTypeDef hspi1;
 fx_mutex_t mutex1;
@@ -28,7 +32,7 @@ void Task_Flash_Init()
 	static fx_thread_t task_flash;
 	static int stack_flash[8192*8 / sizeof(int)];
 
-	fx_mutex_init(&mutex1, FX_MUTEX_CEILING_DISABLED, FX_SYNC_POLICY_DEFAULT);
+	fx_mutex_init(&mutex1, FX_MUTEX_CEILING_DISABLED, FX_SYNC_POLICY_PRIO);
 
 	fx_thread_init(&task_flash, Task_Flash_Func, NULL, 10, (void*)stack_flash, sizeof(stack_flash), false);
 }
@@ -175,19 +179,53 @@ HAL_StatusTypeDef Flash_ChipErase(void) {
     // Ожидаем завершения операции стирания
     return Flash_WaitForWriteEnd();
 }
+/*
+ * FS may access the flash without holding the volume lock (file data reads),
+ * so SPI transactions are serialized by mutex1.
+ */
 int fx_read(struct _fs_media_t* m, void* buf, uint32_t* size, uint32_t blkno)
 {
-	return fx_flash_read(buf, size, blkno);
+	int error;
+
+	fx_mutex_acquire(&mutex1, NULL);
+	error = fx_flash_read(buf, size, blkno);
+	fx_mutex_release(&mutex1);
+	return error;
 }
 int fx_write(struct _fs_media_t* m, void* buf, uint32_t* size, uint32_t blkno)
 {
-	return fx_flash_write(buf, size, blkno);
+	int error;
+
+	fx_mutex_acquire(&mutex1, NULL);
+	error = fx_flash_write(buf, size, blkno);
+	fx_mutex_release(&mutex1);
+	return error;
 }
 int fx_erase(struct _fs_media_t* m, void* buf, uint32_t* size, uint32_t blkno)
 {
+	fx_mutex_acquire(&mutex1, NULL);
 	fx_spi_Erase_Sector(blkno);
+	fx_mutex_release(&mutex1);
 	return 0;
 }
+int fx_erase_range(struct _fs_media_t* m, uint32_t blkno, uint32_t count)
+{
+	int error;
+
+	fx_mutex_acquire(&mutex1, NULL);
+	error = fx_flash_erase_range(blkno, count);
+	fx_mutex_release(&mutex1);
+	return error;
+}
+int fx_program(struct _fs_media_t* m, void* buf, uint32_t* size, uint32_t blkno)
+{
+	int error;
+
+	fx_mutex_acquire(&mutex1, NULL);
+	error = fx_flash_program(buf, size, blkno);
+	fx_mutex_release(&mutex1);
+	return error;
+}
 
 /*old version with eremex fs
  * */
@@ -224,6 +262,9 @@ int fx_erase(struct _fs_media_t* m, void* buf, uint32_t* size, uint32_t blkno)
 //    m.read = fx_read;
 //    m.write = fx_write;
 //    m.sector_erase=fx_erase;
+//    m.erase_range = fx_erase_range;
+//    m.program = fx_program;
+//    fs_media_init(&m);
 //    volume.media = &m;
 ////////////////////////////////////////////////////////////////////////////////
 ////  fx_init_spi_flash(read_spi, write_spi, rw_spi, cs_en, cs_dis);
@@ -404,6 +445,47 @@ int fx_erase(struct _fs_media_t* m, void* buf, uint32_t* size, uint32_t blkno)
 //  }
 //}
 
+#ifdef FS_BENCH
+#ifndef FS_BENCH_TICK_HZ
+#define FS_BENCH_TICK_HZ	1000	// FX-RTOS tick rate
+#endif
+
+/*
+ * Run the same workloads on Eremex FAT and ChaN FatFs over the flash.
+ * All data on the flash is lost. ChaN FatFs runs last, so its volume
+ * is left on the flash and the normal mount below succeeds.
+ */
+static void Flash_Bench(void)
+{
+	static FsBenchReport report;
+	FsBenchConfig cfg;
+	int error;
+
+	m.read = fx_read;
+	m.write = fx_write;
+	m.sector_erase = fx_erase;
+	m.erase_range = fx_erase_range;
+	m.program = fx_program;
+	fs_media_init(&m);
+
+	fs_bench_default_config(&cfg);
+	cfg.clock = fx_timer_get_tick_count;
+	cfg.clock_hz = FS_BENCH_TICK_HZ;
+	cfg.media = &m;
+	cfg.media_sectors = FLASH_SECTOR_COUNT * FLASH_SECTOR_SIZE / SEC_SIZE;
+
+	error = fs_bench_run_eremex(&cfg, &report);
+	fs_bench_print(&cfg, &report);
+	if (error)
+		printf("Eremex FAT benchmark failed: %d\r\n", error);
+
+	error = fs_bench_run_chan(&cfg, &report);
+	fs_bench_print(&cfg, &report);
+	if (error)
+		printf("ChaN FatFs benchmark failed: %d\r\n", error);
+}
+#endif
+
 // Замените функцию Task_Flash_Func() в вашем task_flash.c на эту версию:
 
 void Task_Flash_Func()
@@ -424,6 +506,10 @@ void Task_Flash_Func()
 	printf("Flash Info - MFR: 0x%02X, DEV: 0x%02X, MEM: 0x%02X, CAP: 0x%02X\r\n",
 	       fi.mfr_id, fi.dev_id, fi.mem_type, fi.capacity);
 
+#ifdef FS_BENCH
+	Flash_Bench();
+#endif
+
 	// Опционально: форматирование flash (раскомментируйте если нужно отформатировать)
 	// ВНИМАНИЕ: это сотрет все данные!
 	/*
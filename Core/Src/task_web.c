@@ -10,7 +10,24 @@
 
 #define DHCP_SOCKET     0
 #define DNS_SOCKET      1
-#define HTTP_SOCKET     2
+#define HTTP_SOCKET     2	// first HTTP socket, the rest follow it
+
+// Number of listening HTTP sockets, up to all sockets left after DHCP and DNS.
+// The state of a socket (st_http_socket, about 710 B) has no FIL. It is kept for
+// all _WIZCHIP_SOCK_NUM_ sockets, about 5.7 KB, whatever the count. Downloads,
+// listings and uploads take their FIL or DIR from the pool of HTTP_FILE_POOL_SIZE
+// contexts (http_file_ctx, about 580 B each, 2.3 KB for 4), see httpServer.h.
+#ifndef HTTP_SOCKET_COUNT
+#define HTTP_SOCKET_COUNT	4
+#endif
+
+#ifndef HTTP_TICK_HZ
+#define HTTP_TICK_HZ	1000	// FX-RTOS tick rate
+#endif
+
+#if HTTP_SOCKET_COUNT < 1 || HTTP_SOCKET_COUNT > _WIZCHIP_SOCK_NUM_ - HTTP_SOCKET
+#error "HTTP_SOCKET_COUNT must be from 1 to _WIZCHIP_SOCK_NUM_ - HTTP_SOCKET"
+#endif
 
 extern SPI_HandleTypeDef hspi2;
 #define W5500_SPI hspi2
@@ -26,7 +43,7 @@ extern SPI_HandleTypeDef hspi2;
 //
 //uint8_t rx_tx_buff_sizes[] = {2, 2, 2, 2, 2, 2, 2, 2};
 //
-uint8_t http_server_socket_list[] = {2, 3, 4, 5};
+uint8_t http_server_socket_list[HTTP_SOCKET_COUNT];
 //
 uint8_t http_server_tx_buf[4096];
 uint8_t http_server_rx_buf[4096];
@@ -177,18 +194,20 @@ const char* http_explorer_page =
 "const fileList=document.getElementById('file-list');"
 "fileList.innerHTML='';"
 "document.getElementById('current-path').textContent=path;"
-"if(data.folders.length===0&&data.files.length===0){"
+"const folders=data.entries.filter(e=>e.dir).map(e=>e.name);"
+"const files=data.entries.filter(e=>!e.dir).map(e=>e.name);"
+"if(folders.length===0&&files.length===0){"
 "fileList.innerHTML='<tr><td colspan=\"3\" class=\"empty\">Empty folder</td></tr>';"
 "return;"
 "}"
-"data.folders.forEach(folder=>{"
+"folders.forEach(folder=>{"
 "const row=document.createElement('tr');"
 "row.innerHTML=`<td class=\"folder\" onclick=\"navigateTo('${path}${folder}/')\">${folder}</td>"
 "<td>Folder</td>"
 "<td><button class=\"delete-btn\" onclick=\"deleteItem('${path}${folder}',event)\">Delete</button></td>`;"
 "fileList.appendChild(row);"
 "});"
-"data.files.forEach(file=>{"
+"files.forEach(file=>{"
 "const row=document.createElement('tr');"
 "row.innerHTML=`<td>${file}</td>"
 "<td>File</td>"
@@ -425,12 +444,23 @@ void Task_Web_Func()
 
 	uint8_t buffer[2048];
 
-	httpServer_init(http_server_tx_buf, http_server_rx_buf, 4, http_server_socket_list);
+	for(int i = 0; i < HTTP_SOCKET_COUNT; i++)
+		http_server_socket_list[i] = HTTP_SOCKET + i;
+
+	httpServer_init(http_server_tx_buf, http_server_rx_buf, HTTP_SOCKET_COUNT, http_server_socket_list);
 	//reg_httpServer_webContent("upload_file.html", http_upload_page);
 	reg_httpServer_webContent("index.html", http_explorer_page);
+
+	uint32_t http_tick = fx_timer_get_tick_count();
 	while(1){
 		//fx_thread_yield();
-		httpServer_run(http_server_socket_list[0]);
+		// 1 s clock of the server, it times out idle keep-alive connections
+		while(fx_timer_get_tick_count() - http_tick >= HTTP_TICK_HZ)
+		{
+			http_tick += HTTP_TICK_HZ;
+			httpServer_time_handler();
+		}
+		httpServer_run_all();
 	}
 
 }
@@ -0,0 +1,389 @@
+/*
+ * Host (Linux) doubles of the W5500 TCP sockets and of FatFs over RAM files.
+ *
+ * A socket keeps what the peer sent and what the server sent in two flat
+ * buffers. Sent data is taken by the peer at once: SENDOK is always set
+ * and the TX buffer is always free.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../../../../Wiznet/Ethernet/socket.h"
+#include "../../../../Wiznet/Ethernet/wizchip_conf.h"
+#include "ff.h"
+#include "http_host.h"
+
+typedef struct
+{
+	uint8_t		sr;
+	uint8_t		ir;
+	uint16_t	rx_rd;
+	uint16_t	rx_len;
+	uint32_t	tx_len;
+	uint8_t		rx[HOST_SOCK_BUF];
+	char		tx[HOST_SOCK_BUF];
+}host_sock;
+
+typedef struct
+{
+	char		path[64];
+	uint8_t		used;
+	uint32_t	size;
+	uint8_t		data[HOST_FILE_SIZE];
+}host_file;
+
+static host_sock Host_Sock[_WIZCHIP_SOCK_NUM_];
+static host_file Host_File[HOST_FILE_MAX];
+static uint16_t Host_Stamp = 1;
+
+/*****************************************************************************
+ * Test side
+ ****************************************************************************/
+void host_sock_connect(uint8_t sn)
+{
+	memset(&Host_Sock[sn], 0, sizeof(Host_Sock[sn]));
+	Host_Sock[sn].sr = SOCK_ESTABLISHED;
+	Host_Sock[sn].ir = Sn_IR_CON;
+}
+
+void host_sock_input(uint8_t sn, const char * data, uint16_t len)
+{
+	if(Host_Sock[sn].rx_len + len > HOST_SOCK_BUF) len = HOST_SOCK_BUF - Host_Sock[sn].rx_len;
+	memcpy(Host_Sock[sn].rx + Host_Sock[sn].rx_len, data, len);
+	Host_Sock[sn].rx_len += len;
+}
+
+void host_sock_peer_close(uint8_t sn)
+{
+	if(Host_Sock[sn].sr == SOCK_ESTABLISHED) Host_Sock[sn].sr = SOCK_CLOSE_WAIT;
+}
+
+uint8_t host_sock_state(uint8_t sn)
+{
+	return Host_Sock[sn].sr;
+}
+
+const char * host_sock_output(uint8_t sn, uint32_t * len)
+{
+	*len = Host_Sock[sn].tx_len;
+	Host_Sock[sn].tx[Host_Sock[sn].tx_len < HOST_SOCK_BUF ? Host_Sock[sn].tx_len : HOST_SOCK_BUF - 1] = 0;
+	return Host_Sock[sn].tx;
+}
+
+static host_file * host_file_find(const char * path)
+{
+	uint8_t i;
+
+	for(i = 0; i < HOST_FILE_MAX; i++)
+	{
+		if(Host_File[i].used && !strcmp(Host_File[i].path, path)) return &Host_File[i];
+	}
+	return NULL;
+}
+
+static host_file * host_file_new(const char * path)
+{
+	uint8_t i;
+
+	for(i = 0; i < HOST_FILE_MAX; i++)
+	{
+		if(!Host_File[i].used)
+		{
+			strncpy(Host_File[i].path, path, sizeof(Host_File[i].path) - 1);
+			Host_File[i].used = 1;
+			Host_File[i].size = 0;
+			return &Host_File[i];
+		}
+	}
+	return NULL;
+}
+
+int host_file_put(const char * path, const char * data, uint32_t len)
+{
+	host_file * f = host_file_find(path);
+
+	if(!f) f = host_file_new(path);
+	if(!f || len > HOST_FILE_SIZE) return -1;
+	memcpy(f->data, data, len);
+	f->size = len;
+	Host_Stamp++;
+	return 0;
+}
+
+int host_file_exists(const char * path)
+{
+	return host_file_find(path) != NULL;
+}
+
+/*****************************************************************************
+ * W5500 registers and socket calls
+ ****************************************************************************/
+static host_sock * host_sock_of(uint32_t addr, uint16_t * reg)
+{
+	uint8_t block = (addr >> 3) & 0x1f;
+
+	if((block & 3) != 1) return NULL;
+	*reg = (addr >> 8) & 0xffff;
+	return &Host_Sock[block >> 2];
+}
+
+uint8_t WIZCHIP_READ(uint32_t AddrSel)
+{
+	uint16_t reg;
+	host_sock * hs = host_sock_of(AddrSel, &reg);
+
+	if(!hs) return 0;
+	switch(reg)
+	{
+		case 0x0002: return hs->ir | Sn_IR_SENDOK;
+		case 0x0003: return hs->sr;
+		case 0x001E:
+		case 0x001F: return 16;			// KB of RX and TX buffer
+		case 0x0028: return hs->rx_rd >> 8;
+		case 0x0029: return hs->rx_rd & 0xff;
+		default: return 0;
+	}
+}
+
+void WIZCHIP_WRITE(uint32_t AddrSel, uint8_t wb)
+{
+	uint16_t reg;
+	host_sock * hs = host_sock_of(AddrSel, &reg);
+
+	if(!hs) return;
+	switch(reg)
+	{
+		case 0x0001:
+			if(wb == Sn_CR_DISCON) hs->sr = SOCK_CLOSED;
+			break;
+		case 0x0002: hs->ir &= ~wb; break;
+		case 0x0028: hs->rx_rd = (hs->rx_rd & 0x00ff) | ((uint16_t)wb << 8); break;
+		case 0x0029: hs->rx_rd = (hs->rx_rd & 0xff00) | wb; break;
+		default: break;
+	}
+}
+
+void WIZCHIP_READ_BUF(uint32_t AddrSel, uint8_t * pBuf, uint16_t len)
+{
+	memset(pBuf, 0, len);
+}
+
+uint16_t getSn_RX_RSR(uint8_t sn)
+{
+	return Host_Sock[sn].rx_len - Host_Sock[sn].rx_rd;
+}
+
+uint16_t getSn_TX_FSR(uint8_t sn)
+{
+	return 16 << 10;
+}
+
+void wiz_recv_data(uint8_t sn, uint8_t * wizdata, uint16_t len)
+{
+	host_sock * hs = &Host_Sock[sn];
+
+	if(len > hs->rx_len - hs->rx_rd) len = hs->rx_len - hs->rx_rd;
+	memcpy(wizdata, hs->rx + hs->rx_rd, len);
+	hs->rx_rd += len;
+}
+
+void wiz_recv_ignore(uint8_t sn, uint16_t len)
+{
+	host_sock * hs = &Host_Sock[sn];
+
+	if(len > hs->rx_len - hs->rx_rd) len = hs->rx_len - hs->rx_rd;
+	hs->rx_rd += len;
+}
+
+int8_t socket(uint8_t sn, uint8_t protocol, uint16_t port, uint8_t flag)
+{
+	Host_Sock[sn].sr = SOCK_INIT;
+	return sn;
+}
+
+int8_t close(uint8_t sn)
+{
+	Host_Sock[sn].sr = SOCK_CLOSED;
+	return SOCK_OK;
+}
+
+int8_t listen(uint8_t sn)
+{
+	Host_Sock[sn].sr = SOCK_LISTEN;
+	return SOCK_OK;
+}
+
+int8_t disconnect(uint8_t sn)
+{
+	Host_Sock[sn].sr = SOCK_CLOSED;
+	return SOCK_OK;
+}
+
+int32_t send(uint8_t sn, uint8_t * buf, uint16_t len)
+{
+	host_sock * hs = &Host_Sock[sn];
+
+	if(hs->sr != SOCK_ESTABLISHED && hs->sr != SOCK_CLOSE_WAIT) return SOCKERR_SOCKSTATUS;
+	if(hs->tx_len + len >= HOST_SOCK_BUF) len = HOST_SOCK_BUF - 1 - hs->tx_len;
+	memcpy(hs->tx + hs->tx_len, buf, len);
+	hs->tx_len += len;
+	return len;
+}
+
+int32_t recv(uint8_t sn, uint8_t * buf, uint16_t len)
+{
+	host_sock * hs = &Host_Sock[sn];
+
+	if(len > hs->rx_len - hs->rx_rd) len = hs->rx_len - hs->rx_rd;
+	wiz_recv_data(sn, buf, len);
+	return len;
+}
+
+/*****************************************************************************
+ * FatFs over RAM files, one flat directory
+ ****************************************************************************/
+FRESULT f_open(FIL * fp, const TCHAR * path, BYTE mode)
+{
+	host_file * f = host_file_find(path);
+
+	if(!f)
+	{
+		if(!(mode & (FA_CREATE_ALWAYS | FA_OPEN_ALWAYS | FA_CREATE_NEW))) return FR_NO_FILE;
+		if(!(f = host_file_new(path))) return FR_DENIED;
+	}
+	else if(mode & FA_CREATE_NEW) return FR_EXIST;
+	else if(mode & FA_CREATE_ALWAYS) f->size = 0;
+
+	memset(fp, 0, sizeof(*fp));
+	fp->obj.sclust = (DWORD)(f - Host_File) + 1;
+	fp->obj.objsize = f->size;
+	fp->flag = mode;
+	return FR_OK;
+}
+
+static host_file * host_file_of(FIL * fp)
+{
+	if(!fp->obj.sclust || fp->obj.sclust > HOST_FILE_MAX) return NULL;
+	return &Host_File[fp->obj.sclust - 1];
+}
+
+FRESULT f_close(FIL * fp)
+{
+	if(!host_file_of(fp)) return FR_INVALID_OBJECT;
+	fp->obj.sclust = 0;
+	return FR_OK;
+}
+
+FRESULT f_read(FIL * fp, void * buff, UINT btr, UINT * br)
+{
+	host_file * f = host_file_of(fp);
+
+	*br = 0;
+	if(!f) return FR_INVALID_OBJECT;
+	if(fp->fptr >= f->size) return FR_OK;
+	if(btr > f->size - fp->fptr) btr = f->size - fp->fptr;
+	memcpy(buff, f->data + fp->fptr, btr);
+	fp->fptr += btr;
+	*br = btr;
+	return FR_OK;
+}
+
+FRESULT f_write(FIL * fp, const void * buff, UINT btw, UINT * bw)
+{
+	host_file * f = host_file_of(fp);
+
+	*bw = 0;
+	if(!f) return FR_INVALID_OBJECT;
+	if(fp->fptr + btw > HOST_FILE_SIZE) return FR_DENIED;
+	memcpy(f->data + fp->fptr, buff, btw);
+	fp->fptr += btw;
+	if(fp->fptr > f->size) f->size = fp->fptr;
+	fp->obj.objsize = f->size;
+	*bw = btw;
+	Host_Stamp++;
+	return FR_OK;
+}
+
+FRESULT f_lseek(FIL * fp, FSIZE_t ofs)
+{
+	host_file * f = host_file_of(fp);
+
+	if(!f) return FR_INVALID_OBJECT;
+	fp->fptr = (ofs > f->size) ? f->size : ofs;
+	return FR_OK;
+}
+
+FRESULT f_sync(FIL * fp)
+{
+	return host_file_of(fp) ? FR_OK : FR_INVALID_OBJECT;
+}
+
+FRESULT f_stat(const TCHAR * path, FILINFO * fno)
+{
+	host_file * f = host_file_find(path);
+
+	if(!f)
+	{
+		// Directories are not kept, the root and the upload folder always exist
+		if(!strcmp(path, "/") || !strchr(path + 1, '.'))
+		{
+			if(fno)
+			{
+				memset(fno, 0, sizeof(*fno));
+				fno->fattrib = AM_DIR;
+			}
+			return FR_OK;
+		}
+		return FR_NO_FILE;
+	}
+	if(fno)
+	{
+		memset(fno, 0, sizeof(*fno));
+		fno->fsize = f->size;
+		fno->fdate = 0x5021;
+		fno->ftime = Host_Stamp;
+		strncpy(fno->fname, strrchr(f->path, '/') + 1, sizeof(fno->fname) - 1);
+	}
+	return FR_OK;
+}
+
+FRESULT f_unlink(const TCHAR * path)
+{
+	host_file * f = host_file_find(path);
+
+	if(!f) return FR_NO_FILE;
+	f->used = 0;
+	Host_Stamp++;
+	return FR_OK;
+}
+
+FRESULT f_mkdir(const TCHAR * path)
+{
+	return FR_OK;
+}
+
+FRESULT f_opendir(DIR * dp, const TCHAR * path)
+{
+	memset(dp, 0, sizeof(*dp));
+	return FR_OK;
+}
+
+FRESULT f_closedir(DIR * dp)
+{
+	return FR_OK;
+}
+
+FRESULT f_readdir(DIR * dp, FILINFO * fno)
+{
+	// Entries are given by their index in the file table
+	while(dp->dptr < HOST_FILE_MAX && !Host_File[dp->dptr].used) dp->dptr++;
+	if(dp->dptr >= HOST_FILE_MAX)
+	{
+		fno->fname[0] = 0;
+		return FR_OK;
+	}
+	f_stat(Host_File[dp->dptr].path, fno);
+	dp->dptr++;
+	return FR_OK;
+}
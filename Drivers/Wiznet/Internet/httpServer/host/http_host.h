@@ -0,0 +1,24 @@
+/*
+ * Host (Linux) doubles of the W5500 TCP sockets and of FatFs over RAM
+ * files, enough to run httpServer.c with its parser and CGI handlers.
+ */
+
+#ifndef _HTTP_HOST_H_
+#define _HTTP_HOST_H_
+
+#include <stdint.h>
+
+#define HOST_SOCK_BUF		16384		// Bytes a peer sends or receives per connection
+#define HOST_FILE_MAX		8
+#define HOST_FILE_SIZE		16384
+
+void host_sock_connect(uint8_t sn);
+void host_sock_input(uint8_t sn, const char * data, uint16_t len);
+void host_sock_peer_close(uint8_t sn);
+uint8_t host_sock_state(uint8_t sn);
+const char * host_sock_output(uint8_t sn, uint32_t * len);
+
+int host_file_put(const char * path, const char * data, uint32_t len);
+int host_file_exists(const char * path);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * Request sequences run through httpServer_run_all() over the host socket
+ * and file doubles. Each case connects sockets, feeds requests and checks
+ * the responses as a client would parse them.
+ *
+ *   ./http_test        run all cases, exit status 1 on the first failure
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "../httpServer.h"
+#include "http_host.h"
+
+#define TEST_SOCKS		(HTTP_FILE_POOL_SIZE + 1)
+#define TEST_PASSES		64		// State machine steps for a request to be answered
+
+static uint8_t test_tx_buf[4096];
+static uint8_t test_rx_buf[4096];
+static uint8_t test_socklist[TEST_SOCKS];
+
+static const char test_page[] = "<html><body>host test page</body></html>";
+
+typedef struct
+{
+	int			status;
+	long		length;			// Content-Length, -1 if none
+	const char	* body;
+	uint32_t	next;			// Offset of the next response
+}test_response;
+
+#define CHECK(cond) do { if(!(cond)) { \
+	printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); exit(1); } } while(0)
+
+static void test_run(uint32_t passes)
+{
+	while(passes--) httpServer_run_all();
+}
+
+static void test_send(uint8_t sn, const char * req)
+{
+	host_sock_input(sn, req, strlen(req));
+	test_run(TEST_PASSES);
+}
+
+/*
+ * Parse the response at offset pos of what the server sent. A HEAD response
+ * ends with its header, the Content-Length is the one of the GET response.
+ */
+static void test_response_at(uint8_t sn, uint32_t pos, uint8_t head, test_response * res)
+{
+	uint32_t len;
+	const char * out = host_sock_output(sn, &len);
+	const char * start = out + pos;
+	const char * end;
+	const char * cl;
+
+	CHECK(pos < len);
+	CHECK(!strncmp(start, "HTTP/1.1 ", 9));
+	end = strstr(start, "\r\n\r\n");
+	CHECK(end != NULL);
+	end += 4;
+
+	res->status = atoi(start + 9);
+	res->length = -1;
+	for(cl = start; cl && cl < end; cl = strstr(cl, "\r\n"))
+	{
+		cl += 2;
+		if(!strncasecmp(cl, "Content-Length:", 15)) res->length = atol(cl + 15);
+	}
+	res->body = end;
+	res->next = (uint32_t)(end - out) + ((head || res->length < 0) ? 0 : res->length);
+	CHECK(res->next <= len);
+}
+
+static void test_connect(uint8_t sn)
+{
+	host_sock_connect(sn);
+	test_run(1);
+}
+
+/*
+ * HEAD and GET of a stored file, a registered page, a missing file and the
+ * listing on one persistent connection: no body after a HEAD header, the
+ * GET that follows is whole.
+ */
+static void test_head_then_get(void)
+{
+	test_response res;
+	uint32_t len;
+
+	test_connect(0);
+	test_send(0, "HEAD /a.txt HTTP/1.1\r\nHost: t\r\n\r\n");
+	test_send(0, "GET /a.txt HTTP/1.1\r\nHost: t\r\n\r\n");
+	test_send(0, "HEAD /index.html HTTP/1.1\r\nHost: t\r\n\r\n");
+	test_send(0, "GET /index.html HTTP/1.1\r\nHost: t\r\n\r\n");
+	test_send(0, "HEAD /none.txt HTTP/1.1\r\nHost: t\r\n\r\n");
+	test_send(0, "HEAD /list.cgi?path=/ HTTP/1.1\r\nHost: t\r\n\r\n");
+	test_send(0, "GET /a.txt HTTP/1.1\r\nHost: t\r\n\r\n");
+
+	test_response_at(0, 0, 1, &res);
+	CHECK(res.status == 200 && res.length == 5000);
+	test_response_at(0, res.next, 0, &res);
+	CHECK(res.status == 200 && res.length == 5000);
+	CHECK(res.body[0] == 'a' && res.body[4999] == 'a');
+	test_response_at(0, res.next, 1, &res);
+	CHECK(res.status == 200 && res.length == (long)strlen(test_page));
+	test_response_at(0, res.next, 0, &res);
+	CHECK(res.status == 200 && !strncmp(res.body, test_page, strlen(test_page)));
+	test_response_at(0, res.next, 1, &res);
+	CHECK(res.status == 404);
+	test_response_at(0, res.next, 1, &res);
+	CHECK(res.status == 200 && res.length < 0);
+	test_response_at(0, res.next, 0, &res);
+	CHECK(res.status == 200 && res.length == 5000);
+
+	host_sock_output(0, &len);
+	CHECK(res.next == len);
+	CHECK(host_sock_state(0) == SOCK_ESTABLISHED);
+	printf("ok head_then_get\n");
+}
+
+/*
+ * Request head of an upload of name to the /up folder and the start of its
+ * body up to the file data. Returns the length of the head.
+ */
+static int test_upload_head(char * buf, char * part, const char * name, uint32_t data_len)
+{
+	static const char tail[] = "\r\n--XyZ--\r\n";
+	int part_len;
+
+	part_len = sprintf(part,
+		"--XyZ\r\n"
+		"Content-Disposition: form-data; name=\"file\"; filename=\"%s\"\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"\r\n", name);
+	return sprintf(buf,
+		"POST /api/upload.cgi?path=/up HTTP/1.1\r\n"
+		"Host: t\r\n"
+		"Content-Type: multipart/form-data; boundary=XyZ\r\n"
+		"Content-Length: %lu\r\n"
+		"\r\n", (unsigned long)(part_len + data_len + strlen(tail)));
+}
+
+static uint8_t test_retry_after(uint8_t sn)
+{
+	uint32_t len;
+	const char * out = host_sock_output(sn, &len);
+	const char * end = strstr(out, "\r\n\r\n");
+
+	out = strstr(out, "\r\nRetry-After: ");
+	return out && out < end;
+}
+
+/*
+ * Uploads in progress take every file context. Another upload gets the
+ * 503 with Retry-After of the downloads, whether its file part comes with
+ * the request head or after it. The uploads in progress end normally.
+ */
+static void test_upload_busy(void)
+{
+	char head[256], part[256], name[16], path[24];
+	test_response res;
+	uint8_t sn;
+
+	for(sn = 1; sn <= HTTP_FILE_POOL_SIZE; sn++)
+	{
+		sprintf(name, "f%d.bin", sn);
+		test_upload_head(head, part, name, 4);
+		test_connect(sn);
+		test_send(sn, head);
+		test_send(sn, part);
+		sprintf(path, "/up/%s", name);
+		CHECK(host_file_exists(path));
+	}
+
+	test_upload_head(head, part, "busy.bin", 4);
+	strcat(head, part);
+	strcat(head, "data\r\n--XyZ--\r\n");
+	test_connect(0);
+	test_send(0, head);
+	test_response_at(0, 0, 0, &res);
+	CHECK(res.status == 503 && test_retry_after(0));
+	CHECK(!host_file_exists("/up/busy.bin"));
+
+	test_upload_head(head, part, "busy.bin", 4);
+	test_connect(0);
+	test_send(0, head);
+	test_send(0, part);
+	test_send(0, "data\r\n--XyZ--\r\n");
+	test_response_at(0, 0, 0, &res);
+	CHECK(res.status == 503 && test_retry_after(0));
+	CHECK(!host_file_exists("/up/busy.bin"));
+
+	for(sn = 1; sn <= HTTP_FILE_POOL_SIZE; sn++)
+	{
+		test_send(sn, "data\r\n--XyZ--\r\n");
+		test_response_at(sn, 0, 0, &res);
+		CHECK(res.status == 200 && !strncmp(res.body, "OK", 2));
+	}
+	CHECK(host_file_exists("/up/f4.bin"));
+	printf("ok upload_busy\n");
+}
+
+static void test_wait(uint32_t sec)
+{
+	while(sec--)
+	{
+		httpServer_time_handler();
+		test_run(1);
+	}
+}
+
+/*
+ * An upload whose body stops coming is aborted after the idle timeout:
+ * the partial file is removed, the connection closed and the file context
+ * is free again. An upload sending slowly but steadily is not.
+ */
+static void test_upload_stall(void)
+{
+	char head[256], part[256];
+	test_response res;
+
+	test_upload_head(head, part, "stall.bin", 8);
+	test_connect(0);
+	test_send(0, head);
+	test_send(0, part);
+	test_send(0, "data");
+	CHECK(host_file_exists("/up/stall.bin"));
+	test_wait(HTTP_KEEPALIVE_TIMEOUT_SEC - 1);
+	CHECK(host_sock_state(0) == SOCK_ESTABLISHED);
+	test_wait(1);
+	test_run(TEST_PASSES);
+	CHECK(!host_file_exists("/up/stall.bin"));
+	CHECK(host_sock_state(0) != SOCK_ESTABLISHED);
+
+	test_upload_head(head, part, "slow.bin", 8);
+	test_connect(0);
+	test_send(0, head);
+	test_wait(HTTP_KEEPALIVE_TIMEOUT_SEC - 1);
+	test_send(0, part);
+	test_wait(HTTP_KEEPALIVE_TIMEOUT_SEC - 1);
+	test_send(0, "data");
+	test_wait(HTTP_KEEPALIVE_TIMEOUT_SEC - 1);
+	test_send(0, "data\r\n--XyZ--\r\n");
+	test_response_at(0, 0, 0, &res);
+	CHECK(res.status == 200 && !strncmp(res.body, "OK", 2));
+	CHECK(host_file_exists("/up/slow.bin"));
+	printf("ok upload_stall\n");
+}
+
+int main(void)
+{
+	static char data[5000];
+	uint8_t i;
+
+	memset(data, 'a', sizeof(data));
+	host_file_put("/a.txt", data, sizeof(data));
+
+	for(i = 0; i < TEST_SOCKS; i++) test_socklist[i] = i;
+	httpServer_init(test_tx_buf, test_rx_buf, TEST_SOCKS, test_socklist);
+	reg_httpServer_webContent((uint8_t *)"index.html", (uint8_t *)test_page);
+
+	test_head_then_get();
+	test_upload_busy();
+	test_upload_stall();
+	return 0;
+}
@@ -0,0 +1 @@
+/* Host build: no HAL */
@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 #include "../../../Wiznet/Ethernet/socket.h"
 
@@ -127,49 +128,596 @@ void find_http_uri_type(
 }
 
 
+/* Request parser states */
+#define PARSE_METHOD		0
+#define PARSE_URI			1
+#define PARSE_VERSION		2
+#define PARSE_NAME			3
+#define PARSE_VALUE_START	4
+#define PARSE_VALUE			5
+#define PARSE_HEAD_END		6
+#define PARSE_DONE			7
+#define PARSE_ERROR			8
+
+#define MAX_METHOD_SIZE		7
+
+/* Names of the kept header fields in lower case, by HDR_ index */
+static const char * const http_field_name[HDR_COUNT] =
+{
+	"connection",
+	"content-length",
+	"content-type",
+	"range",
+	"if-range",
+	"if-none-match",
+	"transfer-encoding"
+};
+
+static uint8_t parser_fail(st_http_parser * parser, uint16_t status);
+static uint8_t is_http_token(uint8_t c);
+static uint8_t has_http_token(const char * val, uint16_t len, const char * token);
+
+/**
+ @brief	prepare the parser for a new request
+ */
+void http_parser_init(
+	st_http_parser * parser,	/**< parser state */
+	uint16_t max				/**< longest head accepted, bytes */
+	)
+{
+	memset(parser, 0, sizeof(st_http_parser));
+	parser->state = PARSE_METHOD;
+	parser->max = max;
+}
+
+/**
+ @brief	parse next bytes of the request head
+ @return HTTP_PARSE_MORE until the empty line ending the head is parsed,
+		HTTP_PARSE_DONE then, HTTP_PARSE_ERROR with the status set if the
+		request is malformed or too large.
+ @note	parsing stops right after the head, bytes past it are not consumed
+		and parser->pos is the head length.
+ */
+uint8_t http_parser_feed(
+	st_http_parser * parser,	/**< parser state */
+	const uint8_t * data,		/**< bytes following the ones parsed before */
+	uint16_t len				/**< number of them */
+	)
+{
+	uint8_t c, i;
+
+	while(len-- && parser->state < PARSE_DONE)
+	{
+		c = *data++;
+
+		switch(parser->state)
+		{
+			case PARSE_METHOD :
+				if(c == ' ' && parser->len)
+				{
+					parser->method.off = parser->mark;
+					parser->method.len = parser->len;
+					parser->state = PARSE_URI;
+					parser->mark = parser->pos + 1;
+					parser->len = 0;
+				}
+				else if(!parser->len && (c == '\r' || c == '\n')) parser->mark = parser->pos + 1;	// empty lines ahead of the request
+				else if(!is_http_token(c)) return parser_fail(parser, STATUS_BAD_REQ);
+				else if(++parser->len > MAX_METHOD_SIZE) return parser_fail(parser, STATUS_NOT_IMPL);
+				break;
+
+			case PARSE_URI :
+				if(c == ' ' && parser->len)
+				{
+					parser->uri.off = parser->mark;
+					parser->uri.len = parser->len;
+					parser->state = PARSE_VERSION;
+					parser->mark = parser->pos + 1;
+					parser->len = 0;
+				}
+				else if(c <= ' ' || c == 0x7F) return parser_fail(parser, STATUS_BAD_REQ);
+				else if(++parser->len >= MAX_URI_SIZE) return parser_fail(parser, STATUS_URI_TOO_LONG);
+				break;
+
+			case PARSE_VERSION :
+				if(c == '\n')
+				{
+					parser->version.off = parser->mark;
+					parser->version.len = parser->len;
+					parser->state = PARSE_NAME;
+					parser->mark = parser->pos + 1;
+					parser->len = 0;
+					parser->match = (1 << HDR_COUNT) - 1;
+				}
+				else if(c == '\r') break;
+				else if(c <= ' ' || ++parser->len > 8) return parser_fail(parser, STATUS_BAD_REQ);
+				break;
+
+			case PARSE_NAME :
+				if(c == ':' && parser->len)
+				{
+					// A kept field is the one candidate whose whole name was read
+					parser->field_id = HDR_COUNT;
+					for(i = 0; i < HDR_COUNT; i++)
+					{
+						if((parser->match & (1 << i)) && !http_field_name[i][parser->len]) parser->field_id = i;
+					}
+					parser->state = PARSE_VALUE_START;
+				}
+				else if(!parser->len && c == '\r') parser->state = PARSE_HEAD_END;
+				else if(!parser->len && c == '\n') parser->state = PARSE_DONE;
+				else if(!is_http_token(c)) return parser_fail(parser, STATUS_BAD_REQ);
+				else
+				{
+					if(c >= 'A' && c <= 'Z') c += 'a' - 'A';
+					for(i = 0; i < HDR_COUNT; i++)
+					{
+						if((parser->match & (1 << i)) && http_field_name[i][parser->len] != c) parser->match &= ~(1 << i);
+					}
+					parser->len++;
+				}
+				break;
+
+			case PARSE_VALUE_START :
+				if(c == ' ' || c == '\t') break;
+				parser->mark = parser->pos;
+				parser->len = 0;
+				parser->state = PARSE_VALUE;
+				/* no break, the byte starts the value */
+
+			case PARSE_VALUE :
+				if(c == '\n')
+				{
+					if(parser->field_id < HDR_COUNT)
+					{
+						// Repeated lengths would make the body end ambiguous
+						if(parser->field_id == HDR_CONTENT_LENGTH && parser->field[HDR_CONTENT_LENGTH].off)
+							return parser_fail(parser, STATUS_BAD_REQ);
+						parser->field[parser->field_id].off = parser->mark;
+						parser->field[parser->field_id].len = parser->len;
+					}
+					parser->state = PARSE_NAME;
+					parser->mark = parser->pos + 1;
+					parser->len = 0;
+					parser->match = (1 << HDR_COUNT) - 1;
+				}
+				else if(c == '\r' || c == ' ' || c == '\t') break;
+				else if(c < ' ' || c == 0x7F) return parser_fail(parser, STATUS_BAD_REQ);
+				else parser->len = parser->pos - parser->mark + 1;	// trailing blanks are not counted
+				break;
+
+			case PARSE_HEAD_END :
+				if(c != '\n') return parser_fail(parser, STATUS_BAD_REQ);
+				parser->state = PARSE_DONE;
+				break;
+		}
+
+		parser->pos++;
+	}
+
+	if(parser->state == PARSE_DONE) return HTTP_PARSE_DONE;
+
+	if(parser->pos >= parser->max)
+	{
+		return parser_fail(parser, (parser->state == PARSE_URI) ? STATUS_URI_TOO_LONG : STATUS_HDR_TOO_LARGE);
+	}
+	return HTTP_PARSE_MORE;
+}
+
+/**
+ @brief	fill the request from a parsed head
+ @return 0 if the request can be served, error response status otherwise
+ */
+uint16_t http_parser_request(
+	st_http_parser * parser,	/**< parser that returned HTTP_PARSE_DONE */
+	const uint8_t * head,		/**< the head, parser offsets are relative to it */
+	st_http_request * request	/**< request to be returned */
+	)
+{
+	const char * val;
+	uint16_t len, i;
+	uint32_t num;
+
+	request->METHOD = METHOD_ERR;
+	request->KEEP_ALIVE = 0;
+	request->CONTENT_LENGTH = 0;
+	request->BODY = 0;
+	request->BODY_LEN = 0;
+	request->BOUNDARY[0] = 0;
+
+	val = (const char *)head + parser->method.off;
+	len = parser->method.len;
+	if(len == 3 && !strncasecmp(val, "GET", 3))			request->METHOD = METHOD_GET;
+	else if(len == 4 && !strncasecmp(val, "HEAD", 4))	request->METHOD = METHOD_HEAD;
+	else if(len == 4 && !strncasecmp(val, "POST", 4))	request->METHOD = METHOD_POST;
+	else return STATUS_NOT_IMPL;
+
+	memcpy(request->URI, head + parser->uri.off, parser->uri.len);
+	request->URI[parser->uri.len] = '\0';
+
+	/* HTTP/1.0 clients always get the connection closed */
+	val = (const char *)head + parser->version.off;
+	if(parser->version.len != 8 || strncmp(val, "HTTP/1.", 7)) return STATUS_BAD_REQ;
+	if(val[7] != '0')
+	{
+		val = (const char *)head + parser->field[HDR_CONNECTION].off;
+		request->KEEP_ALIVE = !has_http_token(val, parser->field[HDR_CONNECTION].len, "close");
+	}
+
+	/* A chunked body can't be told from the next request */
+	if(parser->field[HDR_TRANSFER_ENC].off) return STATUS_NOT_IMPL;
+
+	if(parser->field[HDR_CONTENT_LENGTH].off)
+	{
+		val = (const char *)head + parser->field[HDR_CONTENT_LENGTH].off;
+		len = parser->field[HDR_CONTENT_LENGTH].len;
+		if(!len) return STATUS_BAD_REQ;
+		for(i = 0, num = 0; i < len; i++)
+		{
+			if(val[i] < '0' || val[i] > '9' || num > 429496728UL) return STATUS_BAD_REQ;
+			num = num * 10 + (val[i] - '0');
+		}
+		request->CONTENT_LENGTH = num;
+	}
+
+	/* Content-Type: multipart/form-data; boundary="..." */
+	val = (const char *)head + parser->field[HDR_CONTENT_TYPE].off;
+	len = parser->field[HDR_CONTENT_TYPE].len;
+	for(i = 0; i + 9 <= len; i++)
+	{
+		if(strncasecmp(val + i, "boundary=", 9)) continue;
+
+		val += i + 9;
+		len -= i + 9;
+		if(len && *val == '"')
+		{
+			val++;
+			for(i = 0; i < len - 1 && val[i] != '"'; i++);
+		}
+		else
+		{
+			for(i = 0; i < len && val[i] != ';' && val[i] != ' '; i++);
+		}
+		if(!i || i > MAX_BOUNDARY_SIZE) return STATUS_BAD_REQ;
+		memcpy(request->BOUNDARY, val, i);
+		request->BOUNDARY[i] = '\0';
+		break;
+	}
+
+	return 0;
+}
+
+static uint8_t parser_fail(st_http_parser * parser, uint16_t status)
+{
+	parser->state = PARSE_ERROR;
+	parser->status = status;
+	return HTTP_PARSE_ERROR;
+}
+
+/**
+ @brief	check for a character allowed in methods and field names, RFC 7230 tchar
+ */
+static uint8_t is_http_token(uint8_t c)
+{
+	if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return 1;
+	return (c && strchr("!#$%&'*+-.^_`|~", c)) ? 1 : 0;
+}
+
+/**
+ @brief	find a token in a comma separated field value, case insensitive
+ */
+static uint8_t has_http_token(const char * val, uint16_t len, const char * token)
+{
+	uint16_t tlen = strlen(token);
+	uint16_t i = 0, end;
+
+	while(i < len)
+	{
+		while(i < len && (val[i] == ' ' || val[i] == '\t' || val[i] == ',')) i++;
+		for(end = i; end < len && val[end] != ','; end++);
+		if(end - i >= tlen && !strncasecmp(val + i, token, tlen))
+		{
+			for(i += tlen; i < end && (val[i] == ' ' || val[i] == '\t'); i++);
+			if(i == end) return 1;
+		}
+		i = end;
+	}
+	return 0;
+}
+
+/* Multipart parser states */
+#define MP_S_DATA			0		/* preamble or part data */
+#define MP_S_DELIM			1		/* after a delimiter */
+#define MP_S_DELIM_DASH		2		/* "-" after a delimiter */
+#define MP_S_DELIM_LF		3		/* CR after a delimiter */
+#define MP_S_HEAD			4		/* part headers */
+#define MP_S_HEAD_LF		5		/* CR in part headers */
+#define MP_S_END			6		/* epilogue */
+#define MP_S_ERROR			7
+
+/* Horspool shift table, made for the parser that searched last */
+static uint8_t mp_shift[256];
+static const st_http_multipart * mp_shift_owner;
+
+static uint16_t mp_search(st_http_multipart * mp, const uint8_t * in, uint16_t n);
+static uint8_t mp_release(st_http_multipart * mp, uint8_t cnt, const uint8_t ** span, uint16_t * span_len);
+static uint8_t mp_line_end(st_http_multipart * mp);
+
 /**
- @brief	parse http request from a peer
+ @brief	prepare to parse a multipart body
  */
-void parse_http_request(
-	st_http_request * request, 	/**< request to be returned */
-	uint8_t * buf				/**< pointer to be parsed */
+void http_multipart_init(
+	st_http_multipart * mp,		/**< parser state */
+	const uint8_t * boundary	/**< boundary from Content-Type, up to MAX_BOUNDARY_SIZE */
 	)
 {
-  char * nexttok;
-  nexttok = strtok((char*)buf," ");
-  if(!nexttok)
-  {
-    request->METHOD = METHOD_ERR;
-    return;
-  }
-  if(!strcmp(nexttok, "GET") || !strcmp(nexttok,"get"))
-  {
-    request->METHOD = METHOD_GET;
-    nexttok = strtok(NULL," ");
-
-  }
-  else if (!strcmp(nexttok, "HEAD") || !strcmp(nexttok,"head"))
-  {
-    request->METHOD = METHOD_HEAD;
-    nexttok = strtok(NULL," ");
-
-  }
-  else if (!strcmp(nexttok, "POST") || !strcmp(nexttok,"post"))
-  {
-    nexttok = strtok(NULL,"\0");
-    request->METHOD = METHOD_POST;
-  }
-  else
-  {
-    request->METHOD = METHOD_ERR;
-  }
-
-  if(!nexttok)
-  {
-    request->METHOD = METHOD_ERR;
-    return;
-  }
-  strcpy((char *)request->URI, nexttok);
+	uint8_t len = strlen((const char *)boundary);
+
+	memset(mp, 0, sizeof(st_http_multipart));
+	memcpy(mp->delim, "\r\n--", 4);
+	memcpy(mp->delim + 4, boundary, len);
+	mp->delim_len = len + 4;
+	mp->state = MP_S_DATA;
+
+	/* The first delimiter opens the body, as if a line break was before it */
+	memcpy(mp->keep, "\r\n", 2);
+	mp->keep_len = 2;
+
+	if(mp_shift_owner == mp) mp_shift_owner = 0;
+}
+
+/**
+ @brief	parse next bytes of a multipart body
+ @return MP_DATA with a span of file part data, MP_FILE when the headers
+		of a file part are read (the Content-Disposition line is in mp->head),
+		MP_END at the closing delimiter, MP_MORE when the input is used up,
+		MP_ERROR if the body is malformed.
+ @note	call again until MP_MORE or MP_ERROR. The input is advanced past
+		the parsed bytes. A span stays valid until the next call; data of
+		parts without a filename is skipped, clear mp->file after MP_FILE
+		to skip a file part too.
+ */
+uint8_t http_multipart_feed(
+	st_http_multipart * mp,		/**< parser state */
+	const uint8_t ** data,		/**< input, advanced */
+	uint16_t * len,				/**< input length, decreased */
+	const uint8_t ** span,		/**< data span returned */
+	uint16_t * span_len			/**< its length */
+	)
+{
+	const uint8_t * in;
+	uint16_t n, m, pos, held, need;
+	uint8_t c, i;
+
+	/* Held back bytes passed out by the last call are done with */
+	if(mp->keep_drop)
+	{
+		mp->keep_len -= mp->keep_drop;
+		memmove(mp->keep, mp->keep + mp->keep_drop, mp->keep_len);
+		mp->keep_drop = 0;
+	}
+
+	while(*len && mp->state != MP_S_ERROR)
+	{
+		in = *data;
+		n = *len;
+		m = mp->delim_len;
+
+		if(mp->state == MP_S_DATA && mp->keep_len)
+		{
+			/* Look for a delimiter starting in the held back bytes */
+			for(i = 0; i < mp->keep_len; i++)
+			{
+				held = mp->keep_len - i;
+				need = m - held;
+				if(!memcmp(mp->keep + i, mp->delim, held) &&
+				   !memcmp(in, mp->delim + held, (n < need) ? n : need)) break;
+			}
+
+			if(i == mp->keep_len)
+			{
+				/* None, all of them are data */
+				if(mp_release(mp, i, span, span_len)) return MP_DATA;
+			}
+			else if(n >= need)
+			{
+				*data += need;
+				*len -= need;
+				mp->state = MP_S_DELIM;
+				mp->keep_len = i;
+				if(mp_release(mp, i, span, span_len)) return MP_DATA;
+			}
+			else if(i)
+			{
+				/* Still a delimiter prefix, bytes ahead of it are data */
+				if(mp_release(mp, i, span, span_len)) return MP_DATA;
+			}
+			else
+			{
+				memcpy(mp->keep + mp->keep_len, in, n);
+				mp->keep_len += n;
+				*data += n;
+				*len = 0;
+			}
+			continue;
+		}
+
+		switch(mp->state)
+		{
+			case MP_S_DATA :
+				pos = mp_search(mp, in, n);
+				if(pos < n)
+				{
+					*data += pos + m;
+					*len -= pos + m;
+					mp->state = MP_S_DELIM;
+				}
+				else
+				{
+					/* Hold back a tail which may start a delimiter */
+					for(pos = (n > m - 1) ? n - (m - 1) : 0; pos < n; pos++)
+					{
+						if(in[pos] == '\r' && !memcmp(in + pos, mp->delim, n - pos)) break;
+					}
+					memcpy(mp->keep, in + pos, n - pos);
+					mp->keep_len = n - pos;
+					*data += n;
+					*len = 0;
+				}
+				if(mp->file && pos)
+				{
+					*span = in;
+					*span_len = pos;
+					return MP_DATA;
+				}
+				break;
+
+			case MP_S_END :
+				*data += n;
+				*len = 0;
+				break;
+
+			default :
+				c = *in;
+				(*data)++;
+				(*len)--;
+
+				switch(mp->state)
+				{
+					case MP_S_DELIM :
+						if(c == '-') mp->state = MP_S_DELIM_DASH;
+						else if(c == '\r') mp->state = MP_S_DELIM_LF;
+						else if(c != ' ' && c != '\t') mp->state = MP_S_ERROR;	// not transport padding
+						break;
+
+					case MP_S_DELIM_DASH :
+						if(c != '-')
+						{
+							mp->state = MP_S_ERROR;
+							break;
+						}
+						mp->state = MP_S_END;
+						mp->file = 0;
+						mp->ended = 1;
+						return MP_END;
+
+					case MP_S_DELIM_LF :
+						if(c != '\n')
+						{
+							mp->state = MP_S_ERROR;
+							break;
+						}
+						mp->state = MP_S_HEAD;
+						mp->file = 0;
+						mp->head_len = 0;
+						mp->line_len = 0;
+						break;
+
+					case MP_S_HEAD :
+						if(c == '\r')
+						{
+							mp->state = MP_S_HEAD_LF;
+							break;
+						}
+						if(c == '\n')
+						{
+							if(mp_line_end(mp)) return MP_FILE;
+							break;
+						}
+						if(mp->head_len + mp->line_len < MAX_PART_HEAD_SIZE - 1) mp->head[mp->head_len + mp->line_len] = c;
+						if(mp->line_len < 0xFFFF) mp->line_len++;
+						break;
+
+					case MP_S_HEAD_LF :
+						if(c != '\n')
+						{
+							mp->state = MP_S_ERROR;
+							break;
+						}
+						mp->state = MP_S_HEAD;
+						if(mp_line_end(mp)) return MP_FILE;
+						break;
+				}
+				break;
+		}
+	}
+
+	return (mp->state == MP_S_ERROR) ? MP_ERROR : MP_MORE;
+}
+
+/**
+ @brief	find the delimiter in the input, Boyer-Moore-Horspool
+ @return offset of the delimiter, n if it is not there
+ */
+static uint16_t mp_search(st_http_multipart * mp, const uint8_t * in, uint16_t n)
+{
+	uint16_t m = mp->delim_len;
+	uint16_t pos, j;
+	uint8_t last = mp->delim[m - 1];
+	uint8_t c;
+
+	if(mp_shift_owner != mp)
+	{
+		memset(mp_shift, m, sizeof(mp_shift));
+		for(j = 0; j < m - 1; j++) mp_shift[mp->delim[j]] = m - 1 - j;
+		mp_shift_owner = mp;
+	}
+
+	for(pos = 0; pos + m <= n; pos += mp_shift[c])
+	{
+		c = in[pos + m - 1];
+		if(c != last) continue;
+		for(j = m - 1; j && in[pos + j - 1] == mp->delim[j - 1]; j--);
+		if(!j) return pos;
+	}
+	return n;
+}
+
+/**
+ @brief	the first cnt held back bytes turned out to be data
+ @return 1 if they are passed out as a span, 0 if they are dropped
+ */
+static uint8_t mp_release(st_http_multipart * mp, uint8_t cnt, const uint8_t ** span, uint16_t * span_len)
+{
+	if(!cnt) return 0;
+
+	if(mp->file)
+	{
+		*span = mp->keep;
+		*span_len = cnt;
+		mp->keep_drop = cnt;
+		return 1;
+	}
+	mp->keep_len -= cnt;
+	memmove(mp->keep, mp->keep + cnt, mp->keep_len);
+	return 0;
+}
+
+/**
+ @brief	end of a part header line
+ @return 1 if the headers of a file part are complete
+ */
+static uint8_t mp_line_end(st_http_multipart * mp)
+{
+	uint16_t len = mp->line_len;
+
+	if(!len)
+	{
+		mp->head[mp->head_len] = '\0';
+		mp->state = MP_S_DATA;
+		mp->file = strstr(mp->head, "filename=") ? 1 : 0;
+		return mp->file;
+	}
+
+	/* Only the Content-Disposition line is kept */
+	if(len > MAX_PART_HEAD_SIZE - 1 - mp->head_len) len = MAX_PART_HEAD_SIZE - 1 - mp->head_len;
+	if(len >= 20 && !strncasecmp(mp->head + mp->head_len, "Content-Disposition:", 20))
+	{
+		memmove(mp->head, mp->head + mp->head_len, len);
+		mp->head_len = len;
+	}
+	mp->line_len = 0;
+	return 0;
 }
 
 #ifdef _OLD_
@@ -294,7 +842,7 @@ uint8_t get_http_uri_name(uint8_t * uri, uint8_t * uri_buf)
 	uri_ptr = (uint8_t *)strtok((char *)uri_buf, " ?");
 
 	if(strcmp((char *)uri_ptr,"/")) uri_ptr++;
-	strcpy((char *)uri_buf, (char *)uri_ptr);
+	memmove(uri_buf, uri_ptr, strlen((char *)uri_ptr) + 1);	// The name is in uri_buf already
 
 #ifdef _HTTPPARSER_DEBUG_
 	printf("  uri_name = %s\r\n", uri_buf);
@@ -53,6 +53,7 @@ extern "C" {
 #define		STATUS_CREATED		201
 #define		STATUS_ACCEPTED		202
 #define		STATUS_NO_CONTENT	204
+#define		STATUS_PARTIAL		206
 #define		STATUS_MV_PERM		301
 #define		STATUS_MV_TEMP		302
 #define		STATUS_NOT_MODIF	304
@@ -60,6 +61,9 @@ extern "C" {
 #define		STATUS_UNAUTH		401
 #define		STATUS_FORBIDDEN	403
 #define		STATUS_NOT_FOUND	404
+#define		STATUS_URI_TOO_LONG	414
+#define		STATUS_RANGE_ERR	416
+#define		STATUS_HDR_TOO_LARGE	431
 #define		STATUS_INT_SERR		500
 #define		STATUS_NOT_IMPL		501
 #define		STATUS_BAD_GATEWAY	502
@@ -73,7 +77,7 @@ static const char 	ERROR_REQUEST_PAGE[] = "HTTP/1.1 400 OK\r\nContent-Type: text
 #define HTML_HEADER "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: "
 
 /* Response header for HTML*/
-#define RES_HTMLHEAD_OK	"HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nConnection: keep-alive\r\nContent-Length: "
+#define RES_HTMLHEAD_OK	"HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: "
 
 /* Response head for TEXT */
 #define RES_TEXTHEAD_OK	"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: "
@@ -91,7 +95,7 @@ static const char 	ERROR_REQUEST_PAGE[] = "HTTP/1.1 400 OK\r\nContent-Type: text
 #define RES_FLASHHEAD_OK "HTTP/1.1 200 OK\r\nContent-Type: application/x-shockwave-flash\r\nContent-Length: "
 
 /* Response head for XML */
-#define RES_XMLHEAD_OK "HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\nConnection: keep-alive\r\nContent-Length: "
+#define RES_XMLHEAD_OK "HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\nContent-Length: "
 
 /* Response head for CSS */
 #define RES_CSSHEAD_OK	"HTTP/1.1 200 OK\r\nContent-Type: text/css\r\nContent-Length: "		
@@ -136,16 +140,107 @@ static const char 	ERROR_REQUEST_PAGE[] = "HTTP/1.1 400 OK\r\nContent-Type: text
 //#define MAX_URI_SIZE	1461
 #define MAX_URI_SIZE	512
 
+#define MAX_BOUNDARY_SIZE	70		/**< longest multipart boundary, RFC 2046 */
+
 typedef struct _st_http_request
 {
 	uint8_t	METHOD;						/**< request method(METHOD_GET...). */
 	uint8_t	TYPE;						/**< request type(PTYPE_HTML...).   */
-	uint8_t	URI[MAX_URI_SIZE];			/**< request file name.             */
+	uint8_t	URI[MAX_URI_SIZE];			/**< request target, path and query. */
+	uint8_t	KEEP_ALIVE;					/**< client keeps the connection.   */
+	uint32_t	CONTENT_LENGTH;			/**< body size, 0 if none.          */
+	uint8_t *	BODY;					/**< body bytes received with the head. */
+	uint16_t	BODY_LEN;				/**< number of them.                */
+	uint8_t	BOUNDARY[MAX_BOUNDARY_SIZE + 1];	/**< multipart boundary, empty if none. */
 }st_http_request;
 
+/* Header fields kept by the request parser */
+#define		HDR_CONNECTION		0
+#define		HDR_CONTENT_LENGTH	1
+#define		HDR_CONTENT_TYPE	2
+#define		HDR_RANGE			3
+#define		HDR_IF_RANGE		4
+#define		HDR_IF_NONE_MATCH	5
+#define		HDR_TRANSFER_ENC	6
+#define		HDR_COUNT			7
+
+/* Request parser results */
+#define		HTTP_PARSE_MORE		0		/**< head is not complete yet */
+#define		HTTP_PARSE_DONE		1		/**< head is complete */
+#define		HTTP_PARSE_ERROR	2		/**< request is rejected, see status */
+
+/**
+ @brief 	Part of the request head, offset from the start of the request
+ */
+typedef struct _st_http_field
+{
+	uint16_t	off;					/**< 0 if the part is absent */
+	uint16_t	len;
+}st_http_field;
+
+/**
+ @brief 	Incremental request head parser
+
+ The head is fed as it arrives, every byte once. Only offsets are kept,
+ so the bytes fed before need not stay in memory until the head is
+ complete.
+ */
+typedef struct _st_http_parser
+{
+	uint8_t		state;
+	uint8_t		field_id;				/**< kept header of the current line, HDR_COUNT if none */
+	uint8_t		match;					/**< kept headers the name read so far may be */
+	uint16_t	status;					/**< response status for a rejected request */
+	uint16_t	pos;					/**< bytes parsed */
+	uint16_t	max;					/**< longest head accepted */
+	uint16_t	mark;					/**< start of the current token */
+	uint16_t	len;					/**< length of the current token */
+	st_http_field	method;
+	st_http_field	uri;
+	st_http_field	version;
+	st_http_field	field[HDR_COUNT];
+}st_http_parser;
+
+/* Multipart body parser results */
+#define		MP_MORE				0		/**< input is used up */
+#define		MP_DATA				1		/**< span of part data */
+#define		MP_FILE				2		/**< headers of a file part are read, its data follows */
+#define		MP_END				3		/**< closing delimiter is read */
+#define		MP_ERROR			4		/**< body is malformed */
+
+#define MAX_DELIM_SIZE		(MAX_BOUNDARY_SIZE + 4)	/**< "\r\n--" and the boundary */
+#define MAX_PART_HEAD_SIZE	192		/**< kept Content-Disposition line of a part */
+
+/**
+ @brief 	Streaming multipart/form-data parser
+
+ The body is fed as it is received. The boundary is searched with
+ Boyer-Moore-Horspool; a delimiter prefix at the end of the input is held
+ back and completed by the next input, so delimiters split between
+ segments are found and no byte is scanned twice.
+ */
+typedef struct _st_http_multipart
+{
+	uint8_t		state;
+	uint8_t		file;					/**< data of the current part is passed out */
+	uint8_t		ended;					/**< closing delimiter is read */
+	uint8_t		delim_len;
+	uint8_t		keep_len;				/**< delimiter prefix held back */
+	uint8_t		keep_drop;				/**< held back bytes passed out, to be dropped */
+	uint8_t		head_len;				/**< length of the kept line */
+	uint16_t	line_len;				/**< length of the part header line being read */
+	uint8_t		delim[MAX_DELIM_SIZE];
+	uint8_t		keep[MAX_DELIM_SIZE];
+	char		head[MAX_PART_HEAD_SIZE];	/**< Content-Disposition line, then the line being read */
+}st_http_multipart;
+
 // HTTP Parsing functions
 void unescape_http_url(char * url);								/* convert escape character to ascii */
-void parse_http_request(st_http_request *, uint8_t *);			/* parse request from peer */
+void http_parser_init(st_http_parser * parser, uint16_t max);	/* prepare to parse a new request */
+uint8_t http_parser_feed(st_http_parser * parser, const uint8_t * data, uint16_t len);	/* parse more bytes of the head */
+uint16_t http_parser_request(st_http_parser * parser, const uint8_t * head, st_http_request * request);	/* fill the request from the complete head */
+void http_multipart_init(st_http_multipart * mp, const uint8_t * boundary);	/* prepare to parse a multipart body */
+uint8_t http_multipart_feed(st_http_multipart * mp, const uint8_t ** data, uint16_t * len, const uint8_t ** span, uint16_t * span_len);	/* parse more of the body */
 void find_http_uri_type(uint8_t *, uint8_t *);					/* find MIME type of a file */
 void make_http_response_head(char *, char, uint32_t);			/* make response header */
 uint8_t * get_http_param_value(char* uri, char* param_name);	/* get the user-specific parameter value */
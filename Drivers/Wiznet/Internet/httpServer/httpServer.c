@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <strings.h>
 
 #include "../../../Wiznet/Ethernet/socket.h"
 #include "../../../Wiznet/Ethernet/wizchip_conf.h"
@@ -17,16 +19,39 @@
 	#define DATA_BUF_SIZE		2048
 #endif
 
+#define HTTP_CONN_HEADER_MAX	64		// Room for the Connection and Keep-Alive header lines
+#define HTTP_CACHE_HEADER_MAX	128		// Room for the ETag, Cache-Control and Accept-Ranges lines
+#define HTTP_ETAG_MATCH_MAX		64		// Kept part of If-None-Match and If-Range
+#define HTTP_RANGE_MAX			32		// Kept part of Range
+
+#define HTTP_HASH_INIT			2166136261UL	// FNV-1a offset basis
+
+#define HTTP_CHUNK_HEAD			6		// "XXXX\r\n" ahead of chunk data
+#define HTTP_CHUNK_EXTRA		(HTTP_CHUNK_HEAD + 2 + 5)	// Chunk framing and the last chunk
+#define HTTP_LIST_TAIL_MAX		48		// End of the listing JSON
+#ifdef _USE_SDCARD_
+#define HTTP_LIST_ENTRY_MAX		(2 * sizeof(((FILINFO *)0)->fname) + 80)	// One escaped listing entry
+#endif
+
 /*****************************************************************************
  * Private types/enumerations/variables
  ****************************************************************************/
 uint8_t HTTPSock_Num[_WIZCHIP_SOCK_NUM_] = {0, };
+static uint8_t HTTPSock_Cnt = 0;
 static st_http_request * http_request;
 static st_http_request * parsed_http_request;
 static uint8_t * http_response;
 static uint8_t current_file_is_gzip = 0;
+static uint8_t http_head_only = 0;						// Request is HEAD, the response has no body
+static char http_etag[24];								// ETag of the content being answered
+static char http_if_none_match[HTTP_ETAG_MATCH_MAX];	// of the request being processed
+static char http_if_range[HTTP_ETAG_MATCH_MAX];
+static char http_range[HTTP_RANGE_MAX];
+static uint32_t http_range_first, http_range_last, http_range_size;	// Range being answered
+static char http_cache_lines[HTTP_CACHE_HEADER_MAX];
 
 static uint16_t total_content_cnt = 0;
+static uint8_t total_cache_rule_cnt = 0;
 
 /*****************************************************************************
  * Public types/enumerations/variables
@@ -37,10 +62,30 @@ uint8_t * pHTTP_RX;
 volatile uint32_t httpServer_tick_1s = 0;
 st_http_socket HTTPSock_Status[_WIZCHIP_SOCK_NUM_] = { {STATE_HTTP_IDLE, }, };
 httpServer_webContent web_content[MAX_CONTENT_CALLBACK];
+httpServer_cacheRule cache_rule[MAX_CACHE_RULE];
 
 #ifdef	_USE_SDCARD_
-FIL fs;
-FRESULT fr;
+#if _FS_LOCK && HTTP_FILE_POOL_SIZE >= _FS_LOCK
+#error "_FS_LOCK must leave room above HTTP_FILE_POOL_SIZE for files opened by the handlers"
+#endif
+static http_file_ctx HTTPFile_Pool[HTTP_FILE_POOL_SIZE];
+
+// Content hash of a file, valid while the name, size and time are the same
+typedef struct _http_etag_entry
+{
+	uint32_t	name_hash;
+	uint32_t	size;
+	uint32_t	stamp;
+	uint32_t	hash;
+	uint8_t		valid;
+}http_etag_entry;
+
+static http_etag_entry HTTPEtag_Cache[HTTP_ETAG_CACHE_SIZE];
+static uint8_t HTTPEtag_Next = 0;
+
+// Path hashes of compressible files without a .gz variant
+static uint32_t HTTPGz_Absent[HTTP_GZ_CACHE_SIZE];
+static uint8_t HTTPGz_Next = 0;
 #endif
 
 /*****************************************************************************
@@ -50,10 +95,40 @@ void httpServer_Sockinit(uint8_t cnt, uint8_t * socklist);
 static uint8_t getHTTPSocketNum(uint8_t seqnum);
 static int8_t getHTTPSequenceNum(uint8_t socket);
 static int8_t http_disconnect(uint8_t sn);
+static uint8_t http_send_done(uint8_t sn);
+static void http_rx_peek(uint8_t sn, uint16_t offset, uint8_t * buf, uint16_t len);
+static void http_rx_skip(uint8_t sn, uint16_t len);
+static void http_parser_reset(uint8_t s, uint8_t seqnum);
+static uint8_t http_recv_request(uint8_t s, uint8_t seqnum, uint16_t rx_len);
+static uint16_t make_http_conn_header(uint8_t seqnum, char * buf);
+static void http_add_conn_header(uint8_t seqnum, char * resp);
+static void http_send_text(uint8_t s, uint8_t seqnum, const char * resp);
+#ifdef	_USE_SDCARD_
+static http_file_ctx * http_ctx_get(void);
+static int8_t http_file_open(uint8_t seqnum, char * path, uint32_t * file_len);
+static void http_file_release(uint8_t seqnum);
+static void http_list_open(uint8_t s, uint8_t seqnum, uint8_t * uri);
+static void send_http_response_list(uint8_t s, uint8_t seqnum, uint8_t * buf);
+static uint16_t http_list_entry(char * buf, FILINFO * fno, uint8_t details);
+static uint16_t http_json_escape(char * out, const char * in);
+static uint16_t http_chunk_frame(char * buf, uint16_t data_len);
+static http_etag_entry * http_etag_lookup(uint32_t name_hash, uint32_t size, uint32_t stamp);
+static http_etag_entry * http_etag_store(uint32_t name_hash, uint32_t size, uint32_t stamp, uint32_t hash);
+static uint8_t http_gzip_candidate(const char * path);
+static uint8_t http_gz_absent(uint32_t path_hash);
+static void http_gz_forget(uint32_t path_hash);
+#endif
+static uint32_t http_hash(uint32_t hash, const uint8_t * data, uint32_t len);
+static uint32_t http_path_hash(const char * path, uint16_t len);
+static void http_save_field(st_http_field * field, char * buf, uint16_t size);
+static int8_t http_range_resolve(uint32_t size);
+static uint8_t http_etag_match(const char * etag);
+static void make_http_cache_header(uint8_t * uri_name);
+static void http_insert_header(char * resp, const char * lines);
 
 static void http_process_handler(uint8_t s, st_http_request * p_http_request);
 static void send_http_response_header(uint8_t s, uint8_t content_type, uint32_t body_len, uint16_t http_status);
-static void send_http_response_body(uint8_t s, uint8_t * uri_name, uint8_t * buf, uint32_t start_addr, uint32_t file_len);
+static void send_http_response_body(uint8_t s, uint8_t * uri_name, uint8_t * buf, uint32_t start_addr, uint32_t offset, uint32_t file_len);
 static void send_http_response_cgi(uint8_t s, uint8_t * buf, uint8_t * http_body, uint16_t file_len);
 
 /*****************************************************************************
@@ -68,10 +143,13 @@ void httpServer_Sockinit(uint8_t cnt, uint8_t * socklist)
 {
 	uint8_t i;
 
+	if(cnt > _WIZCHIP_SOCK_NUM_) cnt = _WIZCHIP_SOCK_NUM_;
+
 	for(i = 0; i < cnt; i++)
 	{
 		HTTPSock_Num[i] = socklist[i];
 	}
+	HTTPSock_Cnt = cnt;
 }
 
 static uint8_t getHTTPSocketNum(uint8_t seqnum)
@@ -83,7 +161,7 @@ static int8_t getHTTPSequenceNum(uint8_t socket)
 {
 	uint8_t i;
 
-	for(i = 0; i < _WIZCHIP_SOCK_NUM_; i++)
+	for(i = 0; i < HTTPSock_Cnt; i++)
 		if(HTTPSock_Num[i] == socket) return i;
 
 	return -1;
@@ -106,8 +184,8 @@ void reg_httpServer_cbfunc(void(*mcu_reset)(void), void(*wdt_reset)(void))
 void httpServer_run(uint8_t seqnum)
 {
 	uint8_t s;
+	uint8_t ret;
 	uint16_t len;
-	uint32_t gettime = 0;
 
 #ifdef _HTTPSERVER_DEBUG_
 	uint8_t destip[4] = {0, };
@@ -125,66 +203,90 @@ void httpServer_run(uint8_t seqnum)
 			if(getSn_IR(s) & Sn_IR_CON)
 			{
 				setSn_IR(s, Sn_IR_CON);
+				HTTPSock_Status[seqnum].keep_alive = 0;
+				HTTPSock_Status[seqnum].req_count = 0;
+				HTTPSock_Status[seqnum].idle_since = get_httpServer_timecount();
+				http_parser_reset(s, seqnum);
 			}
 
 			switch(HTTPSock_Status[seqnum].sock_status)
 			{
 
 				case STATE_HTTP_IDLE :
-					if ((len = getSn_RX_RSR(s)) > 0)
-					{
-						if (len > DATA_BUF_SIZE) len = DATA_BUF_SIZE;
-						len = recv(s, (uint8_t *)http_request, len);
+					// Keep-alive: the next response waits for the end of the previous one
+					if(HTTPSock_Status[seqnum].req_count && !http_send_done(s)) break;
 
-						*(((uint8_t *)http_request) + len) = '\0';
+					// Only the bytes arrived since the last pass are parsed
+					len = getSn_RX_RSR(s);
+					if(len > HTTPSock_Status[seqnum].parser.pos) ret = http_recv_request(s, seqnum, len);
+					else ret = HTTP_PARSE_MORE;
 
-						parse_http_request(parsed_http_request, (uint8_t *)http_request);
-
-						if(strlen((char*)parsed_http_request->URI) == 1 &&
-						   parsed_http_request->URI[0] == '/') {
-							strcpy((char*)parsed_http_request->URI, "/index.html");
-							printf("[HTTP] Root requested, serving index.html\r\n");
+					if(ret == HTTP_PARSE_MORE)
+					{
+						// A head must arrive whole within the idle timeout
+						if((get_httpServer_timecount() - HTTPSock_Status[seqnum].idle_since) >= HTTP_KEEPALIVE_TIMEOUT_SEC)
+						{
+#ifdef _HTTPSERVER_DEBUG_
+							printf("> HTTPSocket[%d] : Idle timeout after %d requests, disconnect\r\n", s, HTTPSock_Status[seqnum].req_count);
+#endif
+							http_disconnect(s);
 						}
+						break;
+					}
 
-						#ifdef _HTTPSERVER_DEBUG_
-							getSn_DIPR(s, destip);
-							destport = getSn_DPORT(s);
-						printf("\r\n");
-						printf("> HTTPSocket[%d] : HTTP Request received ", s);
-						printf("from %d.%d.%d.%d : %d\r\n", destip[0], destip[1], destip[2], destip[3], destport);
-#endif
+					HTTPSock_Status[seqnum].req_count++;
+					if(ret == HTTP_PARSE_ERROR)
+					{
 #ifdef _HTTPSERVER_DEBUG_
-						printf("> HTTPSocket[%d] : [State] STATE_HTTP_REQ_DONE\r\n", s);
+						printf("> HTTPSocket[%d] : Request rejected, status %d\r\n", s, HTTPSock_Status[seqnum].parser.status);
 #endif
-						http_process_handler(s, parsed_http_request);
+						send_http_response_header(s, 0, 0, HTTPSock_Status[seqnum].parser.status);
+						http_parser_reset(s, seqnum);
+						HTTPSock_Status[seqnum].sock_status = STATE_HTTP_RES_DONE;
+						break;
+					}
+					http_parser_reset(s, seqnum);
+
+					HTTPSock_Status[seqnum].keep_alive = parsed_http_request->KEEP_ALIVE &&
+						(HTTPSock_Status[seqnum].req_count < HTTP_KEEPALIVE_MAX_REQUESTS);
 
-						if(HTTPSock_Status[seqnum].sock_status == STATE_HTTP_UPLOAD) {
 #ifdef _HTTPSERVER_DEBUG_
-							printf("> HTTPSocket[%d] : [State] Streaming upload started, keeping STATE_HTTP_UPLOAD\r\n", s);
+					getSn_DIPR(s, destip);
+					destport = getSn_DPORT(s);
+					printf("\r\n");
+					printf("> HTTPSocket[%d] : HTTP Request received ", s);
+					printf("from %d.%d.%d.%d : %d\r\n", destip[0], destip[1], destip[2], destip[3], destport);
+					printf("> HTTPSocket[%d] : [State] STATE_HTTP_REQ_DONE\r\n", s);
 #endif
-							break;
-						}
+					http_process_handler(s, parsed_http_request);
 
-						gettime = get_httpServer_timecount();
-						while(getSn_TX_FSR(s) != (getSn_TxMAX(s)))
-						{
-							if((get_httpServer_timecount() - gettime) > 3)
-							{
+					if(HTTPSock_Status[seqnum].sock_status == STATE_HTTP_UPLOAD) {
 #ifdef _HTTPSERVER_DEBUG_
-								printf("> HTTPSocket[%d] : [State] STATE_HTTP_REQ_DONE: TX Buffer clear timeout\r\n", s);
+						printf("> HTTPSocket[%d] : [State] Streaming upload started, keeping STATE_HTTP_UPLOAD\r\n", s);
 #endif
-								break;
-							}
-						}
+						// The body must keep coming, see HTTP_KEEPALIVE_TIMEOUT_SEC
+						HTTPSock_Status[seqnum].idle_since = get_httpServer_timecount();
+						break;
+					}
+
+					// Body left unread would be taken for the next request
+					if(parsed_http_request->BODY_LEN < parsed_http_request->CONTENT_LENGTH) HTTPSock_Status[seqnum].keep_alive = 0;
 
-						if(HTTPSock_Status[seqnum].file_len > 0) HTTPSock_Status[seqnum].sock_status = STATE_HTTP_RES_INPROC;
-						else HTTPSock_Status[seqnum].sock_status = STATE_HTTP_RES_DONE;
+					if(HTTPSock_Status[seqnum].file_len > 0 || HTTPSock_Status[seqnum].storage_type == DIRLIST)
+					{
+						HTTPSock_Status[seqnum].sock_status = STATE_HTTP_RES_INPROC;
 					}
+					else HTTPSock_Status[seqnum].sock_status = STATE_HTTP_RES_DONE;
 					break;
 
 				case STATE_HTTP_RES_INPROC :
-#ifdef _HTTPSERVER_DEBUG_
-					printf("> HTTPSocket[%d] : [State] STATE_HTTP_RES_INPROC\r\n", s);
+#ifdef _USE_SDCARD_
+					if(HTTPSock_Status[seqnum].storage_type == DIRLIST)
+					{
+						send_http_response_list(s, seqnum, http_response);
+						if(HTTPSock_Status[seqnum].storage_type != DIRLIST) HTTPSock_Status[seqnum].sock_status = STATE_HTTP_RES_DONE;
+						break;
+					}
 #endif
 					if(HTTPSock_Status[seqnum].file_len == 0) {
 #ifdef _HTTPSERVER_DEBUG_
@@ -194,125 +296,75 @@ void httpServer_run(uint8_t seqnum)
 						break;
 					}
 
-					send_http_response_body(s, 0, http_response, 0, 0);
+					send_http_response_body(s, 0, http_response, 0, 0, 0);
 
 					if(HTTPSock_Status[seqnum].file_len == 0) HTTPSock_Status[seqnum].sock_status = STATE_HTTP_RES_DONE;
 					break;
 
 				case STATE_HTTP_UPLOAD:
 #ifdef _USE_SDCARD_
-				{
-					if ((len = getSn_RX_RSR(s)) > 0)
+					if ((len = getSn_RX_RSR(s)) == 0)
 					{
-						if (len > DATA_BUF_SIZE - 1) len = DATA_BUF_SIZE - 1;
-
-						len = recv(s, (uint8_t *)http_request, len);
-
-						if (len > 0) {
-#ifdef _HTTPSERVER_DEBUG_
-							printf("> HTTPSocket[%d] : [Upload] Received %d bytes\r\n", s, len);
-#endif
-
-							uint32_t bytes_to_write = len;
-							uint32_t total_received_after = HTTPSock_Status[seqnum].upload_bytes_received + len;
-
-							if (total_received_after >= HTTPSock_Status[seqnum].upload_content_length) {
-								uint32_t remaining = HTTPSock_Status[seqnum].upload_content_length -
-													HTTPSock_Status[seqnum].upload_bytes_received;
-
-								if (remaining < len) {
-									bytes_to_write = remaining;
-#ifdef _HTTPSERVER_DEBUG_
-									printf("> HTTPSocket[%d] : [Upload] Last packet, writing only %lu bytes\r\n",
-										   s, bytes_to_write);
-#endif
-								}
-							}
-
-							if (bytes_to_write > 0) {
-								UINT bytes_written = 0;
-								FRESULT res = f_write(&HTTPSock_Status[seqnum].upload_file,
-													 http_request,
-													 bytes_to_write,
-													 &bytes_written);
-
-								if (res != FR_OK) {
+						// A stalled client must not keep the file context and the partial file
+						if ((get_httpServer_timecount() - HTTPSock_Status[seqnum].idle_since) >= HTTP_KEEPALIVE_TIMEOUT_SEC)
+						{
+							FRESULT abort_result = httpServer_upload_abort(seqnum);
+							HTTPSock_Status[seqnum].upload_bytes_received = 0;
+							HTTPSock_Status[seqnum].upload_bytes_written = 0;
+							HTTPSock_Status[seqnum].upload_content_length = 0;
 #ifdef _HTTPSERVER_DEBUG_
-									printf("> HTTPSocket[%d] : [Upload] ERROR: f_write failed, code %d\r\n", s, res);
+							printf("> HTTPSocket[%d] : [Upload] Idle timeout, partial file removed (result=%d)\r\n", s, abort_result);
 #endif
-									f_close(&HTTPSock_Status[seqnum].upload_file);
-									HTTPSock_Status[seqnum].upload_active = 0;
-
-									const char* error_response = "HTTP/1.1 500 Internal Server Error\r\n"
-																 "Content-Type: text/plain\r\n"
-																 "Content-Length: 12\r\n"
-																 "\r\n"
-																 "WRITE_FAILED";
-									send(s, (uint8_t*)error_response, strlen(error_response));
-
-									HTTPSock_Status[seqnum].sock_status = STATE_HTTP_RES_DONE;
-									break;
-								}
+							// The rest of the body may still come, the connection is closed
+							HTTPSock_Status[seqnum].keep_alive = 0;
+							HTTPSock_Status[seqnum].idle_since = get_httpServer_timecount();
+							HTTPSock_Status[seqnum].sock_status = STATE_HTTP_CLOSING;
+						}
+					}
+					else
+					{
+						char upload_msg[24];
+						char upload_resp[128];
 
-								HTTPSock_Status[seqnum].upload_bytes_written += bytes_written;
-								HTTPSock_Status[seqnum].upload_bytes_received += bytes_to_write;
+						HTTPSock_Status[seqnum].idle_since = get_httpServer_timecount();
+						if (len > DATA_BUF_SIZE - 1) len = DATA_BUF_SIZE - 1;
+						// Bytes past the body belong to the next request
+						if (len > HTTPSock_Status[seqnum].upload_content_length - HTTPSock_Status[seqnum].upload_bytes_received)
+							len = HTTPSock_Status[seqnum].upload_content_length - HTTPSock_Status[seqnum].upload_bytes_received;
 
+						len = recv(s, (uint8_t *)http_request, len);
 #ifdef _HTTPSERVER_DEBUG_
-								printf("> HTTPSocket[%d] : [Upload] Written %u bytes (total: %lu / %lu)\r\n",
-									   s, bytes_written,
-									   HTTPSock_Status[seqnum].upload_bytes_received,
-									   HTTPSock_Status[seqnum].upload_content_length);
-#endif
-							}
-
-							if (HTTPSock_Status[seqnum].upload_bytes_received >=
-								HTTPSock_Status[seqnum].upload_content_length)
-							{
-								// === КРИТИЧНО: Принудительный flush перед закрытием ===
-								FRESULT sync_result = f_sync(&HTTPSock_Status[seqnum].upload_file);
-								if (sync_result != FR_OK) {
-#ifdef _HTTPSERVER_DEBUG_
-									printf("> HTTPSocket[%d] : [Upload] WARNING: f_sync failed (error %d)\r\n", s, sync_result);
+						printf("> HTTPSocket[%d] : [Upload] Received %d bytes\r\n", s, len);
 #endif
-								}
 
-								FRESULT close_result = f_close(&HTTPSock_Status[seqnum].upload_file);
-								HTTPSock_Status[seqnum].upload_active = 0;
-								HTTPSock_Status[seqnum].upload_bytes_received = 0;
-								HTTPSock_Status[seqnum].upload_bytes_written = 0;
-								HTTPSock_Status[seqnum].upload_content_length = 0;
+						ret = http_upload_feed(seqnum, (uint8_t *)http_request, len, upload_msg);
+						if (ret == HTTP_MORE) break;
 
 #ifdef _HTTPSERVER_DEBUG_
-								printf("> HTTPSocket[%d] : [Upload] COMPLETE! Total written: %lu bytes (sync=%d, close=%d)\r\n",
-									   s, HTTPSock_Status[seqnum].upload_bytes_written, sync_result, close_result);
+						printf("> HTTPSocket[%d] : [Upload] %s, written %lu of %lu body bytes\r\n",
+							   s, upload_msg, HTTPSock_Status[seqnum].upload_bytes_written,
+							   HTTPSock_Status[seqnum].upload_content_length);
 #endif
+						// The rest of the body is still coming, it can't be taken for a request
+						if (HTTPSock_Status[seqnum].upload_bytes_received < HTTPSock_Status[seqnum].upload_content_length)
+							HTTPSock_Status[seqnum].keep_alive = 0;
 
-								const char* success_response = "HTTP/1.1 200 OK\r\n"
-															  "Content-Type: text/plain\r\n"
-															  "Content-Length: 2\r\n"
-															  "\r\n"
-															  "OK";
-								send(s, (uint8_t*)success_response, strlen(success_response));
-
-								gettime = get_httpServer_timecount();
-								while(getSn_TX_FSR(s) != getSn_TxMAX(s))
-								{
-									if((get_httpServer_timecount() - gettime) > 3)
-									{
-#ifdef _HTTPSERVER_DEBUG_
-										printf("> HTTPSocket[%d] : [Upload] TX Buffer clear timeout\r\n", s);
-#endif
-										break;
-									}
-								}
-
-								HTTPSock_Status[seqnum].sock_status = STATE_HTTP_RES_DONE;
-							}
+						if (ret == HTTP_BUSY)
+						{
+							// Same answer as a download gets, the client retries later
+							send_http_response_header(s, PTYPE_CGI, 0, STATUS_SERV_UNAVAIL);
 						}
+						else
+						{
+							sprintf(upload_resp, "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n%s",
+									(ret == HTTP_OK) ? "200 OK" : "500 Internal Server Error", strlen(upload_msg), upload_msg);
+							http_send_text(s, seqnum, upload_resp);
+						}
+
+						HTTPSock_Status[seqnum].sock_status = STATE_HTTP_RES_DONE;
 					}
-				}
 #endif
-				break;
+					break;
 
 				case STATE_HTTP_RES_DONE :
 #ifdef _HTTPSERVER_DEBUG_
@@ -326,38 +378,46 @@ void httpServer_run(uint8_t seqnum)
 
 #ifdef _USE_SDCARD_
 					if(HTTPSock_Status[seqnum].upload_active) {
-						FRESULT sync_result = f_sync(&HTTPSock_Status[seqnum].upload_file);
-						FRESULT close_result = f_close(&HTTPSock_Status[seqnum].upload_file);
-						HTTPSock_Status[seqnum].upload_active = 0;
+						FRESULT abort_result = httpServer_upload_abort(seqnum);
 						HTTPSock_Status[seqnum].upload_bytes_received = 0;
 						HTTPSock_Status[seqnum].upload_bytes_written = 0;
 						HTTPSock_Status[seqnum].upload_content_length = 0;
 #ifdef _HTTPSERVER_DEBUG_
-						printf("> HTTPSocket[%d] : [RES_DONE] Upload file synced and closed (sync=%d, close=%d)\r\n",
-							   s, sync_result, close_result);
+						printf("> HTTPSocket[%d] : [RES_DONE] Incomplete upload file removed (result=%d)\r\n",
+							   s, abort_result);
 #endif
 					}
-#endif
 
-#ifdef _HTTPSERVER_DEBUG_
-					printf("> HTTPSocket[%d] : [RES_DONE] Waiting for TX buffer to clear...\r\n", s);
+					http_file_release(seqnum);
 #endif
-					gettime = get_httpServer_timecount();
-					while(getSn_TX_FSR(s) != getSn_TxMAX(s))
+
+					if(HTTPSock_Status[seqnum].keep_alive)
 					{
-						if((get_httpServer_timecount() - gettime) > 3)
-						{
+						// Persistent connection: the response drains while the next request is awaited
+						HTTPSock_Status[seqnum].idle_since = get_httpServer_timecount();
 #ifdef _HTTPSERVER_DEBUG_
-							printf("> HTTPSocket[%d] : [RES_DONE] TX clear timeout (FSR=%d, TxMAX=%d)\r\n",
-								   s, getSn_TX_FSR(s), getSn_TxMAX(s));
+						printf("> HTTPSocket[%d] : [RES_DONE] Keep-alive, %d requests served\r\n", s, HTTPSock_Status[seqnum].req_count);
 #endif
-							break;
-						}
+						break;
 					}
 
+					// The response drains on the next passes, the other sockets are served meanwhile
+					HTTPSock_Status[seqnum].idle_since = get_httpServer_timecount();
+					HTTPSock_Status[seqnum].sock_status = STATE_HTTP_CLOSING;
+#ifdef _HTTPSERVER_DEBUG_
+					printf("> HTTPSocket[%d] : [State] STATE_HTTP_CLOSING\r\n", s);
+#endif
+					break;
+
+				case STATE_HTTP_CLOSING :
+					if(!http_send_done(s) && getSn_TX_FSR(s) != getSn_TxMAX(s))
+					{
+						if((get_httpServer_timecount() - HTTPSock_Status[seqnum].idle_since) <= HTTP_MAX_TIMEOUT_SEC) break;
 #ifdef _HTTPSERVER_DEBUG_
-					printf("> HTTPSocket[%d] : [RES_DONE] TX buffer cleared, calling disconnect\r\n", s);
+						printf("> HTTPSocket[%d] : [CLOSING] TX clear timeout (FSR=%d, TxMAX=%d)\r\n",
+							   s, getSn_TX_FSR(s), getSn_TxMAX(s));
 #endif
+					}
 
 #ifdef _USE_WATCHDOG_
 					HTTPServer_WDT_Reset();
@@ -365,7 +425,7 @@ void httpServer_run(uint8_t seqnum)
 					http_disconnect(s);
 
 #ifdef _HTTPSERVER_DEBUG_
-					printf("> HTTPSocket[%d] : [RES_DONE] Disconnect called, socket status = %d\r\n", s, getSn_SR(s));
+					printf("> HTTPSocket[%d] : [CLOSING] Disconnect called, socket status = %d\r\n", s, getSn_SR(s));
 #endif
 					break;
 
@@ -379,34 +439,27 @@ void httpServer_run(uint8_t seqnum)
 			printf("> HTTPSocket[%d] : CLOSE_WAIT\r\n", s);
 #endif
 #ifdef _USE_SDCARD_
-			if(HTTPSock_Status[seqnum].file_len > 0 &&
-			   HTTPSock_Status[seqnum].storage_type == SDCARD) {
-				f_sync(&fs);
-				FRESULT close_result = f_close(&fs);
-
-#ifdef _HTTPSERVER_DEBUG_
-				if(close_result != FR_OK) {
-					printf("> HTTPSocket[%d] : [CLOSE_WAIT] ERROR: f_close failed with code %d!\r\n", s, close_result);
-				}
-				printf("> HTTPSocket[%d] : [CLOSE_WAIT] File synced and closed at offset %ld (result=%d)\r\n",
-					   s, HTTPSock_Status[seqnum].file_offset, close_result);
-#endif
-				HTTPSock_Status[seqnum].file_len = 0;
-				HTTPSock_Status[seqnum].file_offset = 0;
-				HTTPSock_Status[seqnum].storage_type = NONE;
-			}
-
+			// The client is gone before the end of the body
 			if(HTTPSock_Status[seqnum].upload_active) {
-				f_sync(&HTTPSock_Status[seqnum].upload_file);
-				FRESULT close_result = f_close(&HTTPSock_Status[seqnum].upload_file);
-				HTTPSock_Status[seqnum].upload_active = 0;
+				FRESULT abort_result = httpServer_upload_abort(seqnum);
 				HTTPSock_Status[seqnum].upload_bytes_received = 0;
 				HTTPSock_Status[seqnum].upload_bytes_written = 0;
 				HTTPSock_Status[seqnum].upload_content_length = 0;
 #ifdef _HTTPSERVER_DEBUG_
-				printf("> HTTPSocket[%d] : [CLOSE_WAIT] Upload file synced and closed (result=%d)\r\n", s, close_result);
+				printf("> HTTPSocket[%d] : [CLOSE_WAIT] Incomplete upload file removed (result=%d)\r\n", s, abort_result);
 #endif
 			}
+
+			if(HTTPSock_Status[seqnum].file) {
+#ifdef _HTTPSERVER_DEBUG_
+				printf("> HTTPSocket[%d] : [CLOSE_WAIT] File closed at offset %ld\r\n",
+					   s, HTTPSock_Status[seqnum].file_offset);
+#endif
+				http_file_release(seqnum);
+				HTTPSock_Status[seqnum].file_len = 0;
+				HTTPSock_Status[seqnum].file_offset = 0;
+				HTTPSock_Status[seqnum].storage_type = NONE;
+			}
 #endif
 			disconnect(s);
 			break;
@@ -427,9 +480,12 @@ void httpServer_run(uint8_t seqnum)
 			HTTPSock_Status[seqnum].file_start = 0;
 			HTTPSock_Status[seqnum].storage_type = NONE;
 			HTTPSock_Status[seqnum].sock_status = STATE_HTTP_IDLE;
+			HTTPSock_Status[seqnum].keep_alive = 0;
+			HTTPSock_Status[seqnum].req_count = 0;
 
 #ifdef _USE_SDCARD_
-			HTTPSock_Status[seqnum].upload_active = 0;
+			if(HTTPSock_Status[seqnum].upload_active) httpServer_upload_abort(seqnum);
+			http_file_release(seqnum);
 			HTTPSock_Status[seqnum].upload_bytes_received = 0;
 			HTTPSock_Status[seqnum].upload_bytes_written = 0;
 			HTTPSock_Status[seqnum].upload_content_length = 0;
@@ -440,6 +496,8 @@ void httpServer_run(uint8_t seqnum)
 #ifdef _HTTPSERVER_DEBUG_
 				printf("> HTTPSocket[%d] : OPEN\r\n", s);
 #endif
+				// Listen right away, the next client must not wait for another pass
+				listen(s);
 			}
 			break;
 
@@ -460,17 +518,36 @@ void httpServer_run(uint8_t seqnum)
 #endif
 }
 
+/*
+ * Give one state machine step to every configured socket in turn.
+ * No socket waits for a transfer on another one to complete.
+ */
+void httpServer_run_all(void)
+{
+	uint8_t i;
+
+	for(i = 0; i < HTTPSock_Cnt; i++)
+	{
+		httpServer_run(i);
+	}
+}
+
 ////////////////////////////////////////////
 // Private Functions
 ////////////////////////////////////////////
 static void send_http_response_header(uint8_t s, uint8_t content_type, uint32_t body_len, uint16_t http_status)
 {
-	uint8_t head_buf[300] = {0,};
+	uint8_t head_buf[384] = {0,};
+	char conn_buf[HTTP_CONN_HEADER_MAX];
 	uint16_t len;
+	int8_t get_seqnum;
+
+	if((get_seqnum = getHTTPSequenceNum(s)) == -1) return;
 
 	switch(http_status)
 	{
 		case STATUS_OK:
+		case STATUS_PARTIAL:
 			if(current_file_is_gzip) {
 				char * mime_type = "";
 
@@ -480,29 +557,101 @@ static void send_http_response_header(uint8_t s, uint8_t content_type, uint32_t
 				else if(content_type == PTYPE_JSON) mime_type = "application/json";
 				else mime_type = "application/octet-stream";
 
+				make_http_conn_header(get_seqnum, conn_buf);
 				sprintf((char*)head_buf,
 					"HTTP/1.1 200 OK\r\n"
 					"Content-Type: %s\r\n"
 					"Content-Encoding: gzip\r\n"
+					"%s"
 					"Content-Length: %ld\r\n"
 					"\r\n",
-					mime_type, body_len);
+					mime_type, conn_buf, body_len);
+				http_insert_header((char*)head_buf, http_cache_lines);
 
 				printf("[HTTP] Sending GZIP response header (type: %s, len: %ld)\r\n", mime_type, body_len);
 			}
 			else {
 				make_http_response_head((char*)head_buf, content_type, body_len);
+				http_insert_header((char*)head_buf, http_cache_lines);
+				http_add_conn_header(get_seqnum, (char*)head_buf);
+			}
+
+			if(http_status == STATUS_PARTIAL)
+			{
+				char range_buf[64];
+				char * pos = strstr((char*)head_buf, "\r\n");
+
+				// Same head with another status line
+				memmove(head_buf, pos, strlen(pos) + 1);
+				sprintf(range_buf, "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %ld-%ld/%ld",
+					http_range_first, http_range_last, http_range_size);
+				memmove(head_buf + strlen(range_buf), head_buf, strlen((char*)head_buf) + 1);
+				memcpy(head_buf, range_buf, strlen(range_buf));
 			}
 			break;
 
+		case STATUS_RANGE_ERR:
+			sprintf((char*)head_buf,
+				"HTTP/1.1 416 Range Not Satisfiable\r\n"
+				"Content-Range: bytes */%ld\r\n"
+				"Content-Length: 0\r\n"
+				"\r\n",
+				http_range_size);
+			http_add_conn_header(get_seqnum, (char*)head_buf);
+			break;
+
+		case STATUS_NOT_MODIF:
+			strcpy((char*)head_buf, "HTTP/1.1 304 Not Modified\r\n\r\n");
+			http_insert_header((char*)head_buf, http_cache_lines);
+			http_add_conn_header(get_seqnum, (char*)head_buf);
+			break;
+
 		case STATUS_NOT_FOUND:
 			memcpy(head_buf, ERROR_HTML_PAGE, sizeof(ERROR_HTML_PAGE));
+			http_add_conn_header(get_seqnum, (char*)head_buf);
+			break;
+
+		case STATUS_BAD_REQ:
+			// Where the next request starts is unknown, close after the answer
+			HTTPSock_Status[get_seqnum].keep_alive = 0;
+			memcpy(head_buf, ERROR_REQUEST_PAGE, sizeof(ERROR_REQUEST_PAGE));
+			http_add_conn_header(get_seqnum, (char*)head_buf);
+			break;
+
+		case STATUS_URI_TOO_LONG:
+		case STATUS_HDR_TOO_LARGE:
+		case STATUS_NOT_IMPL:
+			// The rest of the request is not read, close after the answer
+			HTTPSock_Status[get_seqnum].keep_alive = 0;
+			sprintf((char*)head_buf, "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n\r\n", http_status,
+				(http_status == STATUS_URI_TOO_LONG) ? "URI Too Long" :
+				(http_status == STATUS_HDR_TOO_LARGE) ? "Request Header Fields Too Large" : "Not Implemented");
+			http_add_conn_header(get_seqnum, (char*)head_buf);
+			break;
+
+		case STATUS_SERV_UNAVAIL:
+			sprintf((char*)head_buf,
+				"HTTP/1.1 503 Service Unavailable\r\n"
+				"Retry-After: %d\r\n"
+				"Content-Type: text/plain\r\n"
+				"Content-Length: 4\r\n"
+				"\r\n"
+				"BUSY",
+				HTTP_RETRY_AFTER_SEC);
+			http_add_conn_header(get_seqnum, (char*)head_buf);
 			break;
 
 		default:
 			break;
 	}
 
+	// Same headers as for GET, the body of the error pages is left out
+	if(http_head_only)
+	{
+		char * end = strstr((char*)head_buf, "\r\n\r\n");
+		if(end) end[4] = 0;
+	}
+
 	len = strlen((char*)head_buf);
 	send(s, head_buf, len);
 
@@ -511,168 +660,83 @@ static void send_http_response_header(uint8_t s, uint8_t content_type, uint32_t
 #endif
 }
 
-static void send_http_response_body(uint8_t s, uint8_t * uri_name, uint8_t * buf, uint32_t start_addr, uint32_t file_len)
+/*
+ * Stream the response body: each call sends as much as fits into the free
+ * part of the socket TX buffer and returns at once. The first call (file_len
+ * given) sets the transfer of bytes from offset up to file_len up, the next
+ * ones continue it. The transfer is complete when HTTPSock_Status[].file_len
+ * drops to zero.
+ */
+static void send_http_response_body(uint8_t s, uint8_t * uri_name, uint8_t * buf, uint32_t start_addr, uint32_t offset, uint32_t file_len)
 {
 	int8_t get_seqnum;
 	uint32_t send_len;
+	int32_t sent;
 
 	uint8_t flag_datasend_end = 0;
 
 #ifdef _USE_SDCARD_
-	uint16_t blocklen;
-#endif
-#ifdef _USE_FLASH_
-	uint32_t addr = 0;
+	UINT blocklen;
 #endif
 
 	if((get_seqnum = getHTTPSequenceNum(s)) == -1) return;
 
-	if(!HTTPSock_Status[get_seqnum].file_len)
+	if(file_len)
 	{
-		if (file_len > DATA_BUF_SIZE - 1)
-		{
-			HTTPSock_Status[get_seqnum].file_start = start_addr;
-			HTTPSock_Status[get_seqnum].file_len = file_len;
-			send_len = DATA_BUF_SIZE - 1;
+		HTTPSock_Status[get_seqnum].file_start = start_addr;
+		HTTPSock_Status[get_seqnum].file_len = file_len;
+		HTTPSock_Status[get_seqnum].file_offset = offset;
 
-			memset(HTTPSock_Status[get_seqnum].file_name, 0x00, MAX_CONTENT_NAME_LEN);
-			strcpy((char *)HTTPSock_Status[get_seqnum].file_name, (char *)uri_name);
+		memset(HTTPSock_Status[get_seqnum].file_name, 0x00, MAX_CONTENT_NAME_LEN);
+		strncpy((char *)HTTPSock_Status[get_seqnum].file_name, (char *)uri_name, MAX_CONTENT_NAME_LEN - 1);
 #ifdef _HTTPSERVER_DEBUG_
-			printf("> HTTPSocket[%d] : HTTP Response body - file name [ %s ]\r\n", s, HTTPSock_Status[get_seqnum].file_name);
+		printf("> HTTPSocket[%d] : HTTP Response body - file name [ %s ] len [ %ld ]byte\r\n", s, HTTPSock_Status[get_seqnum].file_name, file_len);
 #endif
+	}
 
-#ifdef _HTTPSERVER_DEBUG_
-			printf("> HTTPSocket[%d] : HTTP Response body - file len [ %ld ]byte\r\n", s, file_len);
-#endif
-		}
-		else
-		{
-			send_len = file_len;
+	if(!HTTPSock_Status[get_seqnum].file_len) return;
 
-			HTTPSock_Status[get_seqnum].file_len = 0;
-			flag_datasend_end = 1;
+	// The previous chunk is still going out, serve other sockets meanwhile
+	if(!http_send_done(s)) return;
 
-#ifdef _HTTPSERVER_DEBUG_
-			printf("> HTTPSocket[%d] : HTTP Response end - file len [ %ld ]byte\r\n", s, send_len);
-#endif
-		}
-#ifdef _USE_FLASH_
-		if(HTTPSock_Status[get_seqnum]->storage_type == DATAFLASH) addr = start_addr;
-#endif
-	}
-	else
+	send_len = getSn_TX_FSR(s);
+	if(send_len > DATA_BUF_SIZE - 1) send_len = DATA_BUF_SIZE - 1;
+	if(send_len > HTTPSock_Status[get_seqnum].file_len - HTTPSock_Status[get_seqnum].file_offset)
 	{
-#ifdef _USE_FLASH_
-		if(HTTPSock_Status[get_seqnum]->storage_type == DATAFLASH)
-		{
-			addr = HTTPSock_Status[get_seqnum].file_start + HTTPSock_Status[get_seqnum].file_offset;
-		}
-#endif
 		send_len = HTTPSock_Status[get_seqnum].file_len - HTTPSock_Status[get_seqnum].file_offset;
-
-		if(send_len > DATA_BUF_SIZE - 1)
-		{
-			send_len = DATA_BUF_SIZE - 1;
-		}
-		else
-		{
-#ifdef _HTTPSERVER_DEBUG_
-			printf("> HTTPSocket[%d] : HTTP Response end - remaining [ %ld ]byte\r\n", s, send_len);
-#endif
-			flag_datasend_end = 1;
-		}
-#ifdef _HTTPSERVER_DEBUG_
-			printf("> HTTPSocket[%d] : HTTP Response body - send len [ %ld ]byte\r\n", s, send_len);
-#endif
 	}
+	if(!send_len) return;
 
 	if(HTTPSock_Status[get_seqnum].storage_type == CODEFLASH)
 	{
-		if(HTTPSock_Status[get_seqnum].file_len) start_addr = HTTPSock_Status[get_seqnum].file_start;
-		read_userReg_webContent(start_addr, &buf[0], HTTPSock_Status[get_seqnum].file_offset, send_len);
+		read_userReg_webContent(HTTPSock_Status[get_seqnum].file_start, &buf[0], HTTPSock_Status[get_seqnum].file_offset, send_len);
 	}
 #ifdef _USE_SDCARD_
-	else if(HTTPSock_Status[get_seqnum].storage_type == SDCARD)
+	else if(HTTPSock_Status[get_seqnum].storage_type == SDCARD && HTTPSock_Status[get_seqnum].file)
 	{
-		fr = f_read(&fs, &buf[0], send_len, (void *)&blocklen);
+		FRESULT fr = f_read(&HTTPSock_Status[get_seqnum].file->file, &buf[0], send_len, &blocklen);
 
-		if(fr != FR_OK)
+		if(fr != FR_OK || blocklen == 0)
 		{
-			send_len = 0;
-			flag_datasend_end = 1;
-
-			FRESULT sync_result = f_sync(&fs);
-			FRESULT close_result = f_close(&fs);
-			HTTPSock_Status[get_seqnum].file_len = 0;
-			HTTPSock_Status[get_seqnum].file_offset = 0;
-			HTTPSock_Status[get_seqnum].storage_type = NONE;
-
 #ifdef _HTTPSERVER_DEBUG_
-			printf("> HTTPSocket[%d] : [FatFs] Read error: %d, file synced and closed (sync=%d, close=%d)\r\n",
-				   s, fr, sync_result, close_result);
+			printf("> HTTPSocket[%d] : [FatFs] Read stopped at %ld (error %d)\r\n", s, HTTPSock_Status[get_seqnum].file_offset, fr);
 #endif
-		}
-		else if(blocklen == 0)
-		{
 			send_len = 0;
-			flag_datasend_end = 1;
-
-			HTTPSock_Status[get_seqnum].file_len = 0;
-			HTTPSock_Status[get_seqnum].file_offset = 0;
-
-			FRESULT sync_result = f_sync(&fs);
-			FRESULT close_result = f_close(&fs);
-			if(close_result != FR_OK) {
-#ifdef _HTTPSERVER_DEBUG_
-				printf("> HTTPSocket[%d] : [FatFs] ERROR: f_close failed with code %d at EOF!\r\n", s, close_result);
-#endif
-			}
-
-			HTTPSock_Status[get_seqnum].storage_type = NONE;
-
-#ifdef _HTTPSERVER_DEBUG_
-			printf("> HTTPSocket[%d] : [FatFs] EOF reached, file synced and closed (sync=%d, close=%d)\r\n",
-				   s, sync_result, close_result);
-#endif
-		}
-		else if(blocklen < send_len)
-		{
-			send_len = blocklen;
-			flag_datasend_end = 1;
-
-			HTTPSock_Status[get_seqnum].file_len = 0;
-			HTTPSock_Status[get_seqnum].file_offset = 0;
-
-			*(buf+send_len) = 0;
-
-			FRESULT sync_result = f_sync(&fs);
-			FRESULT close_result = f_close(&fs);
-			if(close_result != FR_OK) {
-#ifdef _HTTPSERVER_DEBUG_
-				printf("> HTTPSocket[%d] : [FatFs] ERROR: f_close failed with code %d at last chunk!\r\n", s, close_result);
-#endif
-			}
-
-			HTTPSock_Status[get_seqnum].storage_type = NONE;
-
-#ifdef _HTTPSERVER_DEBUG_
-			printf("> HTTPSocket[%d] : [FatFs] Last chunk (%d bytes), file synced and closed (sync=%d, close=%d)\r\n",
-				   s, send_len, sync_result, close_result);
-#endif
 		}
 		else
 		{
 			send_len = blocklen;
-			*(buf+send_len) = 0;
+			if(HTTPSock_Status[get_seqnum].file->hashing)
+			{
+				HTTPSock_Status[get_seqnum].file->hash = http_hash(HTTPSock_Status[get_seqnum].file->hash, buf, send_len);
+			}
 		}
 	}
 #endif
-
 #ifdef _USE_FLASH_
-	else if(HTTPSock_Status[get_seqnum]->storage_type == DATAFLASH)
+	else if(HTTPSock_Status[get_seqnum].storage_type == DATAFLASH)
 	{
-		read_from_flashbuf(addr, &buf[0], send_len);
-		*(buf+send_len+1) = 0;
+		read_from_flashbuf(HTTPSock_Status[get_seqnum].file_start + HTTPSock_Status[get_seqnum].file_offset, &buf[0], send_len);
 	}
 #endif
 	else
@@ -680,46 +744,58 @@ static void send_http_response_body(uint8_t s, uint8_t * uri_name, uint8_t * buf
 		send_len = 0;
 	}
 
-#ifdef _HTTPSERVER_DEBUG_
-	printf("> HTTPSocket[%d] : [Send] HTTP Response body [ %ld ]byte\r\n", s, send_len);
-#endif
-
-	if(send_len) send(s, buf, send_len);
-	else {
+	if(send_len)
+	{
+		// Fits into the free space, send() does not wait
+		sent = send(s, buf, send_len);
+		if(sent > 0) HTTPSock_Status[get_seqnum].file_offset += sent;
+		else flag_datasend_end = 1;
+	}
+	else
+	{
 		flag_datasend_end = 1;
-#ifdef _HTTPSERVER_DEBUG_
-		printf("> HTTPSocket[%d] : [Send] No data, setting end flag\r\n", s);
-#endif
 	}
 
+	if(HTTPSock_Status[get_seqnum].file_offset >= HTTPSock_Status[get_seqnum].file_len) flag_datasend_end = 1;
+
 	if(flag_datasend_end)
 	{
-		HTTPSock_Status[get_seqnum].file_start = 0;
-		HTTPSock_Status[get_seqnum].file_len = 0;
-		HTTPSock_Status[get_seqnum].file_offset = 0;
-		flag_datasend_end = 0;
-
 #ifdef _HTTPSERVER_DEBUG_
-		printf("> HTTPSocket[%d] : [Response] Transfer complete\r\n", s);
+		printf("> HTTPSocket[%d] : [Response] Transfer complete, %ld of %ld byte\r\n", s,
+			HTTPSock_Status[get_seqnum].file_offset, HTTPSock_Status[get_seqnum].file_len);
 #endif
-	}
-	else
-	{
-		HTTPSock_Status[get_seqnum].file_offset += send_len;
-#ifdef _HTTPSERVER_DEBUG_
-		printf("> HTTPSocket[%d] : HTTP Response body - offset [ %ld ]\r\n", s, HTTPSock_Status[get_seqnum].file_offset);
+#ifdef _USE_SDCARD_
+		// The whole file went out, its hash is the ETag of the next requests
+		if(HTTPSock_Status[get_seqnum].file && HTTPSock_Status[get_seqnum].file->hashing &&
+		   HTTPSock_Status[get_seqnum].file_offset == HTTPSock_Status[get_seqnum].file_len)
+		{
+			http_file_ctx * ctx = HTTPSock_Status[get_seqnum].file;
+
+			http_etag_store(ctx->name_hash, f_size(&ctx->file), ctx->stamp, ctx->hash);
+		}
+		// The context goes back to the pool as soon as the file is read out
+		http_file_release(get_seqnum);
 #endif
+		HTTPSock_Status[get_seqnum].storage_type = NONE;
+		HTTPSock_Status[get_seqnum].file_start = 0;
+		HTTPSock_Status[get_seqnum].file_len = 0;
+		HTTPSock_Status[get_seqnum].file_offset = 0;
 	}
 }
 
 static void send_http_response_cgi(uint8_t s, uint8_t * buf, uint8_t * http_body, uint16_t file_len)
 {
 	uint16_t send_len = 0;
+	char conn_buf[HTTP_CONN_HEADER_MAX];
+	int8_t get_seqnum;
+
+	if((get_seqnum = getHTTPSequenceNum(s)) == -1) return;
 
 #ifdef _HTTPSERVER_DEBUG_
 	printf("> HTTPSocket[%d] : HTTP Response Header + Body - CGI\r\n", s);
 #endif
-	send_len = sprintf((char *)buf, "%s%d\r\n\r\n%s", RES_CGIHEAD_OK, file_len, http_body);
+	make_http_conn_header(get_seqnum, conn_buf);
+	send_len = sprintf((char *)buf, "%s%d\r\n%s\r\n%s", RES_CGIHEAD_OK, file_len, conn_buf, http_head_only ? "" : (char *)http_body);
 #ifdef _HTTPSERVER_DEBUG_
 	printf("> HTTPSocket[%d] : HTTP Response Header + Body - send len [ %d ]byte\r\n", s, send_len);
 #endif
@@ -727,44 +803,824 @@ static void send_http_response_cgi(uint8_t s, uint8_t * buf, uint8_t * http_body
 	send(s, buf, send_len);
 }
 
-static int8_t http_disconnect(uint8_t sn)
+#ifdef	_USE_SDCARD_
+/*
+ * Find a free context in the pool, NULL if all are in use.
+ */
+static http_file_ctx * http_ctx_get(void)
 {
-	setSn_CR(sn,Sn_CR_DISCON);
-	while(getSn_CR(sn));
+	uint8_t i;
 
-	return SOCK_OK;
+	for(i = 0; i < HTTP_FILE_POOL_SIZE; i++)
+	{
+		if(!HTTPFile_Pool[i].in_use) return &HTTPFile_Pool[i];
+	}
+	return NULL;
 }
 
-static void http_process_handler(uint8_t s, st_http_request * p_http_request)
+/*
+ * Open file in a context from the pool. Text content is looked for
+ * in the gzip version first. Content not hashed yet goes out without
+ * an ETag and is hashed while it is sent, the file is never read for it alone.
+ * Returns 1 if the file is open, 2 if the client has it already (the ETag
+ * matches, nothing is opened), 0 if there is no such file and -1 if all
+ * contexts are in use.
+ */
+static int8_t http_file_open(uint8_t seqnum, char * path, uint32_t * file_len)
 {
-	uint8_t * uri_name;
-	uint32_t content_addr = 0;
-	uint16_t content_num = 0;
-	uint32_t file_len = 0;
+	http_file_ctx * ctx = NULL;
+	http_etag_entry * entry;
+	char gz_filename[MAX_URI_SIZE + 4];
+	char * name = path;
+	FILINFO fno;
+	FRESULT fr = FR_NO_FILE;
+	uint32_t path_hash, name_hash, stamp;
 
-	uint8_t uri_buf[MAX_URI_SIZE]={0x00, };
+	http_file_release(seqnum);
 
-	uint16_t http_status;
-	int8_t get_seqnum;
-	uint8_t content_found;
+	current_file_is_gzip = 0;
+	path_hash = http_path_hash(path, strlen(path));
 
-	if((get_seqnum = getHTTPSequenceNum(s)) == -1) return;
+	// A path known to have no .gz variant costs a single lookup
+	if(http_gzip_candidate(path) && !http_gz_absent(path_hash))
+	{
+		sprintf(gz_filename, "%s.gz", path);
 
-	http_status = 0;
-	http_response = pHTTP_RX;
-	file_len = 0;
+		fr = f_stat(gz_filename, &fno);
+		if(fr == FR_OK && !(fno.fattrib & AM_DIR))
+		{
+			current_file_is_gzip = 1;
+			name = gz_filename;
+		}
+		else
+		{
+			if(fr == FR_OK || fr == FR_NO_FILE || fr == FR_NO_PATH)
+			{
+				HTTPGz_Absent[HTTPGz_Next] = path_hash;
+				HTTPGz_Next = (HTTPGz_Next + 1) % HTTP_GZ_CACHE_SIZE;
+			}
+			fr = FR_NO_FILE;
+		}
+	}
+	if(fr != FR_OK) fr = f_stat(path, &fno);
 
-	switch (p_http_request->METHOD)
+	if(fr != FR_OK || (fno.fattrib & AM_DIR))
 	{
-		case METHOD_ERR :
-			http_status = STATUS_BAD_REQ;
-			send_http_response_header(s, 0, 0, http_status);
-			break;
+		printf("[HTTP] ERROR: f_stat failed for %s (error %d)\r\n", path, fr);
+		return 0;
+	}
 
-		case METHOD_HEAD :
-		case METHOD_GET :
-			get_http_uri_name(p_http_request->URI, uri_buf);
-			uri_name = uri_buf;
+	*file_len = fno.fsize;
+	name_hash = current_file_is_gzip ? http_path_hash(name, strlen(name)) : path_hash;
+	stamp = ((uint32_t)fno.fdate << 16) | fno.ftime;
+
+	// Known content is answered from the directory entry alone
+	entry = http_etag_lookup(name_hash, fno.fsize, stamp);
+	if(entry)
+	{
+		sprintf(http_etag, "\"%lx-%08lx\"", fno.fsize, entry->hash);
+		if(http_etag_match(http_etag)) return 2;
+	}
+
+	ctx = http_ctx_get();
+	if(!ctx)
+	{
+		printf("[HTTP] No free file context for %s\r\n", path);
+		return -1;
+	}
+
+	fr = f_open(&ctx->file, name, FA_READ);
+	if(fr != FR_OK)
+	{
+		printf("[HTTP] ERROR: f_open failed for %s (error %d)\r\n", name, fr);
+		return 0;
+	}
+
+	ctx->in_use = 1;
+	ctx->is_list = 0;
+	ctx->hashing = entry ? 0 : 1;
+	ctx->name_hash = name_hash;
+	ctx->stamp = stamp;
+	ctx->hash = HTTP_HASH_INIT;
+	HTTPSock_Status[seqnum].file = ctx;
+
+	printf("[HTTP] Found %s file: %s (%ld bytes)\r\n", current_file_is_gzip ? "GZIP" : "normal", path, *file_len);
+	return 1;
+}
+
+/*
+ * Close the file (or directory) of the socket and return its context to the pool.
+ */
+static void http_file_release(uint8_t seqnum)
+{
+	http_file_ctx * ctx = HTTPSock_Status[seqnum].file;
+
+	if(!ctx) return;
+
+	if(ctx->is_list) f_closedir(&ctx->list.dir);
+	else f_close(&ctx->file);
+	ctx->in_use = 0;
+	ctx->is_list = 0;
+	HTTPSock_Status[seqnum].file = NULL;
+	HTTPSock_Status[seqnum].upload_active = 0;
+}
+
+FRESULT httpServer_upload_open(uint8_t seqnum)
+{
+	http_file_ctx * ctx;
+	FRESULT fr;
+
+	http_file_release(seqnum);
+
+	ctx = http_ctx_get();
+	if(!ctx) return FR_TOO_MANY_OPEN_FILES;
+
+	fr = f_open(&ctx->file, HTTPSock_Status[seqnum].upload_path, FA_CREATE_ALWAYS | FA_WRITE);
+	if(fr != FR_OK) return fr;
+
+	ctx->in_use = 1;
+	ctx->is_list = 0;
+	ctx->hashing = 0;
+	ctx->hash = HTTP_HASH_INIT;
+	HTTPSock_Status[seqnum].file = ctx;
+	HTTPSock_Status[seqnum].upload_active = 1;
+	return FR_OK;
+}
+
+FRESULT httpServer_upload_close(uint8_t seqnum)
+{
+	http_file_ctx * ctx = HTTPSock_Status[seqnum].file;
+	FRESULT sync_result, close_result;
+	FILINFO fno;
+	uint32_t hash;
+
+	if(!HTTPSock_Status[seqnum].upload_active || !ctx) return FR_INVALID_OBJECT;
+
+	sync_result = f_sync(&ctx->file);
+	close_result = f_close(&ctx->file);
+	hash = ctx->hash;
+	ctx->in_use = 0;
+	HTTPSock_Status[seqnum].file = NULL;
+	HTTPSock_Status[seqnum].upload_active = 0;
+
+	if(sync_result != FR_OK) return sync_result;
+	if(close_result != FR_OK) return close_result;
+
+	// The file is served with the hash made while it was written
+	if(f_stat(HTTPSock_Status[seqnum].upload_path, &fno) == FR_OK)
+	{
+		http_etag_store(http_path_hash(HTTPSock_Status[seqnum].upload_path, strlen(HTTPSock_Status[seqnum].upload_path)),
+						fno.fsize, ((uint32_t)fno.fdate << 16) | fno.ftime, hash);
+	}
+	return FR_OK;
+}
+
+FRESULT httpServer_upload_abort(uint8_t seqnum)
+{
+	FRESULT fr;
+
+	if(HTTPSock_Status[seqnum].upload_active) httpServer_upload_close(seqnum);
+
+	fr = f_unlink(HTTPSock_Status[seqnum].upload_path);
+	httpServer_content_changed(HTTPSock_Status[seqnum].upload_path);
+	return fr;
+}
+
+FRESULT httpServer_upload_write(uint8_t seqnum, const uint8_t * data, UINT len, UINT * written)
+{
+	http_file_ctx * ctx = HTTPSock_Status[seqnum].file;
+	FRESULT fr;
+
+	*written = 0;
+	if(!HTTPSock_Status[seqnum].upload_active || !ctx) return FR_INVALID_OBJECT;
+
+	fr = f_write(&ctx->file, data, len, written);
+	ctx->hash = http_hash(ctx->hash, data, *written);
+	return fr;
+}
+
+static http_etag_entry * http_etag_lookup(uint32_t name_hash, uint32_t size, uint32_t stamp)
+{
+	uint8_t i;
+
+	for(i = 0; i < HTTP_ETAG_CACHE_SIZE; i++)
+	{
+		if(HTTPEtag_Cache[i].valid && HTTPEtag_Cache[i].name_hash == name_hash &&
+		   HTTPEtag_Cache[i].size == size && HTTPEtag_Cache[i].stamp == stamp)
+		{
+			return &HTTPEtag_Cache[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Keep the content hash of a file, replacing what was known about the name.
+ */
+static http_etag_entry * http_etag_store(uint32_t name_hash, uint32_t size, uint32_t stamp, uint32_t hash)
+{
+	http_etag_entry * entry;
+	uint8_t i;
+
+	for(i = 0; i < HTTP_ETAG_CACHE_SIZE; i++)
+	{
+		if(HTTPEtag_Cache[i].name_hash == name_hash) HTTPEtag_Cache[i].valid = 0;
+	}
+
+	entry = &HTTPEtag_Cache[HTTPEtag_Next];
+	HTTPEtag_Next = (HTTPEtag_Next + 1) % HTTP_ETAG_CACHE_SIZE;
+
+	entry->name_hash = name_hash;
+	entry->size = size;
+	entry->stamp = stamp;
+	entry->hash = hash;
+	entry->valid = 1;
+	return entry;
+}
+
+
+/*
+ * Only text assets are looked up as .gz, by the exact extension of the name.
+ */
+static uint8_t http_gzip_candidate(const char * path)
+{
+	static const char * const ext_list[] = { "js", "css", "html", "json" };
+	const char * ext = strrchr(path, '.');
+	uint8_t i;
+
+	if(!ext || strchr(ext, '/')) return 0;
+	ext++;
+
+	for(i = 0; i < sizeof(ext_list) / sizeof(ext_list[0]); i++)
+	{
+		if(!strcasecmp(ext, ext_list[i])) return 1;
+	}
+	return 0;
+}
+
+static uint8_t http_gz_absent(uint32_t path_hash)
+{
+	uint8_t i;
+
+	for(i = 0; i < HTTP_GZ_CACHE_SIZE; i++)
+	{
+		if(HTTPGz_Absent[i] == path_hash) return 1;
+	}
+	return 0;
+}
+
+static void http_gz_forget(uint32_t path_hash)
+{
+	uint8_t i;
+
+	for(i = 0; i < HTTP_GZ_CACHE_SIZE; i++)
+	{
+		if(HTTPGz_Absent[i] == path_hash) HTTPGz_Absent[i] = 0;
+	}
+}
+
+/*
+ * Start the listing of list.cgi?path=<dir>[&offset=<n>][&limit=<n>][&details=1].
+ * The JSON is made while it is sent, chunked on persistent connections
+ * and ended by the close otherwise:
+ * {"path":"/dir","offset":0,"entries":[{"name":"a","dir":1},...],"more":false[,"next":<n>]}
+ */
+static void http_list_open(uint8_t s, uint8_t seqnum, uint8_t * uri)
+{
+	http_file_ctx * ctx;
+	char path[MAX_CONTENT_NAME_LEN];
+	char param[12];
+	char conn_buf[HTTP_CONN_HEADER_MAX];
+	char * head = (char *)http_response;
+	uint32_t offset = 0, limit = 0;
+	uint16_t len, body;
+
+	http_file_release(seqnum);
+
+	if(!get_query_param((char *)uri, "path", path, sizeof(path)) || !path[0]) strcpy(path, "/");
+	len = strlen(path);
+	if(len > 1 && path[len - 1] == '/') path[len - 1] = 0;
+	if(get_query_param((char *)uri, "offset", param, sizeof(param))) offset = strtoul(param, NULL, 10);
+	if(get_query_param((char *)uri, "limit", param, sizeof(param))) limit = strtoul(param, NULL, 10);
+
+	ctx = http_ctx_get();
+	if(!ctx)
+	{
+		send_http_response_header(s, PTYPE_CGI, 0, STATUS_SERV_UNAVAIL);
+		return;
+	}
+	if(f_opendir(&ctx->list.dir, path) != FR_OK)
+	{
+		send_http_response_header(s, PTYPE_CGI, 0, STATUS_NOT_FOUND);
+		return;
+	}
+
+	ctx->in_use = 1;
+	ctx->is_list = 1;
+	ctx->list.skip = offset;
+	ctx->list.left = limit;
+	ctx->list.next = offset;
+	ctx->list.limited = limit ? 1 : 0;
+	ctx->list.listed = 0;
+	ctx->list.details = (get_query_param((char *)uri, "details", param, sizeof(param)) && param[0] == '1') ? 1 : 0;
+	HTTPSock_Status[seqnum].file = ctx;
+	HTTPSock_Status[seqnum].storage_type = DIRLIST;
+
+	make_http_conn_header(seqnum, conn_buf);
+	len = sprintf(head,
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/json\r\n"
+		"Cache-Control: no-store\r\n"
+		"%s"
+		"%s"
+		"\r\n",
+		HTTPSock_Status[seqnum].keep_alive ? "Transfer-Encoding: chunked\r\n" : "", conn_buf);
+
+	if(http_head_only)
+	{
+		// Only the header, no listing is made
+		send(s, (uint8_t *)head, len);
+		http_file_release(seqnum);
+		HTTPSock_Status[seqnum].storage_type = NONE;
+		return;
+	}
+
+	// The start of the JSON goes with the header
+	body = (HTTPSock_Status[seqnum].keep_alive ? HTTP_CHUNK_HEAD : 0);
+	body += sprintf(head + len + body, "{\"path\":\"");
+	body += http_json_escape(head + len + body, path);
+	body += sprintf(head + len + body, "\",\"offset\":%lu,\"entries\":[", offset);
+	if(HTTPSock_Status[seqnum].keep_alive) body = http_chunk_frame(head + len, body - HTTP_CHUNK_HEAD);
+
+	send(s, (uint8_t *)head, len + body);
+
+#ifdef _HTTPSERVER_DEBUG_
+	printf("> HTTPSocket[%d] : Listing '%s' from %ld, limit %ld\r\n", s, path, offset, limit);
+#endif
+}
+
+/*
+ * Send the next part of the listing: as many entries as fit into the free
+ * TX buffer space. The listing is complete when storage_type is not DIRLIST.
+ */
+static void send_http_response_list(uint8_t s, uint8_t seqnum, uint8_t * buf)
+{
+	http_file_ctx * ctx = HTTPSock_Status[seqnum].file;
+	http_list_ctx * list;
+	FILINFO fno;
+	FRESULT fr;
+	uint8_t chunked = HTTPSock_Status[seqnum].keep_alive;
+	uint8_t done = 0, more = 0;
+	uint16_t room, len, reads = 0;
+	int32_t sent;
+
+	if(!ctx || !ctx->is_list)
+	{
+		HTTPSock_Status[seqnum].storage_type = NONE;
+		return;
+	}
+	list = &ctx->list;
+
+	if(!http_send_done(s)) return;
+
+	room = getSn_TX_FSR(s);
+	if(room > DATA_BUF_SIZE - 1) room = DATA_BUF_SIZE - 1;
+	if(room < HTTP_LIST_ENTRY_MAX + HTTP_LIST_TAIL_MAX + HTTP_CHUNK_EXTRA) return;
+	room -= HTTP_LIST_TAIL_MAX + (chunked ? HTTP_CHUNK_EXTRA : 0);
+
+	len = chunked ? HTTP_CHUNK_HEAD : 0;
+
+	while(len + HTTP_LIST_ENTRY_MAX <= room && reads < HTTP_LIST_STEP_ENTRIES)
+	{
+		fr = f_readdir(&list->dir, &fno);
+		reads++;
+		if(fr != FR_OK || !fno.fname[0])
+		{
+			done = 1;
+			break;
+		}
+		if(!strcmp(fno.fname, ".") || !strcmp(fno.fname, "..")) continue;
+
+		if(list->skip)
+		{
+			list->skip--;
+			continue;
+		}
+		// One more entry past the page tells that there are more
+		if(list->limited && !list->left)
+		{
+			done = 1;
+			more = 1;
+			break;
+		}
+
+		if(list->listed) buf[len++] = ',';
+		len += http_list_entry((char *)buf + len, &fno, list->details);
+		list->listed = 1;
+		list->next++;
+		if(list->limited) list->left--;
+	}
+
+	if(done)
+	{
+		if(more) len += sprintf((char *)buf + len, "],\"more\":true,\"next\":%lu}", list->next);
+		else len += sprintf((char *)buf + len, "],\"more\":false}");
+	}
+
+	if(chunked)
+	{
+		if(len == HTTP_CHUNK_HEAD) len = 0;
+		else len = http_chunk_frame((char *)buf, len - HTTP_CHUNK_HEAD);
+		if(done) len += sprintf((char *)buf + len, "0\r\n\r\n");
+	}
+
+	if(len)
+	{
+		sent = send(s, buf, len);
+		if(sent <= 0) done = 1;
+	}
+
+	if(done)
+	{
+#ifdef _HTTPSERVER_DEBUG_
+		printf("> HTTPSocket[%d] : Listing complete, %ld entries up to offset %ld\r\n", s, list->next, list->next);
+#endif
+		http_file_release(seqnum);
+		HTTPSock_Status[seqnum].storage_type = NONE;
+	}
+}
+
+/*
+ * Make one JSON object of the listing, returns its length.
+ */
+static uint16_t http_list_entry(char * buf, FILINFO * fno, uint8_t details)
+{
+	uint16_t len;
+
+	len = sprintf(buf, "{\"name\":\"");
+	len += http_json_escape(buf + len, fno->fname);
+	len += sprintf(buf + len, "\",\"dir\":%d", (fno->fattrib & AM_DIR) ? 1 : 0);
+
+	if(details)
+	{
+		len += sprintf(buf + len, ",\"size\":%lu,\"mtime\":\"%04d-%02d-%02dT%02d:%02d:%02d\"",
+			(uint32_t)fno->fsize,
+			1980 + (fno->fdate >> 9), (fno->fdate >> 5) & 0x0F, fno->fdate & 0x1F,
+			fno->ftime >> 11, (fno->ftime >> 5) & 0x3F, (fno->ftime & 0x1F) * 2);
+	}
+
+	buf[len++] = '}';
+	buf[len] = 0;
+	return len;
+}
+
+/*
+ * Copy a string into JSON string content, returns the length written.
+ */
+static uint16_t http_json_escape(char * out, const char * in)
+{
+	uint16_t len = 0;
+
+	for(; *in; in++)
+	{
+		if(*in == '"' || *in == '\\')
+		{
+			out[len++] = '\\';
+			out[len++] = *in;
+		}
+		else if((uint8_t)*in < 0x20)
+		{
+			len += sprintf(out + len, "\\u%04x", (uint8_t)*in);
+		}
+		else
+		{
+			out[len++] = *in;
+		}
+	}
+	out[len] = 0;
+	return len;
+}
+
+/*
+ * Frame data_len bytes placed at buf + HTTP_CHUNK_HEAD as one chunk,
+ * returns the chunk length.
+ */
+static uint16_t http_chunk_frame(char * buf, uint16_t data_len)
+{
+	char head[HTTP_CHUNK_HEAD + 1];
+
+	sprintf(head, "%04X\r\n", data_len);
+	memcpy(buf, head, HTTP_CHUNK_HEAD);
+	memcpy(buf + HTTP_CHUNK_HEAD + data_len, "\r\n", 2);
+
+	return HTTP_CHUNK_HEAD + data_len + 2;
+}
+#endif
+
+/*
+ * FNV-1a hash, content of ETags.
+ */
+static uint32_t http_hash(uint32_t hash, const uint8_t * data, uint32_t len)
+{
+	while(len--)
+	{
+		hash ^= *data++;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/*
+ * Hash of a stored file path. FAT names are case insensitive and the leading
+ * slash is optional, both spellings give the same hash. Never 0, the empty slot.
+ */
+static uint32_t http_path_hash(const char * path, uint16_t len)
+{
+	uint32_t hash = HTTP_HASH_INIT;
+
+	if(len && *path == '/') { path++; len--; }
+
+	while(len--)
+	{
+		hash ^= (uint8_t)tolower((uint8_t)*path++);
+		hash *= 16777619UL;
+	}
+	return hash ? hash : 1;
+}
+
+/*
+ * Keep a header value of the request, the request buffer is reused for the
+ * response. A missing header gives an empty string.
+ */
+static void http_save_field(st_http_field * field, char * buf, uint16_t size)
+{
+	uint16_t len = field->len;
+
+	if(len > size - 1) len = size - 1;
+	memcpy(buf, pHTTP_RX + field->off, len);
+	buf[len] = 0;
+}
+
+/*
+ * Check the Range of the request against the content size. Only a single
+ * "bytes=" range is served, anything else gets the whole content.
+ * Returns 1 with http_range_first/last set, 0 to send the whole content
+ * and -1 if the range is not satisfiable.
+ */
+static int8_t http_range_resolve(uint32_t size)
+{
+	char * p = http_range;
+	char * end;
+	uint32_t first, last;
+
+	http_range_size = size;
+	if(strncmp(p, "bytes=", 6) || strchr(p, ',')) return 0;
+	p += 6;
+
+	// Resume needs the same content the first part came from
+	if(http_if_range[0] && (!http_etag[0] || strcmp(http_if_range, http_etag))) return 0;
+
+	if(*p == '-')
+	{
+		last = strtoul(p + 1, &end, 10);		// suffix length
+		if(end == p + 1) return 0;
+		if(!last || !size) return -1;
+		if(last > size) last = size;
+		first = size - last;
+		last = size - 1;
+	}
+	else
+	{
+		first = strtoul(p, &end, 10);
+		if(end == p || *end != '-') return 0;
+		p = end + 1;
+		if(*p >= '0' && *p <= '9') last = strtoul(p, &end, 10);
+		else last = size - 1;
+		if(first >= size) return -1;
+		if(last < first) return 0;
+		if(last >= size) last = size - 1;
+	}
+
+	http_range_first = first;
+	http_range_last = last;
+	return 1;
+}
+
+static uint8_t http_etag_match(const char * etag)
+{
+	if(!http_if_none_match[0]) return 0;
+	if(http_if_none_match[0] == '*') return 1;
+
+	return strstr(http_if_none_match, etag) ? 1 : 0;
+}
+
+/*
+ * Make the ETag and Cache-Control lines of a stored file response.
+ */
+static void make_http_cache_header(uint8_t * uri_name)
+{
+	const char * value = HTTP_CACHE_CONTROL_DEFAULT;
+	uint16_t len = 0;
+	uint8_t i;
+
+	for(i = 0; i < total_cache_rule_cnt; i++)
+	{
+		if(!strncmp((char *)uri_name, (char *)cache_rule[i].prefix, strlen((char *)cache_rule[i].prefix)))
+		{
+			value = (char *)cache_rule[i].value;
+			break;
+		}
+	}
+
+	if(http_etag[0]) len = sprintf(http_cache_lines, "ETag: %s\r\n", http_etag);
+	sprintf(http_cache_lines + len, "Cache-Control: %s\r\nAccept-Ranges: bytes\r\n", value);
+}
+
+/*
+ * Insert header lines after the status line of a complete response.
+ */
+static void http_insert_header(char * resp, const char * lines)
+{
+	char * pos = strstr(resp, "\r\n");
+	uint16_t len = strlen(lines);
+
+	if(!pos || !len) return;
+	pos += 2;
+
+	memmove(pos + len, pos, strlen(pos) + 1);
+	memcpy(pos, lines, len);
+}
+
+static int8_t http_disconnect(uint8_t sn)
+{
+	setSn_CR(sn,Sn_CR_DISCON);
+	while(getSn_CR(sn));
+
+	return SOCK_OK;
+}
+
+/*
+ * Check that the last SEND command of the socket is complete, so send()
+ * will not return SOCK_BUSY. Valid once a response was started with send(),
+ * the flag stays set up to the next send().
+ */
+static uint8_t http_send_done(uint8_t sn)
+{
+	return (getSn_IR(sn) & Sn_IR_SENDOK) ? 1 : 0;
+}
+
+/*
+ * Copy received data from the socket buffer, leaving it there.
+ */
+static void http_rx_peek(uint8_t sn, uint16_t offset, uint8_t * buf, uint16_t len)
+{
+	uint16_t rd = getSn_RX_RD(sn);
+
+	setSn_RX_RD(sn, (uint16_t)(rd + offset));
+	wiz_recv_data(sn, buf, len);
+	setSn_RX_RD(sn, rd);
+}
+
+/*
+ * Drop received data from the socket buffer.
+ */
+static void http_rx_skip(uint8_t sn, uint16_t len)
+{
+	wiz_recv_ignore(sn, len);
+	setSn_CR(sn, Sn_CR_RECV);
+	while(getSn_CR(sn));
+}
+
+static void http_parser_reset(uint8_t s, uint8_t seqnum)
+{
+	uint16_t max = getSn_RxMAX(s);
+
+	// The whole head has to fit both the socket buffer and the request buffer
+	if(max > DATA_BUF_SIZE - 1) max = DATA_BUF_SIZE - 1;
+	http_parser_init(&HTTPSock_Status[seqnum].parser, max);
+}
+
+/*
+ * Parse the request head as it arrives. The bytes are parsed in the socket
+ * buffer and stay there until the head is complete, so a head split over
+ * segments needs no buffer of its own and a pipelined request behind it is
+ * left for the next pass. The complete head is taken into pHTTP_RX together
+ * with the body bytes already received, and parsed_http_request is filled.
+ * Returns HTTP_PARSE_MORE, HTTP_PARSE_DONE or HTTP_PARSE_ERROR.
+ */
+static uint8_t http_recv_request(uint8_t s, uint8_t seqnum, uint16_t rx_len)
+{
+	st_http_parser * parser = &HTTPSock_Status[seqnum].parser;
+	uint16_t start = parser->pos;
+	uint16_t status;
+	uint32_t body_len;
+	uint8_t ret;
+
+	if(rx_len > parser->max) rx_len = parser->max;
+
+	http_rx_peek(s, start, pHTTP_RX + start, rx_len - start);
+	ret = http_parser_feed(parser, pHTTP_RX + start, rx_len - start);
+	if(ret != HTTP_PARSE_DONE) return ret;
+
+	// Bytes of earlier passes may be overwritten by other sockets
+	if(start == 0) http_rx_skip(s, parser->pos);
+	else recv(s, pHTTP_RX, parser->pos);
+
+	status = http_parser_request(parser, pHTTP_RX, parsed_http_request);
+	if(status)
+	{
+		parser->status = status;
+		return HTTP_PARSE_ERROR;
+	}
+
+	http_save_field(&parser->field[HDR_IF_NONE_MATCH], http_if_none_match, sizeof(http_if_none_match));
+	http_save_field(&parser->field[HDR_IF_RANGE], http_if_range, sizeof(http_if_range));
+	http_save_field(&parser->field[HDR_RANGE], http_range, sizeof(http_range));
+
+	// Body bytes already here follow the head
+	body_len = getSn_RX_RSR(s);
+	if(body_len > parsed_http_request->CONTENT_LENGTH) body_len = parsed_http_request->CONTENT_LENGTH;
+	if(body_len > DATA_BUF_SIZE - 1 - parser->pos) body_len = DATA_BUF_SIZE - 1 - parser->pos;
+	if(body_len) body_len = recv(s, pHTTP_RX + parser->pos, body_len);
+
+	parsed_http_request->BODY = pHTTP_RX + parser->pos;
+	parsed_http_request->BODY_LEN = body_len;
+	parsed_http_request->BODY[body_len] = '\0';
+
+	return HTTP_PARSE_DONE;
+}
+
+/*
+ * Make the Connection header lines of the response.
+ * Returns the length of the text in buf.
+ */
+static uint16_t make_http_conn_header(uint8_t seqnum, char * buf)
+{
+	if(!HTTPSock_Status[seqnum].keep_alive) return sprintf(buf, "Connection: close\r\n");
+
+	return sprintf(buf, "Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n",
+		HTTP_KEEPALIVE_TIMEOUT_SEC, HTTP_KEEPALIVE_MAX_REQUESTS - HTTPSock_Status[seqnum].req_count);
+}
+
+/*
+ * Insert the Connection header lines after the status line of a complete
+ * response. The buffer must have HTTP_CONN_HEADER_MAX bytes to spare.
+ */
+static void http_add_conn_header(uint8_t seqnum, char * resp)
+{
+	char conn_buf[HTTP_CONN_HEADER_MAX];
+
+	make_http_conn_header(seqnum, conn_buf);
+	http_insert_header(resp, conn_buf);
+}
+
+/*
+ * Send a short fixed response with the Connection header added.
+ */
+static void http_send_text(uint8_t s, uint8_t seqnum, const char * resp)
+{
+	char buf[128 + HTTP_CONN_HEADER_MAX];
+
+	strncpy(buf, resp, 128);
+	buf[127] = 0;
+	http_add_conn_header(seqnum, buf);
+	send(s, (uint8_t *)buf, strlen(buf));
+}
+
+static void http_process_handler(uint8_t s, st_http_request * p_http_request)
+{
+	uint8_t * uri_name;
+	uint32_t content_addr = 0;
+	uint16_t content_num = 0;
+	uint32_t file_len = 0;
+	uint32_t body_len;
+
+	uint8_t uri_buf[MAX_URI_SIZE]={0x00, };
+
+	uint16_t http_status;
+	int8_t get_seqnum;
+	uint8_t content_found = 0;
+
+	if((get_seqnum = getHTTPSequenceNum(s)) == -1) return;
+
+	http_status = 0;
+	http_response = pHTTP_RX;
+	file_len = 0;
+	http_head_only = (p_http_request->METHOD == METHOD_HEAD);
+	http_etag[0] = 0;
+	http_cache_lines[0] = 0;
+
+	switch (p_http_request->METHOD)
+	{
+		case METHOD_ERR :
+			http_status = STATUS_BAD_REQ;
+			send_http_response_header(s, 0, 0, http_status);
+			break;
+
+		case METHOD_HEAD :
+		case METHOD_GET :
+			get_http_uri_name(p_http_request->URI, uri_buf);
+			uri_name = uri_buf;
 
 			if (!strcmp((char *)uri_name, "/")) {
 				strcpy((char *)uri_name, INITIAL_WEBPAGE);
@@ -788,8 +1644,16 @@ static void http_process_handler(uint8_t s, st_http_request * p_http_request)
 
 			if(p_http_request->TYPE == PTYPE_CGI)
 			{
+			#ifdef _USE_SDCARD_
+				// The listing has no size limit, it is streamed from the directory
+				if(!strncmp((char *)uri_name, "list.cgi", 8))
+				{
+					http_list_open(s, get_seqnum, p_http_request->URI);
+					break;
+				}
+			#endif
 				content_found = http_get_cgi_handler(uri_name, pHTTP_TX, &file_len);
-				if(content_found && (file_len <= (DATA_BUF_SIZE-(strlen(RES_CGIHEAD_OK)+8))))
+				if(content_found && (file_len <= (DATA_BUF_SIZE-(strlen(RES_CGIHEAD_OK)+8+HTTP_CONN_HEADER_MAX))))
 				{
 					send_http_response_cgi(s, http_response, pHTTP_TX, (uint16_t)file_len);
 				}
@@ -807,6 +1671,9 @@ static void http_process_handler(uint8_t s, st_http_request * p_http_request)
 					content_found = 1;
 					content_addr = (uint32_t)content_num;
 					HTTPSock_Status[get_seqnum].storage_type = CODEFLASH;
+
+					sprintf(http_etag, "\"%lx-%08lx\"", file_len, web_content[content_num].etag);
+					if(http_etag_match(http_etag)) http_status = STATUS_NOT_MODIF;
 				}
 			#ifdef _USE_SDCARD_
 				else
@@ -819,63 +1686,21 @@ static void http_process_handler(uint8_t s, st_http_request * p_http_request)
 						strcpy(fatfs_path, (char *)uri_name);
 					}
 
-					uint8_t try_gzip = 0;
-					if(strstr(fatfs_path, ".js") || strstr(fatfs_path, ".css") ||
-					   strstr(fatfs_path, ".html") || strstr(fatfs_path, ".json")) {
-						try_gzip = 1;
-					}
-
-					if(try_gzip) {
-						char gz_filename[MAX_URI_SIZE + 4];
-						sprintf(gz_filename, "%s.gz", fatfs_path);
-
-						printf("[HTTP] Trying GZIP version: %s\r\n", gz_filename);
-
-						fr = f_open(&fs, gz_filename, FA_READ);
-						if(fr == FR_OK)
-						{
-							content_found = 1;
-							current_file_is_gzip = 1;
-							file_len = f_size(&fs);
-							content_addr = 0;
-							HTTPSock_Status[get_seqnum].storage_type = SDCARD;
-
-							printf("[HTTP] Found GZIP file: %s (%ld bytes)\r\n", gz_filename, file_len);
-						}
-						else {
-							printf("[HTTP] No GZIP version (error %d), trying normal file: %s\r\n", fr, fatfs_path);
-
-							fr = f_open(&fs, fatfs_path, FA_READ);
-							if(fr == FR_OK)
-							{
-								content_found = 1;
-								current_file_is_gzip = 0;
-								file_len = f_size(&fs);
-								content_addr = 0;
-								HTTPSock_Status[get_seqnum].storage_type = SDCARD;
-
-								printf("[HTTP] Found normal file: %s (%ld bytes)\r\n", fatfs_path, file_len);
-							}
-							else {
-								printf("[HTTP] ERROR: f_open failed for %s (error %d)\r\n", fatfs_path, fr);
-							}
-						}
-					}
-					else {
-						fr = f_open(&fs, fatfs_path, FA_READ);
-						if(fr == FR_OK)
-						{
+					switch(http_file_open(get_seqnum, fatfs_path, &file_len))
+					{
+						case 1:
 							content_found = 1;
-							current_file_is_gzip = 0;
-							file_len = f_size(&fs);
 							content_addr = 0;
 							HTTPSock_Status[get_seqnum].storage_type = SDCARD;
-
-							printf("[HTTP] Loaded normal file: %s (%ld bytes)\r\n", fatfs_path, file_len);
-						}
-						else {
-							printf("[HTTP] ERROR: f_open failed for %s (error %d)\r\n", fatfs_path, fr);
-						}
+							break;
+						case 2:
+							http_status = STATUS_NOT_MODIF;
+							break;
+						case -1:
+							http_status = STATUS_SERV_UNAVAIL;
+							break;
+						default:
+							break;
 					}
 				}
 			#elif _USE_FLASH_
@@ -886,7 +1711,20 @@ static void http_process_handler(uint8_t s, st_http_request * p_http_request)
 				}
 			#endif
 
-				if(!content_found)
+				if(http_status == STATUS_SERV_UNAVAIL)
+				{
+			#ifdef _HTTPSERVER_DEBUG_
+					printf("> HTTPSocket[%d] : File pool exhausted, retry later\r\n", s);
+			#endif
+				}
+				else if(http_status == STATUS_NOT_MODIF)
+				{
+			#ifdef _HTTPSERVER_DEBUG_
+					printf("> HTTPSocket[%d] : Content [%s] not modified, ETag %s\r\n", s, uri_name, http_etag);
+			#endif
+					make_http_cache_header(uri_name);
+				}
+				else if(!content_found)
 				{
 			#ifdef _HTTPSERVER_DEBUG_
 					printf("> HTTPSocket[%d] : Unknown Page Request\r\n", s);
@@ -901,25 +1739,69 @@ static void http_process_handler(uint8_t s, st_http_request * p_http_request)
 						s, uri_name, content_addr, file_len, current_file_is_gzip ? "YES" : "NO");
 			#endif
 					http_status = STATUS_OK;
+					make_http_cache_header(uri_name);
+
+					switch(http_range_resolve(file_len))
+					{
+						case 1:
+							http_status = STATUS_PARTIAL;
+							break;
+						case -1:
+							http_status = STATUS_RANGE_ERR;
+							break;
+						default:
+							break;
+					}
+				}
+
+			#ifdef _USE_SDCARD_
+				if(http_status == STATUS_PARTIAL && HTTPSock_Status[get_seqnum].storage_type == SDCARD)
+				{
+					// A part of the file can't give the content hash
+					HTTPSock_Status[get_seqnum].file->hashing = 0;
+
+					if(f_lseek(&HTTPSock_Status[get_seqnum].file->file, http_range_first) != FR_OK)
+					{
+						http_file_release(get_seqnum);
+						HTTPSock_Status[get_seqnum].storage_type = NONE;
+						http_status = STATUS_NOT_FOUND;
+						current_file_is_gzip = 0;
+					}
 				}
+			#endif
 
 				if(http_status)
 				{
+					if(http_status == STATUS_PARTIAL) body_len = http_range_last - http_range_first + 1;
+					else body_len = file_len;
 			#ifdef _HTTPSERVER_DEBUG_
-					printf("> HTTPSocket[%d] : Requested content len = [%ld]byte\r\n", s, file_len);
+					printf("> HTTPSocket[%d] : Requested content len = [%ld]byte, sent [%ld]byte\r\n", s, file_len, body_len);
 			#endif
-					send_http_response_header(s, p_http_request->TYPE, file_len, http_status);
+					send_http_response_header(s, p_http_request->TYPE, body_len, http_status);
 				}
 
-				if(http_status == STATUS_OK)
+				if(http_head_only)
+				{
+					// Nothing follows the header, the next request comes right after it
+			#ifdef _USE_SDCARD_
+					http_file_release(get_seqnum);
+			#endif
+					HTTPSock_Status[get_seqnum].storage_type = NONE;
+					HTTPSock_Status[get_seqnum].file_len = 0;
+				}
+				else if(http_status == STATUS_OK)
+				{
+					send_http_response_body(s, uri_name, http_response, content_addr, 0, file_len);
+				}
+				else if(http_status == STATUS_PARTIAL)
 				{
-					send_http_response_body(s, uri_name, http_response, content_addr, file_len);
+					send_http_response_body(s, uri_name, http_response, content_addr, http_range_first, http_range_last + 1);
 				}
 			}
 			break;
 
 		case METHOD_POST :
-			mid((char *)p_http_request->URI, "/", " HTTP", (char *)uri_buf);
+			get_http_uri_name(p_http_request->URI, uri_buf);
 			uri_name = uri_buf;
 			find_http_uri_type(&p_http_request->TYPE, uri_name);
 
@@ -943,7 +1825,11 @@ static void http_process_handler(uint8_t s, st_http_request * p_http_request)
 					break;
 				}
 
-				if(content_found && (file_len <= (DATA_BUF_SIZE-(strlen(RES_CGIHEAD_OK)+8))))
+				if(content_found == HTTP_BUSY)
+				{
+					send_http_response_header(s, PTYPE_CGI, 0, STATUS_SERV_UNAVAIL);
+				}
+				else if(content_found && (file_len <= (DATA_BUF_SIZE-(strlen(RES_CGIHEAD_OK)+8+HTTP_CONN_HEADER_MAX))))
 				{
 					send_http_response_cgi(s, pHTTP_TX, http_response, (uint16_t)file_len);
 
@@ -965,6 +1851,7 @@ static void http_process_handler(uint8_t s, st_http_request * p_http_request)
 			send_http_response_header(s, 0, 0, http_status);
 			break;
 	}
+	http_head_only = 0;
 }
 
 void httpServer_time_handler(void)
@@ -998,10 +1885,67 @@ void reg_httpServer_webContent(uint8_t * content_name, uint8_t * content)
 	strcpy((char *)web_content[total_content_cnt].content_name, (const char *)content_name);
 	web_content[total_content_cnt].content_len = content_len;
 	web_content[total_content_cnt].content = content;
+	web_content[total_content_cnt].etag = http_hash(HTTP_HASH_INIT, content, content_len);
 
 	total_content_cnt++;
 }
 
+/*
+ * Set Cache-Control of the stored files starting with prefix (no leading '/').
+ * The first registered matching rule is used, HTTP_CACHE_CONTROL_DEFAULT if none.
+ */
+void reg_httpServer_cacheControl(uint8_t * prefix, uint8_t * value)
+{
+	if(prefix == NULL || value == NULL)
+	{
+		return;
+	}
+	else if(total_cache_rule_cnt >= MAX_CACHE_RULE || strlen((char *)value) > HTTP_CACHE_VALUE_MAX)
+	{
+		return;
+	}
+
+	cache_rule[total_cache_rule_cnt].prefix = prefix;
+	cache_rule[total_cache_rule_cnt].value = value;
+	total_cache_rule_cnt++;
+}
+
+void httpServer_content_changed(const char * path)
+{
+#ifdef _USE_SDCARD_
+	uint32_t path_hash;
+	uint16_t len;
+	uint8_t i;
+
+	if(!path)
+	{
+		memset(HTTPEtag_Cache, 0, sizeof(HTTPEtag_Cache));
+		memset(HTTPGz_Absent, 0, sizeof(HTTPGz_Absent));
+		for(i = 0; i < HTTP_FILE_POOL_SIZE; i++) HTTPFile_Pool[i].hashing = 0;
+		return;
+	}
+
+	len = strlen(path);
+	path_hash = http_path_hash(path, len);
+	for(i = 0; i < HTTP_ETAG_CACHE_SIZE; i++)
+	{
+		if(HTTPEtag_Cache[i].name_hash == path_hash) HTTPEtag_Cache[i].valid = 0;
+	}
+	// A download of the file in flight would keep the hash of the old content
+	for(i = 0; i < HTTP_FILE_POOL_SIZE; i++)
+	{
+		if(HTTPFile_Pool[i].name_hash == path_hash) HTTPFile_Pool[i].hashing = 0;
+	}
+	http_gz_forget(path_hash);
+
+	// A new or removed .gz changes what its plain file is served from
+	if(len > 3 && !strncasecmp(path + len - 3, ".gz", 3))
+	{
+		http_gz_forget(http_path_hash(path, len - 3));
+	}
+#endif
+}
+
 uint8_t display_reg_webContent_list(void)
 {
 	uint16_t i;
@@ -10,6 +10,7 @@
 #define	__HTTPSERVER_H__
 
 #include "../../../Wiznet/Ethernet/wizchip_conf.h"
+#include "../../../Wiznet/Internet/httpServer/httpParser.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -49,6 +50,7 @@ extern "C" {
 #define STATE_HTTP_RES_INPROC  		3           /* Sending the HTTP response to HTTP client (in progress) */
 #define STATE_HTTP_RES_DONE    		4           /* The end of HTTP response send (HTTP transaction ended) */
 #define STATE_HTTP_UPLOAD  5  // После STATE_HTTP_RES_DONE
+#define STATE_HTTP_CLOSING          6           /* Response drains before disconnect, see HTTP_MAX_TIMEOUT_SEC */
 
 /*********************************************
 * HTTP Simple Return Value
@@ -56,6 +58,8 @@ extern "C" {
 #define HTTP_FAILED					0
 #define HTTP_OK						1
 #define HTTP_RESET					2
+#define HTTP_MORE					3		// Request body continues
+#define HTTP_BUSY					4		// No free file context, answered with 503
 
 /*********************************************
 * HTTP Content NAME length
@@ -67,14 +71,85 @@ extern "C" {
 *********************************************/
 #define HTTP_MAX_TIMEOUT_SEC		3			// Sec.
 
+/*********************************************
+* HTTP Persistent connections
+*********************************************/
+#ifndef HTTP_KEEPALIVE_MAX_REQUESTS
+#define HTTP_KEEPALIVE_MAX_REQUESTS	100			// Requests served on one connection
+#endif
+#ifndef HTTP_KEEPALIVE_TIMEOUT_SEC
+#define HTTP_KEEPALIVE_TIMEOUT_SEC	5			// Sec. Idle connection or stalled upload is closed after it
+#endif
+
+/*********************************************
+* HTTP File serving contexts
+*********************************************/
+// Each context holds a FIL with its own _MAX_SS sector buffer (_FS_TINY is 0),
+// about 580 bytes with _MAX_SS 512, so 4 contexts take about 2.3 KB of RAM.
+// Uploads take a context too, a socket uses one at a time.
+#ifndef HTTP_FILE_POOL_SIZE
+#define HTTP_FILE_POOL_SIZE			4			// Files open at the same time, see _FS_LOCK
+#endif
+#define HTTP_RETRY_AFTER_SEC		1			// Sec. Retry-After of 503 response
+
+/*********************************************
+* HTTP Caching
+*********************************************/
+#ifndef HTTP_ETAG_CACHE_SIZE
+#define HTTP_ETAG_CACHE_SIZE		16			// Content hashes of stored files kept for ETags
+#endif
+#ifndef HTTP_GZ_CACHE_SIZE
+#define HTTP_GZ_CACHE_SIZE			16			// Paths known to have no .gz variant
+#endif
+#define MAX_CACHE_RULE				8			// Cache-Control rules by path prefix
+#define HTTP_CACHE_VALUE_MAX		48			// Max length of a Cache-Control value
+#define HTTP_CACHE_CONTROL_DEFAULT	"no-cache"	// Revalidate with the ETag on every use
+
+/*********************************************
+* HTTP Directory listing (list.cgi)
+*********************************************/
+#define HTTP_LIST_STEP_ENTRIES		64			// Directory entries read in one server step
+
 typedef enum
 {
    NONE,		///< Web storage none
    CODEFLASH,	///< Code flash memory
    SDCARD,    	///< SD card
-   DATAFLASH	///< External data flash memory
+   DATAFLASH,	///< External data flash memory
+   DIRLIST		///< Directory listing made while it is sent
 }StorageType;
 
+#ifdef _USE_SDCARD_
+// Directory listing state of list.cgi
+typedef struct _http_list_ctx
+{
+	DIR				dir;
+	uint32_t		skip;		// Entries left to skip up to the offset
+	uint32_t		left;		// Entries left to list up to the limit
+	uint32_t		next;		// Offset of the entry after the listed ones
+	uint8_t			details;	// Add size and mtime of the entries
+	uint8_t			listed;		// An entry is out, the next one needs a comma
+	uint8_t			limited;	// Page size was given
+}http_list_ctx;
+
+// File serving context, taken from the pool for the time of one download,
+// one upload or one directory listing
+typedef struct _http_file_ctx
+{
+	union
+	{
+		FIL				file;
+		http_list_ctx	list;
+	};
+	uint8_t			in_use;
+	uint8_t			is_list;
+	uint8_t			hashing;	// Content hash of a download is made while the file is sent
+	uint32_t		name_hash;
+	uint32_t		stamp;		// Modification date and time
+	uint32_t		hash;		// Content hash of the data sent or written so far
+}http_file_ctx;
+#endif
+
 typedef struct _st_http_socket
 {
 	uint8_t			sock_status;
@@ -83,12 +158,18 @@ typedef struct _st_http_socket
 	uint32_t 		file_len;
 	uint32_t 		file_offset; // (start addr + sent size...)
 	uint8_t			storage_type; // Storage type; Code flash, SDcard, Data flash ...
+	uint8_t			keep_alive;		// Connection stays open after the response
+	uint8_t			req_count;		// Requests served on the connection
+	uint32_t		idle_since;		// Time of the last activity, see get_httpServer_timecount()
+	st_http_parser	parser;			// Head of the next request, parsed as it arrives
 #ifdef _USE_SDCARD_
-    FIL upload_file;
+    http_file_ctx * file;		// File being sent or received, NULL if none
     uint32_t upload_content_length;
     uint32_t upload_bytes_received;
     uint32_t upload_bytes_written;
-    uint8_t upload_active;
+    uint8_t upload_active;		// The upload file is open in file
+    st_http_multipart upload_mp;	// Parser of the upload body
+    char upload_path[MAX_CONTENT_NAME_LEN];	// Folder the file goes to, the file path once it is open
 #endif
 }st_http_socket;
 
@@ -100,19 +181,61 @@ typedef struct _httpServer_webContent
 	uint8_t	*	content_name;
 	uint32_t	content_len;
 	uint8_t * 	content;
+	uint32_t	etag;			// Content hash
 }httpServer_webContent;
 
+// Cache-Control value for the paths starting with prefix
+typedef struct _httpServer_cacheRule
+{
+	uint8_t *	prefix;			// Path prefix without leading '/'
+	uint8_t *	value;
+}httpServer_cacheRule;
+
 extern uint8_t HTTPSock_Num[_WIZCHIP_SOCK_NUM_];
 
 void httpServer_init(uint8_t * tx_buf, uint8_t * rx_buf, uint8_t cnt, uint8_t * socklist);
 void reg_httpServer_cbfunc(void(*mcu_reset)(void), void(*wdt_reset)(void));
 void httpServer_run(uint8_t seqnum);
+void httpServer_run_all(void);
 
 void reg_httpServer_webContent(uint8_t * content_name, uint8_t * content);
 uint8_t find_userReg_webContent(uint8_t * content_name, uint16_t * content_num, uint32_t * file_len);
 uint16_t read_userReg_webContent(uint16_t content_num, uint8_t * buf, uint32_t offset, uint16_t size);
 uint8_t display_reg_webContent_list(void);
 
+void reg_httpServer_cacheControl(uint8_t * prefix, uint8_t * value);
+
+/*
+ * @brief Forget what is known about a stored file: content hash and .gz variant
+ * @param path File path as stored on the card, NULL for all files
+ * @note SHOULD BE called when files served by the server are created, changed or removed
+ */
+void httpServer_content_changed(const char * path);
+
+#ifdef _USE_SDCARD_
+/*
+ * @brief Create the upload file named by upload_path of a socket in a file context from the pool
+ * @return FR_TOO_MANY_OPEN_FILES if all contexts are in use, f_open() result otherwise
+ */
+FRESULT httpServer_upload_open(uint8_t seqnum);
+
+/*
+ * @brief Write to the upload file, the data goes into the content hash as well
+ */
+FRESULT httpServer_upload_write(uint8_t seqnum, const uint8_t * data, UINT len, UINT * written);
+
+/*
+ * @brief Flush and close the upload file, its context goes back to the pool
+ * @note The content hash of a closed file gives its ETag without reading it back
+ */
+FRESULT httpServer_upload_close(uint8_t seqnum);
+
+/*
+ * @brief Close the upload file if it is still open and remove it, the upload did not complete
+ */
+FRESULT httpServer_upload_abort(uint8_t seqnum);
+#endif
+
 /*
  * @brief HTTP Server 1sec Tick Timer handler
  * @note SHOULD BE register to your system 1s Tick timer handler
@@ -22,86 +22,10 @@ uint8_t http_get_cgi_handler(uint8_t * uri_name, uint8_t * buf, uint32_t * file_
 {
 	uint8_t ret = HTTP_OK;
 
-	// Получение списка файлов и папок (list.cgi?path=/web)
-	if(strncmp((const char *)uri_name, "list.cgi", 8) == 0)
-	{
-		char path[128] = "";
-		get_query_param((char*)buf, "path", path, sizeof(path));
-
-		// Если путь пустой, используем корень
-		if (path[0] == '\0') {
-			strcpy(path, "/");
-		}
-
-		// ВАЖНО: Убираем слэш в конце для f_opendir (кроме корня)
-		size_t path_len = strlen(path);
-		if (path_len > 1 && path[path_len - 1] == '/') {
-			path[path_len - 1] = '\0';
-			path_len--;
-		}
-
-		char folders[512] = "";
-		char files[512] = "";
+	// Список файлов (list.cgi) отдаётся потоком из httpServer.c
 
-		DIR dir;
-		FILINFO fno;
-		FRESULT res;
-
-		printf("[HTTP] Listing directory: '%s'\r\n", path);
-
-		// Открыть директорию (БЕЗ слэша в конце!)
-		res = f_opendir(&dir, path);
-		if (res == FR_OK) {
-			// Читать содержимое директории
-			while (1) {
-				res = f_readdir(&dir, &fno);
-				if (res != FR_OK || fno.fname[0] == 0) break;
-
-				// Пропустить точку и две точки
-				if (strcmp(fno.fname, ".") == 0 || strcmp(fno.fname, "..") == 0) {
-					continue;
-				}
-
-				if (fno.fattrib & AM_DIR) {
-					// Это директория
-					if (strlen(folders) > 0) {
-						strcat(folders, ", \"");
-					} else {
-						strcat(folders, "\"");
-					}
-					strcat(folders, fno.fname);
-					strcat(folders, "\"");
-
-					printf("[HTTP] Found folder: %s\r\n", fno.fname);
-				} else {
-					// Это файл
-					if (strlen(files) > 0) {
-						strcat(files, ", \"");
-					} else {
-						strcat(files, "\"");
-					}
-					strcat(files, fno.fname);
-					strcat(files, "\"");
-
-					printf("[HTTP] Found file: %s (%lu bytes)\r\n", fno.fname, fno.fsize);
-				}
-			}
-			f_closedir(&dir);
-		} else {
-			printf("[HTTP] Error opening directory: %d\r\n", res);
-		}
-
-		// Формируем JSON ответ
-		char json[1060] = "";
-		sprintf(json, "{\"folders\": [%s], \"files\": [%s]}", folders, files);
-
-		strcpy((char*)buf, json);
-		*file_len = strlen(json);
-
-		printf("[HTTP] Response: %s\r\n", json);
-	}
 	// Создание директории (api/mkdir.cgi?name=/web)
-	else if (strncmp((const char *)uri_name, "api/mkdir.cgi", 13) == 0)
+	if (strncmp((const char *)uri_name, "api/mkdir.cgi", 13) == 0)
 	{
 		char folder[128] = "";
 		if (get_query_param((char*)buf, "name", folder, sizeof(folder))) {
@@ -154,6 +78,7 @@ uint8_t http_get_cgi_handler(uint8_t * uri_name, uint8_t * buf, uint32_t * file_
 			FRESULT res = f_unlink(filepath);
 
 			if (res == FR_OK) {
+				httpServer_content_changed(filepath);
 				printf("[HTTP] Deleted successfully\r\n");
 				strcpy((char*)buf, "OK");
 				*file_len = 2;
@@ -202,7 +127,7 @@ uint8_t http_post_cgi_handler(uint8_t s, uint8_t * uri_name, st_http_request * p
 	if (strncmp((char*)uri_name, "api/mkdir.cgi", 13) == 0)
 	{
 		char folder[128] = "";
-		if (get_query_param((char*)buf, "name", folder, sizeof(folder))) {
+		if (get_query_param((char*)p_http_request->URI, "name", folder, sizeof(folder))) {
 
 			// Убрать слэш в конце (кроме корня)
 			size_t len = strlen(folder);
@@ -230,198 +155,76 @@ uint8_t http_post_cgi_handler(uint8_t s, uint8_t * uri_name, st_http_request * p
 	// === API: Загрузка файла ===
 	else if (strncmp((char*)uri_name, "api/upload.cgi", 14) == 0)
 	{
-		extern st_http_socket HTTPSock_Status[_WIZCHIP_SOCK_NUM_];
-		extern uint8_t * pHTTP_RX;
+		st_http_socket * sock = &HTTPSock_Status[seq];
 
 		// Получаем путь из query параметра
-		char upload_path[128] = "";
-		get_query_param((char*)p_http_request->URI, "path", upload_path, sizeof(upload_path));
+		sock->upload_path[0] = '\0';
+		get_query_param((char*)p_http_request->URI, "path", sock->upload_path, sizeof(sock->upload_path));
 
-		printf("[HTTP] Streaming upload request to: %s\r\n", upload_path);
-
-		// Парсим HTTP запрос
-		post_request_t request;
-		if (!disassemble_post_request(p_http_request, &request)) {
-			printf("[HTTP] Failed to parse POST request\r\n");
-			strcpy((char*)buf, "PARSE_ERROR");
-			*file_len = strlen((char*)buf);
-			return HTTP_FAILED;
-		}
+		printf("[HTTP] Streaming upload request to: %s\r\n", sock->upload_path);
+		printf("[HTTP] Content-Length: %lu\r\n", p_http_request->CONTENT_LENGTH);
 
 		// Проверка размера
-		if (request.content_length == 0 || request.content_length > 50000000) {
-			printf("[HTTP] Invalid Content-Length: %lu\r\n", request.content_length);
+		if (p_http_request->CONTENT_LENGTH == 0 || p_http_request->CONTENT_LENGTH > 50000000) {
+			printf("[HTTP] Invalid Content-Length: %lu\r\n", p_http_request->CONTENT_LENGTH);
 			strcpy((char*)buf, "INVALID_SIZE");
 			*file_len = strlen((char*)buf);
 			return HTTP_FAILED;
 		}
 
-		// Извлекаем имя файла
-		char filename[128] = "";
-		char *filename_start = strstr((char*)request.content_disposition, "filename=\"");
-
-		if (!filename_start) {
-			printf("[HTTP] Filename not found\r\n");
-			strcpy((char*)buf, "NO_FILENAME");
+		// Тело должно быть multipart/form-data
+		if (p_http_request->BOUNDARY[0] == '\0') {
+			printf("[HTTP] Failed to parse POST request: no boundary\r\n");
+			strcpy((char*)buf, "PARSE_ERROR");
 			*file_len = strlen((char*)buf);
 			return HTTP_FAILED;
 		}
 
-		filename_start += 10;
-		int filename_length = 0;
-		while(*filename_start && (*filename_start != '"') &&
-			  (*filename_start != '\r') && (*filename_start != '\n') &&
-			  filename_length < 126) {
-			filename[filename_length++] = *filename_start++;
-		}
-		filename[filename_length] = '\0';
-
-		// === ИСПРАВЛЕНО: Правильная обработка пути ===
-		char full_path[256] = "";
-		if (strlen(upload_path) > 0) {
-			strcpy(full_path, upload_path);
-
-			// Создаем директорию если нужно
-			if (strcmp(full_path, "/") != 0) {
-				// КРИТИЧНО: Используем копию пути для mkdir
-				char mkdir_path[256];
-				strcpy(mkdir_path, full_path);
-
-				// Убираем слэш в конце ТОЛЬКО для mkdir
-				size_t len = strlen(mkdir_path);
-				if (len > 1 && mkdir_path[len-1] == '/') {
-					mkdir_path[len-1] = '\0';
-				}
+		// Создаем директорию если нужно
+		if (strlen(sock->upload_path) > 0 && strcmp(sock->upload_path, "/") != 0) {
+			char mkdir_path[sizeof(sock->upload_path)];
+			strcpy(mkdir_path, sock->upload_path);
 
-				FRESULT res = f_mkdir(mkdir_path);
-				if (res == FR_OK) {
-					printf("[HTTP] Directory created: %s\r\n", mkdir_path);
-				} else if (res != FR_EXIST) {
-					printf("[HTTP] Warning: Failed to create directory: %s (error %d)\r\n", mkdir_path, res);
-				}
+			// Убираем слэш в конце ТОЛЬКО для mkdir
+			size_t len = strlen(mkdir_path);
+			if (len > 1 && mkdir_path[len-1] == '/') {
+				mkdir_path[len-1] = '\0';
 			}
 
-			// КРИТИЧНО: Убеждаемся что путь заканчивается на /
-			size_t len = strlen(full_path);
-			if (len > 0 && full_path[len-1] != '/') {
-				strcat(full_path, "/");
+			FRESULT res = f_mkdir(mkdir_path);
+			if (res == FR_OK) {
+				printf("[HTTP] Directory created: %s\r\n", mkdir_path);
+			} else if (res != FR_EXIST) {
+				printf("[HTTP] Warning: Failed to create directory: %s (error %d)\r\n", mkdir_path, res);
 			}
-
-			strcat(full_path, filename);
-		} else {
-			sprintf(full_path, "/%s", filename);
 		}
 
-		printf("[HTTP] Starting streaming upload: %s\r\n", full_path);
-		printf("[HTTP] Total size: %lu bytes\r\n", request.content_length);
-
-		// === ОТКРЫВАЕМ ФАЙЛ ДЛЯ ПОТОКОВОЙ ЗАПИСИ ===
-		FRESULT res = f_open(&HTTPSock_Status[seq].upload_file,
-							 full_path,
-							 FA_CREATE_ALWAYS | FA_WRITE);
-
-		if (res != FR_OK) {
-			printf("[HTTP] Failed to open file (error %d)\r\n", res);
-			sprintf((char*)buf, "FILE_ERROR_%d", res);
-			*file_len = strlen((char*)buf);
-			return HTTP_FAILED;
-		}
-
-		printf("[HTTP] File opened successfully\r\n");
-
-		// === ШАГ 1: ВЫЧИСЛЯЕМ ДОСТУПНЫЕ ДАННЫЕ В БУФЕРЕ ===
-		uint32_t available = (uint32_t)(request.content_end - request.content_start);
-		printf("[HTTP] Available data in buffer: %lu bytes\r\n", available);
-
-		// === ШАГ 2: ИЩЕМ BOUNDARY В КОНЦЕ БУФЕРА ===
-		uint32_t search_window = 200;
-		char* search_start = (available > search_window) ?
-			(request.content_end - search_window) : request.content_start;
-
-		char* boundary_pos = strstr(search_start, "\r\n--");
-		if (boundary_pos && (boundary_pos >= request.content_start)) {
-			// Boundary найден - это реальный конец данных файла
-			available = (uint32_t)(boundary_pos - request.content_start);
-			printf("[HTTP] Boundary found at offset %lu, file data size: %lu bytes\r\n",
-				   (uint32_t)(boundary_pos - request.content_start), available);
-		}
-
-		// === ШАГ 3: ОГРАНИЧИВАЕМ РАЗМЕР CONTENT-LENGTH ===
-		uint32_t to_write = (available > request.content_length) ?
-			request.content_length : available;
-
-		printf("[HTTP] Will write: %lu bytes (available=%lu, content_length=%lu)\r\n",
-			   to_write, available, request.content_length);
-
-		// === ШАГ 4: ЗАПИСЫВАЕМ ТОЛЬКО НУЖНОЕ КОЛИЧЕСТВО ДАННЫХ ===
-		UINT bytes_written = 0;
-		if (to_write > 0) {
-			res = f_write(&HTTPSock_Status[seq].upload_file,
-						 request.content_start,
-						 to_write,
-						 &bytes_written);
+		sock->upload_content_length = p_http_request->CONTENT_LENGTH;
+		sock->upload_bytes_received = 0;
+		sock->upload_bytes_written = 0;
+		http_multipart_init(&sock->upload_mp, p_http_request->BOUNDARY);
 
-			if (res != FR_OK) {
-				printf("[HTTP] Failed to write (error %d)\r\n", res);
-				f_close(&HTTPSock_Status[seq].upload_file);
-				sprintf((char*)buf, "WRITE_ERROR_%d", res);
-				*file_len = strlen((char*)buf);
-				return HTTP_FAILED;
-			}
-
-			printf("[HTTP] Written: %u bytes\r\n", bytes_written);
-		}
+		// Тело, пришедшее вместе с заголовками
+		uint8_t ret = http_upload_feed(seq, p_http_request->BODY, p_http_request->BODY_LEN, (char*)buf);
 
-		// === ШАГ 5: ПРОВЕРЯЕМ - ФАЙЛ ПОЛНОСТЬЮ ПОЛУЧЕН? ===
-		if (bytes_written >= request.content_length) {
-			// Весь файл уже в первом пакете!
-			printf("[HTTP] File complete! Written %u of %lu bytes\r\n",
-				   bytes_written, request.content_length);
-
-			// === КРИТИЧНО: Flush файла перед закрытием ===
-			FRESULT sync_result = f_sync(&HTTPSock_Status[seq].upload_file);
-			FRESULT close_result = f_close(&HTTPSock_Status[seq].upload_file);
-
-			printf("[HTTP] File closed (sync=%d, close=%d)\r\n", sync_result, close_result);
-
-			// === КРИТИЧНО: Flush метаданных родительской директории ===
-			// Это заставит FatFS записать directory entry на диск
-			DIR parent_dir;
-			FRESULT dir_result = f_opendir(&parent_dir, upload_path);
-			if (dir_result == FR_OK) {
-				f_closedir(&parent_dir);
-				printf("[HTTP] Parent directory flushed\r\n");
-			} else {
-				printf("[HTTP] WARNING: Failed to flush parent directory (error %d)\r\n", dir_result);
-			}
-
-			strcpy((char*)buf, "OK");
-			*file_len = 2;
+		if (ret == HTTP_MORE) {
+			// Остальное тело примет STATE_HTTP_UPLOAD
+			printf("[HTTP] Streaming mode: Received %lu / %lu bytes\r\n",
+				   sock->upload_bytes_received, sock->upload_content_length);
+			sock->sock_status = STATE_HTTP_UPLOAD;
+			*file_len = 0;
 			return HTTP_OK;
 		}
 
-		// === ШАГ 6: ФАЙЛ БОЛЬШОЙ - ПЕРЕХОДИМ В ПОТОКОВЫЙ РЕЖИМ ===
-		printf("[HTTP] Large file detected, switching to streaming mode\r\n");
-
-		HTTPSock_Status[seq].upload_active = 1;
-		HTTPSock_Status[seq].upload_content_length = request.content_length;
-		HTTPSock_Status[seq].upload_bytes_received = bytes_written;
-		HTTPSock_Status[seq].upload_bytes_written = bytes_written;
-		HTTPSock_Status[seq].sock_status = STATE_HTTP_UPLOAD;
-
-		printf("[HTTP] Streaming mode: Received %lu / %lu bytes\r\n",
-			   HTTPSock_Status[seq].upload_bytes_received,
-			   HTTPSock_Status[seq].upload_content_length);
-
-		*file_len = 0;
-		return HTTP_OK;
+		*file_len = strlen((char*)buf);
+		return ret;
 	}
 
 	// === API: Удаление файла ===
 	else if (strncmp((char*)uri_name, "api/delete.cgi", 14) == 0)
 	{
 		char path[128] = "";
-		if (get_query_param((char*)buf, "path", path, sizeof(path))) {
+		if (get_query_param((char*)p_http_request->URI, "path", path, sizeof(path))) {
 
 			// Убрать слэш (кроме корня)
 			size_t len = strlen(path);
@@ -453,6 +256,7 @@ uint8_t http_post_cgi_handler(uint8_t s, uint8_t * uri_name, st_http_request * p
 				}
 
 				if (res == FR_OK) {
+					httpServer_content_changed(path);
 					strcpy((char*)buf, "OK");
 					*file_len = 2;
 					return HTTP_OK;
@@ -484,71 +288,146 @@ uint8_t predefined_set_cgi_processor(uint8_t * uri_name, uint8_t * uri, uint8_t
 }
 
 /**
- * @brief Разбор POST запроса (multipart/form-data)
+ * @brief Приём очередной порции тела запроса загрузки (multipart/form-data)
+ *
+ * Данные файловой части пишутся в файл по мере разбора, разделитель и
+ * заголовки частей в файл не попадают.
+ *
+ * @return HTTP_MORE - тело получено не целиком, HTTP_OK - файл записан,
+ *         HTTP_BUSY - нет свободного контекста файла, HTTP_FAILED - ошибка;
+ *         текст ответа в msg
  */
-uint8_t disassemble_post_request(st_http_request * p_http_request, post_request_t* request)
+uint8_t http_upload_feed(uint8_t seq, const uint8_t * data, uint16_t len, char * msg)
 {
-	request->content_length_header = NULL;
-	request->content_length = 0;
-	request->content_disposition = NULL;
-	request->content_type = NULL;
-	request->content_start = NULL;
-	request->content_end = NULL;
-
-	char* uri = (char*)p_http_request->URI;
-
-	// === 1. Content-Length ===
-	request->content_length_header = strstr(uri, "Content-Length: ");
-	if (!request->content_length_header) {
-		printf("[HTTP] ERROR: No Content-Length\r\n");
-		return HTTP_FAILED;
-	}
+	extern st_http_socket HTTPSock_Status[_WIZCHIP_SOCK_NUM_];
 
-	request->content_length_header += strlen("Content-Length: ");
-	request->content_length = atoi(request->content_length_header);
+	st_http_socket * sock = &HTTPSock_Status[seq];
+	const uint8_t * span;
+	uint16_t span_len;
+	uint8_t ret;
+	UINT bytes_written;
+	FRESULT res;
 
-	printf("[HTTP] Content-Length: %lu\r\n", request->content_length);
+	sock->upload_bytes_received += len;
 
-	if (request->content_length == 0 || request->content_length > 50000000) {
-		printf("[HTTP] ERROR: Invalid Content-Length: %lu\r\n", request->content_length);
-		return HTTP_FAILED;
-	}
+	while ((ret = http_multipart_feed(&sock->upload_mp, &data, &len, &span, &span_len)) != MP_MORE)
+	{
+		if (ret == MP_FILE) {
+			// Пишем только первый файл запроса
+			if (sock->upload_active) {
+				sock->upload_mp.file = 0;
+				continue;
+			}
 
-	// === 2. Content-Disposition ===
-	request->content_disposition = strstr(uri, "Content-Disposition: form-data;");
-	if (!request->content_disposition) {
-		printf("[HTTP] ERROR: No Content-Disposition\r\n");
-		return HTTP_FAILED;
-	}
+			// Извлекаем имя файла
+			char filename[MAX_FILENAME_LEN] = "";
+			char *filename_start = strstr(sock->upload_mp.head, "filename=\"");
+			int filename_length = 0;
+
+			if (filename_start) {
+				filename_start += 10;
+				while (*filename_start && (*filename_start != '"') &&
+					   filename_length < MAX_FILENAME_LEN - 2) {
+					filename[filename_length++] = *filename_start++;
+				}
+			}
+			filename[filename_length] = '\0';
+
+			if (filename_length == 0) {
+				printf("[HTTP] Filename not found\r\n");
+				strcpy(msg, "NO_FILENAME");
+				return HTTP_FAILED;
+			}
 
-	// === 3. Content-Type (optional) ===
-	request->content_type = strstr(request->content_disposition, "Content-Type:");
+			// Путь: папка из query + имя файла
+			char full_path[256] = "";
+			size_t dir_len = strlen(sock->upload_path);
+			if (dir_len > 0) {
+				strcpy(full_path, sock->upload_path);
+				if (full_path[dir_len-1] != '/') {
+					strcat(full_path, "/");
+				}
+				strcat(full_path, filename);
+			} else {
+				sprintf(full_path, "/%s", filename);
+			}
 
-	// === 4. Начало данных файла ===
-	char* search_start = request->content_disposition;
-	if (request->content_type) {
-		search_start = request->content_type;
+			// Путь файла нужен до его закрытия
+			if (strlen(full_path) >= sizeof(sock->upload_path)) {
+				printf("[HTTP] Path too long: %s\r\n", full_path);
+				strcpy(msg, "PATH_TOO_LONG");
+				return HTTP_FAILED;
+			}
+			strcpy(sock->upload_path, full_path);
+
+			printf("[HTTP] Starting streaming upload: %s\r\n", full_path);
+			printf("[HTTP] Total size: %lu bytes\r\n", sock->upload_content_length);
+
+			// === ОТКРЫВАЕМ ФАЙЛ ДЛЯ ПОТОКОВОЙ ЗАПИСИ ===
+			httpServer_content_changed(full_path);
+			res = httpServer_upload_open(seq);
+			if (res == FR_TOO_MANY_OPEN_FILES) {
+				printf("[HTTP] No free file context for upload\r\n");
+				strcpy(msg, "BUSY");
+				return HTTP_BUSY;
+			}
+			if (res != FR_OK) {
+				printf("[HTTP] Failed to open file (error %d)\r\n", res);
+				sprintf(msg, "FILE_ERROR_%d", res);
+				return HTTP_FAILED;
+			}
+		}
+		else if (ret == MP_DATA) {
+			// Данные файла - сразу в файл
+			res = httpServer_upload_write(seq, span, span_len, &bytes_written);
+			if (res != FR_OK || bytes_written != span_len) {
+				printf("[HTTP] Failed to write (error %d)\r\n", res);
+				httpServer_upload_abort(seq);
+				sprintf(msg, "WRITE_ERROR_%d", res);
+				return HTTP_FAILED;
+			}
+			sock->upload_bytes_written += bytes_written;
+		}
+		else if (ret == MP_ERROR) {
+			printf("[HTTP] Malformed multipart body\r\n");
+			break;
+		}
+		// MP_END: эпилог после последней части пропускается
 	}
 
-	request->content_start = strstr(search_start, "\r\n\r\n");
-	if (!request->content_start) {
-		printf("[HTTP] ERROR: Content start not found\r\n");
+	if (ret != MP_ERROR && sock->upload_bytes_received < sock->upload_content_length) {
+		return HTTP_MORE;
+	}
+
+	// === ТЕЛО ПОЛУЧЕНО: ЗАКРЫВАЕМ ФАЙЛ ===
+	if (!sock->upload_active) {
+		printf("[HTTP] No file in the upload body\r\n");
+		strcpy(msg, (ret == MP_ERROR) ? "PARSE_ERROR" : "NO_FILENAME");
 		return HTTP_FAILED;
 	}
-	request->content_start += 4;
 
-	// === 5. КОНЕЦ данных ===
-	// Для определения конца доступных данных используем размер буфера
-	extern uint8_t * pHTTP_RX;
-	uint32_t buffer_size = 4096;  // Размер буфера приёма
+	// Файл цел, только если тело закрыто последним разделителем,
+	// неполный файл удаляется
+	if (!sock->upload_mp.ended) {
+		printf("[HTTP] Upload body is incomplete or malformed, file removed\r\n");
+		httpServer_upload_abort(seq);
+		strcpy(msg, "PARSE_ERROR");
+		return HTTP_FAILED;
+	}
 
-	char* buffer_start = (char*)pHTTP_RX;
-	request->content_end = buffer_start + buffer_size;
+	// === КРИТИЧНО: Flush файла перед закрытием ===
+	FRESULT close_result = httpServer_upload_close(seq);
 
-	uint32_t available = (uint32_t)(request->content_end - request->content_start);
+	printf("[HTTP] File closed, written %lu bytes (result=%d)\r\n",
+		   sock->upload_bytes_written, close_result);
 
-	printf("[HTTP] Available data in first packet: %lu bytes\r\n", available);
+	if (close_result != FR_OK) {
+		httpServer_upload_abort(seq);
+		strcpy(msg, "WRITE_FAILED");
+		return HTTP_FAILED;
+	}
 
+	strcpy(msg, "OK");
 	return HTTP_OK;
 }
 
@@ -557,33 +436,39 @@ uint8_t disassemble_post_request(st_http_request * p_http_request, post_request_
  */
 int get_query_param(const char* uri, const char* key, char* out, size_t max_len)
 {
+	size_t key_len = strlen(key);
 	char* pos = strstr(uri, "?");
 	if (!pos) return 0;
 	pos++;
 
-	if (strncmp(pos, key, strlen(key)) == 0 && pos[strlen(key)] == '=') {
-		char* value = pos + strlen(key) + 1;
-		pos = value;
-		int i = 0;
-
-		while (*value && i < (max_len - 1)) {
-			if ((value[0] == '%') && (value[1] == '2') && (value[2] == 'F')) {
-				out[i++] = '/';
-				value += 3;
-			} else if ((value[0] == '%') && (value[1] == '2') && (value[2] == '0')) {
-				out[i++] = ' ';
-				value += 3;
-			} else if (value[0] == '+') {
-				out[i++] = ' ';
-				value++;
-			} else if (value[0] == '&' || value[0] == ' ') {
-				break;
-			} else {
-				out[i++] = *value++;
+	// Перебираем параметры через '&' до конца строки запроса
+	while (*pos && *pos != ' ') {
+		if (strncmp(pos, key, key_len) == 0 && pos[key_len] == '=') {
+			char* value = pos + key_len + 1;
+			int i = 0;
+
+			while (*value && i < (max_len - 1)) {
+				if ((value[0] == '%') && (value[1] == '2') && (value[2] == 'F')) {
+					out[i++] = '/';
+					value += 3;
+				} else if ((value[0] == '%') && (value[1] == '2') && (value[2] == '0')) {
+					out[i++] = ' ';
+					value += 3;
+				} else if (value[0] == '+') {
+					out[i++] = ' ';
+					value++;
+				} else if (value[0] == '&' || value[0] == ' ') {
+					break;
+				} else {
+					out[i++] = *value++;
+				}
 			}
+			out[i] = '\0';
+			return 1;
 		}
-		out[i] = '\0';
-		return 1;
+
+		while (*pos && *pos != '&' && *pos != ' ') pos++;
+		if (*pos == '&') pos++;
 	}
 
 	return 0;
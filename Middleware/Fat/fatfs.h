@@ -51,6 +51,7 @@
 #define CL_FIRST    2       /* first legal cluster */
 #define CL_LAST     0xfffffff5  /* last legal cluster */
 #define CL_EOF      0xffffffff  /* EOF cluster */
+#define CL_BAD      0xfffffff7  /* bad (reserved) cluster */
 
 #define EOF_MASK    0xfffffff8  /* mask of eof */
 
@@ -150,6 +151,120 @@ struct fat_dirent {
 
 #define DIR_PER_SEC     (SEC_SIZE / sizeof(struct fat_dirent))
 
+/*
+ * Max number of sectors in one media request for contiguous clusters.
+ */
+#ifndef FAT_IO_MAX_SECS
+#define FAT_IO_MAX_SECS 8
+#endif
+
+/*
+ * Number of FAT sectors kept in RAM by the FAT cache.
+ */
+#ifndef FAT_CACHE_SLOTS
+#define FAT_CACHE_SLOTS 2
+#endif
+
+/*
+ * Cached FAT sector.
+ */
+struct fat_cache {
+    uint32_t    sec;          /* cached sector# or SEC_INVAL */
+    uint32_t    stamp;        /* last access time for LRU replacement */
+    int         dirty;        /* sector must be written back */
+    char        *buf;         /* sector data */
+};
+
+/*
+ * Directory name index: number of indexed directories and
+ * hash slots per directory (power of 2). Set dirs to 0 to disable.
+ */
+#ifndef FAT_DIR_INDEX_DIRS
+#define FAT_DIR_INDEX_DIRS  2
+#endif
+
+#ifndef FAT_DIR_INDEX_SLOTS
+#define FAT_DIR_INDEX_SLOTS 256
+#endif
+
+/*
+ * Hash slot of the directory index: location of one entry.
+ */
+struct fat_dir_slot {
+    uint32_t    sec;          /* sector# of entry, 0 free, SEC_INVAL removed */
+    uint16_t    offset;       /* offset of entry in sector */
+    uint16_t    tag;          /* hash of 8.3 name */
+};
+
+/*
+ * Name index of one directory.
+ */
+struct fat_dir_index {
+    uint32_t    cl;           /* directory cluster# (CL_ROOT for root) */
+    uint32_t    stamp;        /* last access time for LRU, 0 if unused */
+    int         count;        /* number of used slots */
+    int         overflow;     /* directory is too big to be indexed */
+    struct fat_dir_slot *slot;  /* FAT_DIR_INDEX_SLOTS entries */
+};
+
+/*
+ * Cluster cursor of an open file: last known cluster# and the file
+ * offset where this cluster starts. Used to avoid walking the FAT chain
+ * from the first cluster on sequential access.
+ */
+struct fatfs_cursor {
+    uint32_t    offset;       /* file offset of cluster start */
+    uint32_t    cl;           /* cluster# or CL_FREE if not valid */
+};
+
+#define fat_cursor_reset(cur) do { (cur)->offset = 0; (cur)->cl = CL_FREE; } while (0)
+
+/*
+ * Directory read cursor: position of the next entry to read.
+ */
+struct fatfs_dir_cursor {
+    uint32_t    cl;           /* current cluster# */
+    uint32_t    sec;          /* current sector#, 0 if not started */
+    uint32_t    sec_idx;      /* sector index in cluster */
+    uint32_t    slot;         /* entry index in sector */
+};
+
+#define fat_dir_cursor_reset(cur) memset((cur), 0, sizeof(struct fatfs_dir_cursor))
+
+/*
+ * Max depth of directory tree walked by the volume scan. Deeper
+ * directories are counted as skipped.
+ */
+#ifndef FAT_SCAN_DEPTH
+#define FAT_SCAN_DEPTH      8
+#endif
+
+#define FAT_SCAN_MIRROR     0   /* refresh FAT copies from the first FAT */
+#define FAT_SCAN_TREE       1   /* mark clusters of all files and directories */
+#define FAT_SCAN_LOST       2   /* look for used clusters not marked */
+#define FAT_SCAN_DONE       3
+
+/*
+ * Incremental volume scan state, see fatfs_scan(). The tree and lost
+ * cluster phases restart if the volume is modified meanwhile.
+ */
+struct fatfs_scan {
+    int         phase;        /* FAT_SCAN_* */
+    uint32_t    pos;          /* items done in the phase */
+    uint32_t    total;        /* items in the phase, 0 if unknown */
+    uint32_t    gen;          /* volume generation the tree walk started at */
+    uint8_t     *map;         /* marked clusters, FREE_MAP_SIZE bytes */
+    int         depth;        /* directories on the stack */
+    uint32_t    dir_cl[FAT_SCAN_DEPTH];               /* directory cluster# */
+    struct fatfs_dir_cursor dir[FAT_SCAN_DEPTH];      /* directory position */
+    uint32_t    restarts;     /* restarts due to volume changes */
+    uint32_t    mirror_fixed; /* FAT copy sectors rewritten */
+    uint32_t    lost;         /* used clusters not owned by any file */
+    uint32_t    crossed;      /* clusters owned twice (cross-linked or looped) */
+    uint32_t    bad_chains;   /* chains with out of range links */
+    uint32_t    skipped;      /* directories deeper than FAT_SCAN_DEPTH */
+};
+
 /*
  * FAT volume object.
  */
@@ -157,6 +272,8 @@ struct fatfs_vol {
     int fat_type;             /* 12, 16 or 32 */
     uint32_t    root_start;   /* start sector for root directory */
     uint32_t    fat_start;    /* start sector for fat entries */
+    uint32_t    fat_sectors;  /* sectors per FAT copy */
+    uint32_t    fat_copies;   /* number of FAT copies */
     uint32_t    data_start;   /* start sector for data */
     uint32_t    fat_eof;      /* id of end cluster */
     uint32_t    sec_per_cl;   /* sectors per cluster */
@@ -164,16 +281,31 @@ struct fatfs_vol {
     uint32_t    last_cluster; /* last cluser */
     uint32_t    fat_mask;     /* mask for cluster# */
     uint32_t    free_scan;    /* start cluster# to free search */
+    uint8_t     *free_map;    /* in-RAM map of used clusters or NULL */
+    int         free_map_valid; /* map is built from current FAT */
+    uint32_t    resv_lo;      /* clusters handed out by fat_alloc_run */
+    uint32_t    resv_hi;      /* and not yet committed, used without map */
     char    *io_buf;          /* local data buffer */
     char    *fat_buf;         /* buffer for fat entry */
+    struct fat_cache fat_cache[FAT_CACHE_SLOTS]; /* cached fat sectors */
+    int         fat_cache_cnt;  /* number of used cache slots */
+    uint32_t    fat_clock;      /* access counter for fat cache */
+#if FAT_DIR_INDEX_DIRS > 0
+    struct fat_dir_index dir_index[FAT_DIR_INDEX_DIRS]; /* directory name indexes */
+    uint32_t    dir_clock;      /* access counter for directory indexes */
+#endif
     char    *dir_buf;         /* buffer for directory entry */
     fs_media_t* dev;          /* storage device */
+    uint32_t    gen;          /* metadata change counter */
     uint32_t    j_base_sec;
     uint32_t    j_capacity;
     uint32_t    j_start;
     uint32_t    j_end;
     uint32_t    j_timestamp;
     uint8_t     j_readonly;
+    uint8_t     j_dirty;      /* j_buf holds entries not yet written */
+    uint32_t    j_buf_sec;    /* journal sector# in j_buf or SEC_INVAL */
+    char        *j_buf;       /* journal sector buffer */
 };
 
 #define FAT12(fat)  ((fat)->fat_type == 12)
@@ -217,8 +349,19 @@ int  fat_set_cluster(struct fatfs_vol *fmp, uint32_t cl, uint32_t next);
 int  fat_alloc_cluster(struct fatfs_vol *fmp, uint32_t scan_start, uint32_t *free);
 int  fat_free_clusters(struct fatfs_vol *fmp, uint32_t start);
 int  fat_seek_cluster(struct fatfs_vol *fmp, uint32_t start, uint32_t offset, uint32_t *cl);
+int  fat_seek_cursor(struct fatfs_vol *fmp, uint32_t start, struct fatfs_cursor *cur, uint32_t offset, uint32_t *cl);
 int  fat_expand_file(struct fatfs_vol *fmp, uint32_t cl, int size);
 int  fat_expand_dir(struct fatfs_vol *fmp, uint32_t cl, uint32_t *new_cl);
+int  fat_alloc_run(struct fatfs_vol *fmp, uint32_t hint, uint32_t count, uint32_t *first, uint32_t *len);
+int  fat_mirror_sector(struct fatfs_vol *fmp, uint32_t idx, uint32_t *fixed);
+
+#define FREE_MAP_SIZE(fmp) (((fmp)->last_cluster + 7) / 8)
+#define fat_map_invalidate(fmp) ((fmp)->free_map_valid = 0)
+#define fat_resv_clear(fmp) ((fmp)->resv_lo = (fmp)->resv_hi = 0)
+
+void fat_cache_init(struct fatfs_vol *fmp, char *buf, int cnt);
+int  fat_cache_flush(struct fatfs_vol *fmp);
+void fat_cache_invalidate(struct fatfs_vol *fmp);
 
 int fat_read_dirent(struct fatfs_vol *fmp, uint32_t sec);
 int fat_write_dirent_direct(struct fatfs_vol *fmp, const struct fat_dirent* de, uint32_t sec, uint32_t offset);
@@ -227,6 +370,15 @@ int fat_empty_dirents_direct(struct fatfs_vol *fmp, uint32_t cl);
 int fat_empty_dirents_deferred(struct fatfs_vol *fmp, uint32_t cl);
 int write_fat_entry_direct(struct fatfs_vol *fmp, uint32_t cl, uint32_t offset, uint32_t val);
 int write_fat_entry_deferred(struct fatfs_vol *fmp, uint32_t cl, uint32_t offset, uint32_t val);
+int fat_link_run_direct(struct fatfs_vol *fmp, uint32_t cl, uint32_t count, uint32_t last);
+int fat_link_run_deferred(struct fatfs_vol *fmp, uint32_t cl, uint32_t count, uint32_t last);
+
+void fat_index_init(struct fatfs_vol *fmp, void *mem);
+void fat_index_add(struct fatfs_vol *fmp, uint32_t cl, const struct fat_dirent *de, uint32_t sec, uint32_t offset);
+void fat_index_update(struct fatfs_vol *fmp, const struct fat_dirent *de, uint32_t sec, uint32_t offset);
+void fat_index_invalidate(struct fatfs_vol *fmp);
+
+#define FAT_DIR_INDEX_SIZE (FAT_DIR_INDEX_DIRS * FAT_DIR_INDEX_SLOTS * sizeof(struct fat_dir_slot))
 
 void fat_convert_name(char *org, char *name);
 void fat_restore_name(char *org, char *name);
@@ -235,30 +387,40 @@ int  fat_compare_name(char *n1, char *n2);
 
 int  fatfs_lookup_node(struct fatfs_vol * dvp, char *name, struct fatfs_node *node, uint32_t cl);
 int  fatfs_get_node(struct fatfs_vol * dvp, int index, struct fatfs_node *node, uint32_t cl);
+int  fatfs_read_nodes(struct fatfs_vol *fmp, struct fatfs_dir_cursor *cur, uint32_t cl, struct fatfs_node *np, int max, int *count);
 int  fatfs_put_node(struct fatfs_vol *fmp, struct fatfs_node *node);
 int  fatfs_add_node(struct fatfs_vol * dvp, struct fatfs_node *node, uint32_t cl);
 
 #ifdef FATFS_JOURNALING
 #define write_fat_entry write_fat_entry_deferred
+#define fat_link_run fat_link_run_deferred
 #define fat_write_dirent fat_write_dirent_deferred
 #define fat_empty_dirents fat_empty_dirents_deferred
 #define fatfs_commit fatfs_commit_journal
 #define fatfs_mkjournal fatfs_create_journal
 #define fatfs_chk fatfs_check
+#define fatfs_sync fatfs_flush_journal
 #else
 #define write_fat_entry write_fat_entry_direct
+#define fat_link_run fat_link_run_direct
 #define fat_write_dirent fat_write_dirent_direct
 #define fat_empty_dirents fat_empty_dirents_direct
-#define fatfs_commit(fmp, err)
+#define fatfs_commit fatfs_commit_direct
 #define fatfs_mkjournal(dev, buf) 0
 #define fatfs_chk(vol) 0
+#define fatfs_sync(fmp) fat_cache_flush(fmp)
 #endif
 
 extern int erase_sectors(fs_media_t* dev, uint32_t base_sec, uint32_t count, void* buf);
 
 int fatfs_create_journal(fs_media_t* dev, void* bpb_buf);
-void fatfs_commit_journal(struct fatfs_vol *fmp, int error);
+int fatfs_commit_journal(struct fatfs_vol *fmp, int error);
+int fatfs_commit_direct(struct fatfs_vol *fmp, int error);
 int fatfs_check(struct fatfs_vol* fmp);
+int fatfs_flush_journal(struct fatfs_vol* fmp);
+
+void fatfs_scan_init(struct fatfs_vol *fmp, struct fatfs_scan *scan, uint8_t *map);
+int fatfs_scan(struct fatfs_vol *fmp, struct fatfs_scan *scan, int budget);
 
 /*
  * Low level FAT module interface.
@@ -269,9 +431,9 @@ int fatfs_get_node_by_path(struct fatfs_vol *fmp, char *path, struct fatfs_node*
 
 int fatfs_alloc(struct fatfs_vol *fmp, struct fatfs_node *np, size_t size);
 int fatfs_lookup(struct fatfs_vol *fmp, struct fatfs_node *dp, char *name, struct fatfs_node *np);
-int fatfs_read(struct fatfs_vol *fmp, struct fatfs_node *np, uint32_t* f_offset, void *buf, size_t size, size_t *result);
+int fatfs_read(struct fatfs_vol *fmp, struct fatfs_node *np, uint32_t* f_offset, struct fatfs_cursor *cur, void *buf, size_t size, size_t *result);
 
-int fatfs_write(struct fatfs_vol *fmp, struct fatfs_node *np, uint32_t* f_offset, void *buf, size_t size, size_t *result, int append);
+int fatfs_write(struct fatfs_vol *fmp, struct fatfs_node *np, uint32_t* f_offset, struct fatfs_cursor *cur, void *buf, size_t size, size_t *result, int append);
 int fatfs_create(struct fatfs_vol *fmp, struct fatfs_node *np, char *name, uint8_t attr);
 int fatfs_remove(struct fatfs_vol *fmp, struct fatfs_node *np, char *name);
 int fatfs_rename(struct fatfs_vol *fmp, struct fatfs_node *dp1, char *name1, struct fatfs_node *dp2, char *name2);
@@ -14,6 +14,63 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/*! @en
+ * Locks are FX-RTOS mutexes. Define FS_MEDIA_NO_LOCK for single threaded
+ * use without the kernel.
+ */
+#ifndef FS_MEDIA_NO_LOCK
+#include "FXRTOS.h"
+typedef fx_mutex_t fs_lock_t;
+#else
+typedef int fs_lock_t;
+#endif
+
+/*! @en
+ * Priority ceiling of FS locks. By default waiters are ordered by priority
+ * and no ceiling is used, set it to the highest priority of FS users to
+ * bound priority inversion.
+ */
+#ifndef FS_LOCK_CEILING
+#define FS_LOCK_CEILING FX_MUTEX_CEILING_DISABLED
+#endif
+
+/*! @en
+ * Media capabilities.
+ */
+#define FS_MEDIA_CAP_VECTOR 0x01    //!< @en readv/writev are provided.
+#define FS_MEDIA_CAP_ASYNC  0x02    //!< @en submit/complete are provided.
+
+/*! @en
+ * Asynchronous request operations.
+ */
+#define FS_MEDIA_OP_READ    0
+#define FS_MEDIA_OP_WRITE   1
+
+/*! @en
+ * Scatter/gather segment: contiguous sectors range and its buffer.
+ */
+typedef struct _fs_media_iov_t
+{
+    uint32_t blkno;     //!< @en First sector.
+    void* buf;          //!< @en Data buffer.
+    uint32_t size;      //!< @en Size in bytes, multiple of sector size.
+}
+fs_media_iov_t;
+
+/*! @en
+ * Asynchronous request. Segments may be reordered or merged by the driver,
+ * request is finished when complete() returns.
+ */
+typedef struct _fs_media_req_t
+{
+    int op;                     //!< @en FS_MEDIA_OP_READ or FS_MEDIA_OP_WRITE.
+    fs_media_iov_t* iov;        //!< @en Segments.
+    unsigned int iovcnt;        //!< @en Number of segments.
+    int status;                 //!< @en Result, valid after completion.
+    void* drv;                  //!< @en Driver private data.
+}
+fs_media_req_t;
+
 /*! @en
  * Media representation.
  */
@@ -22,12 +79,37 @@ typedef struct _fs_media_t
     int (*read)(struct _fs_media_t*, void*, uint32_t*, uint32_t);         //!< @en Device read function.
     int (*write)(struct _fs_media_t*, void*, uint32_t*, uint32_t);        //!< @en Device write function.
     int (*sector_erase)(struct _fs_media_t*, void*, uint32_t*, uint32_t); //!< @en Device erase sectors function.
+    int (*erase_range)(struct _fs_media_t*, uint32_t, uint32_t);         //!< @en Optional: erase sectors range (block/chip erase).
+    int (*program)(struct _fs_media_t*, void*, uint32_t*, uint32_t);      //!< @en Optional: write erased sectors without erase.
+    uint32_t caps;                                                        //!< @en FS_MEDIA_CAP_* flags of optional functions below.
+    int (*readv)(struct _fs_media_t*, fs_media_iov_t*, unsigned int);     //!< @en Optional: vectored read.
+    int (*writev)(struct _fs_media_t*, fs_media_iov_t*, unsigned int);    //!< @en Optional: vectored write.
+    int (*submit)(struct _fs_media_t*, fs_media_req_t*);                  //!< @en Optional: start asynchronous request.
+    int (*complete)(struct _fs_media_t*, fs_media_req_t*);                //!< @en Optional: wait for request, returns its status.
+    fs_lock_t lock;                                                       //!< @en Volume metadata lock, see fs_media_lock().
     //int sec_size;                                                       //!< @en Device sectors count.
 }
 fs_media_t;
 
-/* Please provide this functions if needed */
+/*
+ * Volume lock guards FAT, directories and shared volume buffers. It is
+ * recursive and must be initialized by fs_media_init() before the media is
+ * used by more than one thread. Device access functions may be called
+ * without it held, so media shared between threads should serialize them.
+ */
+int fs_media_init(fs_media_t* media);
 void fs_media_lock(fs_media_t* media);
 void fs_media_unlock(fs_media_t* media);
 
+int fs_lock_init(fs_lock_t* lock);
+void fs_lock_deinit(fs_lock_t* lock);
+void fs_lock(fs_lock_t* lock);
+void fs_unlock(fs_lock_t* lock);
+
+/* Vectored and asynchronous access, emulated by read/write if the media lacks them. */
+int fs_media_readv(fs_media_t* media, fs_media_iov_t* iov, unsigned int iovcnt);
+int fs_media_writev(fs_media_t* media, fs_media_iov_t* iov, unsigned int iovcnt);
+int fs_media_submit(fs_media_t* media, fs_media_req_t* req);
+int fs_media_complete(fs_media_t* media, fs_media_req_t* req);
+
 #endif
@@ -0,0 +1,44 @@
+/*
+ * fs_ram_media.h
+ *
+ * RAM backed media with access statistics and power cut simulation.
+ */
+
+#ifndef _FS_RAM_MEDIA_HEADER_
+#define _FS_RAM_MEDIA_HEADER_
+
+#include "fatfs.h"
+#include "fs_media.h"
+
+/*
+ * RAM media. Sector size is SEC_SIZE, erased sectors are filled by 0xff.
+ * The memory may be a static array on target or a mapped file on host.
+ */
+typedef struct _fs_ram_media_t
+{
+    fs_media_t media;               /* Must be first. */
+    uint8_t* mem;                   /* Media content. */
+    uint32_t sec_count;             /* Number of sectors. */
+
+    void (*delay)(uint32_t);        /* Latency function, may be NULL. */
+    uint32_t read_latency;          /* Delay per sector read. */
+    uint32_t write_latency;         /* Delay per sector write. */
+    uint32_t erase_latency;         /* Delay per sector erase. */
+
+    uint32_t nreads;                /* Sectors read. */
+    uint32_t nwrites;               /* Sectors written. */
+    uint32_t nerases;               /* Sectors erased. */
+    uint32_t nrequests;             /* Media requests of any kind. */
+
+    uint32_t cut_after;             /* Sector writes until power cut, 0 if disabled. */
+    int torn;                       /* Cut write erases the sector and stores its first half. */
+    int powered_off;                /* Writes fail until fs_ram_media_power_on(). */
+}
+fs_ram_media_t;
+
+void fs_ram_media_init(fs_ram_media_t* rm, void* mem, uint32_t sec_count);
+void fs_ram_media_reset_stats(fs_ram_media_t* rm);
+void fs_ram_media_power_cut(fs_ram_media_t* rm, uint32_t writes, int torn);
+void fs_ram_media_power_on(fs_ram_media_t* rm);
+
+#endif
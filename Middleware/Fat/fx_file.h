@@ -31,6 +31,13 @@ typedef struct _fs_vol_t
 }
 fs_vol_t;
 
+/*
+ * Background volume check state.
+ */
+typedef struct fatfs_scan fs_scan_t;
+
+#define FS_SCAN_MAP_SIZE(volume) FREE_MAP_SIZE(&(volume)->fmp)
+
 /*
  * Directory object.
  */
@@ -39,11 +46,29 @@ typedef struct _fs_dir_t
     struct fatfs_vol* fmp;
     struct fatfs_node dirnode;
     uint32_t index;
+    struct fatfs_dir_cursor cursor;
 }
 fs_dir_t;
 
 /*
- * File object.
+ * Directory entry returned by fs_dir_read_entries.
+ */
+typedef struct _fs_dir_entry_t
+{
+    char name[13];
+    uint8_t attr;
+    uint32_t size;
+}
+fs_dir_entry_t;
+
+/*
+ * Max number of entries returned by one fs_dir_read_entries call.
+ */
+#define FS_DIR_BATCH    8
+
+/*
+ * File object. The lock serializes calls on the same file object and is
+ * taken before the volume lock.
  */
 typedef struct _fs_file_t
 {
@@ -51,6 +76,8 @@ typedef struct _fs_file_t
     struct fatfs_node file_node;
     struct fatfs_vol* fmp;
     uint32_t offset;
+    struct fatfs_cursor cursor;
+    fs_lock_t lock;
 }
 fs_file_t;
 
@@ -58,6 +85,8 @@ fs_file_t;
 
 int fs_volume_open(fs_media_t* media, fs_vol_t* volume, uintptr_t part, void* (*mem_alloc)(size_t));
 int fs_volume_close(fs_vol_t* volume);
+int fs_volume_scan_init(fs_vol_t* volume, fs_scan_t* scan, uint8_t* map);
+int fs_volume_scan(fs_vol_t* volume, fs_scan_t* scan, int budget);
 
 int fs_dir_create(fs_vol_t* volume, char* directory_name);
 int fs_dir_delete(fs_vol_t* volume, char* directory_name);
@@ -66,6 +95,7 @@ int fs_dir_open(fs_vol_t* volume, char* directory_name, fs_dir_t *dir);
 int fs_dir_close(fs_dir_t *dir);
 int fs_dir_read_first_entry(fs_dir_t *dir, char* entry);
 int fs_dir_read_next_entry(fs_dir_t *dir, char* entry);
+int fs_dir_read_entries(fs_dir_t *dir, fs_dir_entry_t* entries, int max, int* count);
 
 int fs_file_create(fs_vol_t* volume, char* file_name);
 int fs_file_delete(fs_vol_t* volume, char* file_name);
@@ -0,0 +1,818 @@
+/*
+ * fs_fuzz.c
+ *
+ * Fuzzer of the Eremex FAT file API with simulated power cuts.
+ *
+ * An input is a program of fs_* calls over a few files in the root and
+ * two subdirectories. Every result is checked against a model of the
+ * volume. The input may arm a power cut after a number of sector
+ * writes: the media then stops accepting writes, optionally tearing the
+ * interrupted sector, the volume is remounted (which replays the
+ * journal) and checked:
+ * - the full volume scan finds no lost, cross-linked or broken chains;
+ * - files and directories not touched by the interrupted call are
+ *   exactly as in the model, the touched ones are read back whole;
+ * - the program goes on with the recovered volume.
+ *
+ * Built with FS_FUZZ_LIBFUZZER the file provides only the libFuzzer
+ * entry point. Otherwise main() runs the given input files, or random
+ * inputs, and saves a failing input as fs_fuzz_crash.bin.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs_host.h"
+
+#define FUZZ_SECTORS    1024        /* 4 MB, FAT12 with one cluster journal */
+#define FUZZ_FILES      12          /* 4 names in each directory */
+#define FUZZ_DIRS       3           /* root, D0 and D1 */
+#define FUZZ_MAX_FILE   (64 * 1024)
+#define FUZZ_MAX_WRITE  (5 * SEC_SIZE + 100)
+#define FUZZ_MAX_OPS    256
+
+enum {
+    OP_CREATE,
+    OP_WRITE,
+    OP_READ,
+    OP_TRUNC,
+    OP_DELETE,
+    OP_MKDIR,
+    OP_RMDIR,
+    OP_RENAME,
+    OP_LIST,
+    OP_REMOUNT,
+    OP_SCAN,
+    OP_COUNT
+};
+
+/* Model of a file. Unknown entries are resolved from the volume. */
+typedef struct {
+    int exists;
+    int unknown;
+    uint32_t size;
+    uint8_t data[FUZZ_MAX_FILE];
+} fuzz_file_t;
+
+typedef struct {
+    int exists;
+    int unknown;
+} fuzz_dir_t;
+
+typedef struct {
+    const uint8_t* p;
+    size_t n;
+} fuzz_input_t;
+
+static fs_host_media_t media;
+static uint8_t* pristine;
+static fs_vol_t volume;
+static fs_file_t file;
+static fs_dir_t dir;
+static fs_scan_t scan;
+static uint8_t scan_map[FUZZ_SECTORS / 8 + 1];
+static fuzz_file_t files[FUZZ_FILES];
+static fuzz_dir_t dirs[FUZZ_DIRS];
+static uint8_t io_buf[FUZZ_MAX_FILE];
+static int op_no;
+
+static int verbose;
+static int scan_each;
+static void (*fail_hook)(void);
+
+static void
+trace(const char* fmt, ...)
+{
+    va_list ap;
+
+    if (!verbose)
+        return;
+    printf("%4d ", op_no);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("%s\n", media.rm.powered_off ? " [power cut]" : "");
+}
+
+static void
+fuzz_fail(const char* fmt, ...)
+{
+    va_list ap;
+
+    fflush(stdout);
+    fprintf(stderr, "fs_fuzz: op %d: ", op_no);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+
+    if (fail_hook)
+        fail_hook();
+    abort();
+}
+
+static uint32_t
+get8(fuzz_input_t* in)
+{
+    if (in->n == 0)
+        return 0;
+    in->n--;
+    return *in->p++;
+}
+
+static uint32_t
+get16(fuzz_input_t* in)
+{
+    uint32_t v = get8(in);
+
+    return v | (get8(in) << 8);
+}
+
+/*
+ * Names. File i is "Fi.BIN" in directory i / 4, directory 0 is root.
+ */
+static void
+dir_path(int d, char* path)
+{
+    if (d == 0)
+        strcpy(path, "/");
+    else
+        sprintf(path, "/D%d", d - 1);
+}
+
+static void
+file_path(int i, char* path)
+{
+    if (i / 4 == 0)
+        sprintf(path, "/F%d.BIN", i % 4);
+    else
+        sprintf(path, "/D%d/F%d.BIN", i / 4 - 1, i % 4);
+}
+
+static int
+powered_off(void)
+{
+    return media.rm.powered_off;
+}
+
+static void
+mount(void)
+{
+    int error;
+
+    fs_host_arena_reset();
+    memset(&volume, 0, sizeof(volume));
+    error = fs_volume_open(&media.rm.media, &volume, 0, fs_host_alloc);
+    if (error && !powered_off())
+        fuzz_fail("mount: %d", error);
+}
+
+/*
+ * Walk the whole volume, it must have no broken chains.
+ */
+static void
+check_scan(void)
+{
+    int error;
+
+    fs_volume_scan_init(&volume, &scan, scan_map);
+    do
+        error = fs_volume_scan(&volume, &scan, 1 << 20);
+    while (error == EAGAIN);
+
+    /* The scan refreshes FAT copies, so the power may be cut here. */
+    if (error && powered_off())
+        return;
+    if (error)
+        fuzz_fail("scan: %d", error);
+    if (scan.lost || scan.crossed || scan.bad_chains)
+        fuzz_fail("scan: lost %u crossed %u bad %u",
+            (unsigned)scan.lost, (unsigned)scan.crossed, (unsigned)scan.bad_chains);
+}
+
+/*
+ * Read whole file to io_buf. Returns ENOENT if there is no such file.
+ */
+static int
+read_file(int i, uint32_t* size)
+{
+    char path[32];
+    size_t done;
+    int error;
+
+    file_path(i, path);
+    error = fs_file_open(&volume, &file, path, 0);
+    if (error)
+        return error;
+
+    *size = file.file_node.dirent.size;
+    if (*size > FUZZ_MAX_FILE)
+        fuzz_fail("%s: size %u", path, (unsigned)*size);
+
+    error = fs_file_read(&file, io_buf, *size, &done);
+    fs_file_close(&file);
+    if (error || done != *size)
+        fuzz_fail("%s: read %d, %u of %u", path, error, (unsigned)done, (unsigned)*size);
+    return 0;
+}
+
+static int
+dir_exists(int d)
+{
+    char path[16];
+    int error;
+
+    if (d == 0)
+        return 1;
+
+    dir_path(d, path);
+    error = fs_dir_open(&volume, path, &dir);
+    fs_dir_close(&dir);
+    return !error;
+}
+
+/*
+ * Compare the volume with the model, taking unknown entries from the volume.
+ */
+static void
+check_model(void)
+{
+    char path[32];
+    uint32_t size;
+    int i, d, error;
+
+    for (d = 1; d < FUZZ_DIRS; d++) {
+        if (dirs[d].unknown) {
+            dirs[d].exists = dir_exists(d);
+            dirs[d].unknown = 0;
+        } else if (dirs[d].exists != dir_exists(d)) {
+            fuzz_fail("D%d: exists %d", d - 1, !dirs[d].exists);
+        }
+    }
+
+    for (i = 0; i < FUZZ_FILES; i++) {
+        file_path(i, path);
+        error = read_file(i, &size);
+        if (error && error != ENOENT)
+            fuzz_fail("%s: open %d", path, error);
+
+        if (files[i].unknown) {
+            files[i].exists = !error;
+            files[i].size = error ? 0 : size;
+            if (!error)
+                memcpy(files[i].data, io_buf, size);
+            files[i].unknown = 0;
+            continue;
+        }
+
+        if (files[i].exists != !error)
+            fuzz_fail("%s: exists %d", path, !error);
+        if (error)
+            continue;
+        if (files[i].size != size)
+            fuzz_fail("%s: size %u, expected %u", path, (unsigned)size, (unsigned)files[i].size);
+        if (memcmp(files[i].data, io_buf, size) != 0)
+            fuzz_fail("%s: content differs", path);
+    }
+}
+
+/*
+ * Directory listing must hold exactly the model entries.
+ */
+static void
+check_list(int d)
+{
+    fs_dir_entry_t entries[FS_DIR_BATCH];
+    char path[16], name[13];
+    uint32_t seen = 0;
+    int i, k, n, error;
+
+    if (!dirs[d].exists)
+        return;
+
+    dir_path(d, path);
+    error = fs_dir_open(&volume, path, &dir);
+    while (!error) {
+        error = fs_dir_read_entries(&dir, entries, FS_DIR_BATCH, &n);
+        if (error || n == 0)
+            break;
+
+        for (k = 0; k < n; k++) {
+            if (entries[k].name[0] == '.' || (entries[k].attr & (FA_HIDDEN | FA_SYSTEM)))
+                continue;
+
+            for (i = 0; i < 4; i++) {
+                sprintf(name, "F%d.BIN", i);
+                if (strcmp(entries[k].name, name) == 0)
+                    break;
+            }
+            if (i < 4) {
+                i += d * 4;
+                if (!files[i].exists || entries[k].size != files[i].size)
+                    fuzz_fail("%s: unexpected %s size %u", path, entries[k].name, (unsigned)entries[k].size);
+                seen |= 1u << i;
+                continue;
+            }
+            if (d != 0 || (strcmp(entries[k].name, "D0") && strcmp(entries[k].name, "D1")))
+                fuzz_fail("%s: unexpected %s", path, entries[k].name);
+        }
+    }
+    fs_dir_close(&dir);
+
+    if (error && error != ENOENT)
+        fuzz_fail("%s: list %d", path, error);
+
+    for (i = d * 4; i < d * 4 + 4; i++)
+        if (files[i].exists && !(seen & (1u << i)))
+            fuzz_fail("%s: F%d.BIN missing", path, i % 4);
+}
+
+/*
+ * Power came back: remount and check everything.
+ */
+static void
+recover(void)
+{
+    trace("recover");
+    fs_ram_media_power_on(&media.rm);
+    mount();
+    check_scan();
+    check_model();
+}
+
+/*
+ * Check result of a call. After a power cut the result says nothing,
+ * the touched entries are resolved when the volume is recovered.
+ * Returns nonzero if the call may be taken as done.
+ */
+static int
+expect(int error, int ok, const char* what, int i)
+{
+    if (powered_off())
+        return 0;
+    if (ok && error)
+        fuzz_fail("%s %d: %d", what, i, error);
+    if (!ok && !error)
+        fuzz_fail("%s %d: succeeded", what, i);
+    return ok;
+}
+
+static void
+op_create(fuzz_input_t* in)
+{
+    const int i = get8(in) % FUZZ_FILES;
+    const int ok = dirs[i / 4].exists;
+    char path[32];
+    int error;
+
+    /* Names are not checked for duplicates, it is up to the caller. */
+    if (files[i].exists)
+        return;
+
+    file_path(i, path);
+    files[i].unknown = 1;
+    error = fs_file_create(&volume, path);
+    trace("create %s: %d", path, error);
+    if (expect(error, ok, "create", i)) {
+        files[i].exists = 1;
+        files[i].size = 0;
+    }
+    if (!powered_off())
+        files[i].unknown = 0;
+}
+
+static void
+op_write(fuzz_input_t* in)
+{
+    const int i = get8(in) % FUZZ_FILES;
+    uint32_t len = get16(in) % (FUZZ_MAX_WRITE + 1);
+    uint32_t seed = get8(in) * 2654435761u + 1;
+    char path[32];
+    size_t done;
+    uint32_t k;
+    int error;
+
+    if (!files[i].exists)
+        return;
+    if (len > FUZZ_MAX_FILE - files[i].size)
+        len = FUZZ_MAX_FILE - files[i].size;
+
+    for (k = 0; k < len; k++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        io_buf[k] = (uint8_t)seed;
+    }
+
+    file_path(i, path);
+    files[i].unknown = 1;
+    error = fs_file_open(&volume, &file, path, 0);
+    if (!error)
+        error = fs_file_write(&file, io_buf, len, &done);
+    fs_file_close(&file);
+    trace("write %s %u at %u: %d", path, (unsigned)len, (unsigned)files[i].size, error);
+
+    if (expect(error, 1, "write", i)) {
+        if (done != len)
+            fuzz_fail("write %d: %u of %u", i, (unsigned)done, (unsigned)len);
+        memcpy(files[i].data + files[i].size, io_buf, len);
+        files[i].size += len;
+    }
+    if (!powered_off())
+        files[i].unknown = 0;
+}
+
+static void
+op_read(fuzz_input_t* in)
+{
+    const int i = get8(in) % FUZZ_FILES;
+    const uint32_t off = get16(in) % (files[i].size + 1);
+    uint32_t len = get16(in) % (FUZZ_MAX_WRITE + 1);
+    char path[32];
+    size_t done;
+    int error;
+
+    if (!files[i].exists)
+        return;
+
+    file_path(i, path);
+    error = fs_file_open(&volume, &file, path, 0);
+    if (!error)
+        error = fs_file_seek(&file, off, SEEK_SET);
+    if (!error)
+        error = fs_file_read(&file, io_buf, len, &done);
+    fs_file_close(&file);
+    trace("read %s %u at %u: %d", path, (unsigned)len, (unsigned)off, error);
+
+    if (len > files[i].size - off)
+        len = files[i].size - off;
+    if (error || done != len)
+        fuzz_fail("read %d at %u: %d, %u of %u", i, (unsigned)off, error, (unsigned)done, (unsigned)len);
+    if (memcmp(files[i].data + off, io_buf, len) != 0)
+        fuzz_fail("read %d at %u: content differs", i, (unsigned)off);
+}
+
+static void
+op_trunc(fuzz_input_t* in)
+{
+    const int i = get8(in) % FUZZ_FILES;
+    const uint32_t size = get16(in) % (files[i].size + 1);
+    char path[32];
+    int error;
+
+    if (!files[i].exists)
+        return;
+
+    file_path(i, path);
+    files[i].unknown = 1;
+    error = fs_file_open(&volume, &file, path, 0);
+    if (!error)
+        error = fs_file_trunc(&file, size);
+    fs_file_close(&file);
+    trace("trunc %s %u to %u: %d", path, (unsigned)files[i].size, (unsigned)size, error);
+
+    if (expect(error, 1, "trunc", i))
+        files[i].size = size;
+    if (!powered_off())
+        files[i].unknown = 0;
+}
+
+static void
+op_delete(fuzz_input_t* in)
+{
+    const int i = get8(in) % FUZZ_FILES;
+    char path[32];
+    int error;
+
+    file_path(i, path);
+    files[i].unknown = 1;
+    error = fs_file_delete(&volume, path);
+    trace("delete %s: %d", path, error);
+    if (expect(error, files[i].exists, "delete", i))
+        files[i].exists = 0;
+    if (!powered_off())
+        files[i].unknown = 0;
+}
+
+static int
+dir_empty(int d)
+{
+    int i;
+
+    for (i = d * 4; i < d * 4 + 4; i++)
+        if (files[i].exists)
+            return 0;
+    return 1;
+}
+
+static void
+op_mkdir(fuzz_input_t* in)
+{
+    const int d = 1 + get8(in) % (FUZZ_DIRS - 1);
+    char path[16];
+    int error;
+
+    if (dirs[d].exists)
+        return;
+
+    dir_path(d, path);
+    dirs[d].unknown = 1;
+    error = fs_dir_create(&volume, path);
+    trace("mkdir %s: %d", path, error);
+    if (expect(error, 1, "mkdir", d))
+        dirs[d].exists = 1;
+    if (!powered_off())
+        dirs[d].unknown = 0;
+}
+
+static void
+op_rmdir(fuzz_input_t* in)
+{
+    const int d = 1 + get8(in) % (FUZZ_DIRS - 1);
+    char path[16];
+    int error;
+
+    /* Emptiness is not checked either, the files would be lost. */
+    if (!dirs[d].exists || !dir_empty(d))
+        return;
+
+    dir_path(d, path);
+    dirs[d].unknown = 1;
+    error = fs_dir_delete(&volume, path);
+    trace("rmdir %s: %d", path, error);
+    if (expect(error, 1, "rmdir", d))
+        dirs[d].exists = 0;
+    if (!powered_off())
+        dirs[d].unknown = 0;
+}
+
+/*
+ * Rename file, an existing destination file is replaced.
+ */
+static void
+op_rename(fuzz_input_t* in)
+{
+    const int i = get8(in) % FUZZ_FILES;
+    const int j = get8(in) % FUZZ_FILES;
+    char from[32], to[32];
+    int error;
+
+    if (i == j || !files[i].exists || !dirs[j / 4].exists)
+        return;
+
+    file_path(i, from);
+    file_path(j, to);
+    files[i].unknown = 1;
+    files[j].unknown = 1;
+    error = fs_rename(&volume, from, to);
+    trace("rename %s %s: %d", from, to, error);
+    if (expect(error, 1, "rename", i)) {
+        files[j].exists = 1;
+        files[j].size = files[i].size;
+        memcpy(files[j].data, files[i].data, files[i].size);
+        files[i].exists = 0;
+    }
+    if (!powered_off())
+        files[i].unknown = files[j].unknown = 0;
+}
+
+static void
+op_list(fuzz_input_t* in)
+{
+    const int d = get8(in) % FUZZ_DIRS;
+
+    trace("list %d", d);
+    check_list(d);
+}
+
+static void
+op_scan(void)
+{
+    trace("scan");
+    check_scan();
+}
+
+static void
+op_remount(void)
+{
+    int error = fs_volume_close(&volume);
+
+    trace("remount: %d", error);
+    if (powered_off())
+        return;
+    if (error)
+        fuzz_fail("close: %d", error);
+    mount();
+}
+
+static void
+run(fuzz_input_t* in)
+{
+    uint32_t cut;
+    int torn, d;
+
+    memcpy(media.mem, pristine, (size_t)FUZZ_SECTORS * SEC_SIZE);
+    fs_ram_media_power_on(&media.rm);
+    memset(files, 0, sizeof(files));
+    memset(dirs, 0, sizeof(dirs));
+    dirs[0].exists = 1;
+    op_no = 0;
+
+    /* Sector writes until the power cut, 0 if the power stays on. */
+    cut = get16(in) % 2048;
+    torn = get8(in) & 1;
+    trace("cut after %u writes%s", (unsigned)cut, torn ? ", torn" : "");
+
+    mount();
+    fs_ram_media_power_cut(&media.rm, cut, torn);
+
+    for (op_no = 1; in->n > 0 && op_no <= FUZZ_MAX_OPS; op_no++) {
+        switch (get8(in) % OP_COUNT) {
+        case OP_CREATE:     op_create(in); break;
+        case OP_WRITE:      op_write(in); break;
+        case OP_READ:       op_read(in); break;
+        case OP_TRUNC:      op_trunc(in); break;
+        case OP_DELETE:     op_delete(in); break;
+        case OP_MKDIR:      op_mkdir(in); break;
+        case OP_RMDIR:      op_rmdir(in); break;
+        case OP_RENAME:     op_rename(in); break;
+        case OP_LIST:       op_list(in); break;
+        case OP_REMOUNT:    op_remount(); break;
+        case OP_SCAN:       op_scan(); break;
+        }
+
+        if (powered_off())
+            recover();
+        else if (scan_each)
+            check_scan();
+    }
+
+    /* Whatever is left, including the cut during the last close. */
+    fs_volume_close(&volume);
+    if (powered_off()) {
+        recover();
+    } else {
+        fs_ram_media_power_cut(&media.rm, 0, 0);
+        mount();
+        check_scan();
+        check_model();
+    }
+    for (d = 0; d < FUZZ_DIRS; d++)
+        check_list(d);
+}
+
+static void
+setup(void)
+{
+    int error;
+
+    if (pristine)
+        return;
+
+    if (fs_host_media_open(&media, FUZZ_SECTORS, NULL) != 0)
+        fuzz_fail("no memory for media");
+
+    error = fs_volume_format(&media.rm.media, FUZZ_SECTORS, io_buf);
+    if (error)
+        fuzz_fail("format: %d", error);
+
+    pristine = malloc((size_t)FUZZ_SECTORS * SEC_SIZE);
+    if (pristine == NULL)
+        fuzz_fail("no memory for image");
+    memcpy(pristine, media.mem, (size_t)FUZZ_SECTORS * SEC_SIZE);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    fuzz_input_t in = { data, size };
+
+    setup();
+    run(&in);
+    return 0;
+}
+
+#ifndef FS_FUZZ_LIBFUZZER
+
+static const uint8_t* cur_data;
+static size_t cur_size;
+
+static void
+save_crash(void)
+{
+    FILE* f = fopen("fs_fuzz_crash.bin", "wb");
+
+    if (f) {
+        fwrite(cur_data, 1, cur_size, f);
+        fclose(f);
+        fprintf(stderr, "fs_fuzz: input saved to fs_fuzz_crash.bin\n");
+    }
+}
+
+static int
+run_file(const char* path)
+{
+    static uint8_t data[64 * 1024];
+    FILE* f = fopen(path, "rb");
+
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    cur_size = fread(data, 1, sizeof(data), f);
+    cur_data = data;
+    fclose(f);
+
+    LLVMFuzzerTestOneInput(data, cur_size);
+    printf("%s: ok\n", path);
+    return 0;
+}
+
+/*
+ * Random inputs. Ops are biased to writes, so that files grow and
+ * the cut lands inside multi-sector transactions.
+ */
+static void
+run_random(uint32_t seed, unsigned long count, size_t max_len)
+{
+    static uint8_t data[4096];
+    unsigned long n;
+    size_t k;
+
+    if (max_len > sizeof(data))
+        max_len = sizeof(data);
+
+    for (n = 0; n < count; n++) {
+        srand(seed + n);
+        cur_size = 3 + rand() % (max_len - 2);
+        for (k = 0; k < cur_size; k++)
+            data[k] = (uint8_t)rand();
+        for (k = 3; k < cur_size; k += 8)
+            if (rand() % 3 == 0)
+                data[k] = OP_WRITE;
+        cur_data = data;
+
+        LLVMFuzzerTestOneInput(data, cur_size);
+        if ((n + 1) % 1000 == 0)
+            printf("%lu inputs\n", n + 1);
+    }
+    printf("seed %lu: %lu inputs ok\n", (unsigned long)seed, count);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: fs_fuzz [-v] [-x] [-n count] [-s seed] [-l max_len]\n"
+        "       fs_fuzz [-v] [-x] input...\n"
+        "  -v  trace calls\n"
+        "  -x  scan the volume after every call\n");
+    exit(2);
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned long count = 1000;
+    uint32_t seed = 1;
+    size_t max_len = 512;
+    int i, errors = 0;
+
+    fail_hook = save_crash;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "-x") == 0) {
+            scan_each = 1;
+            continue;
+        }
+        if (i + 1 >= argc)
+            usage();
+        if (strcmp(argv[i], "-n") == 0)
+            count = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-s") == 0)
+            seed = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-l") == 0)
+            max_len = strtoul(argv[++i], NULL, 0);
+        else
+            usage();
+    }
+    if (max_len < 4)
+        usage();
+
+    if (i < argc) {
+        for (; i < argc; i++)
+            errors += run_file(argv[i]);
+        return errors != 0;
+    }
+
+    run_random(seed, count, max_len);
+    return 0;
+}
+
+#endif
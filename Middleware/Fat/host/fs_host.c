@@ -0,0 +1,136 @@
+/*
+ * fs_host.c
+ *
+ * Host (Linux) support for the Eremex FAT.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "fs_host.h"
+
+#define ARENA_SIZE  (256 * 1024)
+
+static uint8_t arena[ARENA_SIZE] __attribute__((aligned(16)));
+static size_t arena_used;
+
+void
+fs_host_arena_reset(void)
+{
+    arena_used = 0;
+}
+
+void*
+fs_host_alloc(size_t size)
+{
+    void* p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (size > ARENA_SIZE - arena_used)
+        return NULL;
+
+    p = arena + arena_used;
+    arena_used += size;
+    return p;
+}
+
+size_t
+fs_host_arena_used(void)
+{
+    return arena_used;
+}
+
+uint64_t
+fs_host_clock_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+/*
+ * Busy wait, sleeping is too coarse for sector latencies.
+ */
+void
+fs_host_delay_us(uint32_t us)
+{
+    const uint64_t end = fs_host_clock_us() + us;
+
+    while (fs_host_clock_us() < end)
+        ;
+}
+
+/*
+ * Create media of sec_count sectors. With a path the image file is
+ * created or resized and mapped, otherwise the image is in memory.
+ * New images are erased.
+ */
+int
+fs_host_media_open(fs_host_media_t* hm, uint32_t sec_count, const char* path)
+{
+    const size_t size = (size_t)sec_count * SEC_SIZE;
+
+    hm->fd = -1;
+    hm->sec_count = sec_count;
+
+    if (path) {
+        off_t old;
+
+        hm->fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (hm->fd < 0)
+            return errno;
+
+        old = lseek(hm->fd, 0, SEEK_END);
+        if (old < 0)
+            old = 0;
+        if (ftruncate(hm->fd, size) != 0) {
+            close(hm->fd);
+            return errno;
+        }
+
+        hm->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, hm->fd, 0);
+        if (hm->mem == MAP_FAILED) {
+            close(hm->fd);
+            return errno;
+        }
+        if (old < (off_t)size)
+            memset(hm->mem + old, 0xff, size - old);
+    } else {
+        hm->mem = malloc(size);
+        if (hm->mem == NULL)
+            return ENOMEM;
+        memset(hm->mem, 0xff, size);
+    }
+
+    fs_ram_media_init(&hm->rm, hm->mem, sec_count);
+    return 0;
+}
+
+void
+fs_host_media_close(fs_host_media_t* hm)
+{
+    if (hm->fd >= 0) {
+        munmap(hm->mem, (size_t)hm->sec_count * SEC_SIZE);
+        close(hm->fd);
+    } else {
+        free(hm->mem);
+    }
+    hm->mem = NULL;
+}
+
+/*
+ * Set per sector latencies in microseconds, zero disables the delay.
+ */
+void
+fs_host_media_latency(fs_host_media_t* hm, uint32_t read_us, uint32_t write_us, uint32_t erase_us)
+{
+    hm->rm.read_latency = read_us;
+    hm->rm.write_latency = write_us;
+    hm->rm.erase_latency = erase_us;
+    hm->rm.delay = (read_us || write_us || erase_us) ? fs_host_delay_us : NULL;
+}
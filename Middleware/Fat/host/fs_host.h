@@ -0,0 +1,42 @@
+/*
+ * fs_host.h
+ *
+ * Host (Linux) support for the Eremex FAT: media image, memory for
+ * volumes and time functions used by the fuzzer and the benchmark.
+ */
+
+#ifndef FS_HOST_H_
+#define FS_HOST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fx_file.h"
+#include "fs_ram_media.h"
+
+/*
+ * Media image. The memory is either allocated or a shared mapping of
+ * an image file, so the volume may be inspected or reused afterwards.
+ */
+typedef struct {
+    fs_ram_media_t rm;
+    uint8_t* mem;
+    uint32_t sec_count;
+    int fd;                 /* image file or -1 */
+} fs_host_media_t;
+
+int  fs_host_media_open(fs_host_media_t* hm, uint32_t sec_count, const char* path);
+void fs_host_media_close(fs_host_media_t* hm);
+void fs_host_media_latency(fs_host_media_t* hm, uint32_t read_us, uint32_t write_us, uint32_t erase_us);
+
+/*
+ * Volume memory. fatfs_init() has no counterpart to free its buffers, so
+ * they come from an arena which is reset before each mount.
+ */
+void  fs_host_arena_reset(void);
+void* fs_host_alloc(size_t size);
+size_t fs_host_arena_used(void);
+
+uint64_t fs_host_clock_us(void);
+void fs_host_delay_us(uint32_t us);
+
+#endif /* FS_HOST_H_ */
@@ -0,0 +1,384 @@
+/*
+ * fs_perf.c
+ *
+ * Host benchmark of the Eremex FAT.
+ *
+ * Formats a RAM or file backed media, runs a fixed list of workloads
+ * through the fs_* API and prints for each one the rate in operations
+ * per second and media sectors read, written and erased per operation.
+ * Per sector latencies emulate the real flash, with zero latency the
+ * numbers show the CPU cost of the file system itself.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs_host.h"
+
+#define PERF_MAX_CHUNK  (64 * 1024)
+
+typedef struct {
+    uint32_t sectors;       /* media size */
+    const char* image;      /* image file or NULL */
+    uint32_t read_us;       /* latencies per sector */
+    uint32_t write_us;
+    uint32_t erase_us;
+    uint32_t files;         /* small files */
+    uint32_t small_size;    /* small file size */
+    uint32_t seq_kb;        /* large file size */
+    uint32_t chunk;         /* request size of large file I/O */
+    uint32_t rand_reads;    /* random reads of the large file */
+} perf_cfg_t;
+
+static fs_host_media_t media;
+static fs_vol_t volume;
+static fs_file_t file;
+static fs_dir_t dir;
+static uint8_t buf[PERF_MAX_CHUNK];
+
+static uint64_t t_start;
+static uint32_t ops;
+
+static void
+perf_begin(void)
+{
+    fs_ram_media_reset_stats(&media.rm);
+    ops = 0;
+    t_start = fs_host_clock_us();
+}
+
+static void
+perf_end(const char* name, uint64_t bytes)
+{
+    const uint64_t us = fs_host_clock_us() - t_start;
+    const double sec = us ? us / 1e6 : 1e-6;
+    const double n = ops ? ops : 1;
+
+    printf("%-12s %8u %10.0f %8.2f %8.2f %8.2f %8.2f",
+        name, (unsigned)ops, ops / sec,
+        media.rm.nreads / n, media.rm.nwrites / n, media.rm.nerases / n,
+        media.rm.nrequests / n);
+    if (bytes)
+        printf(" %8.2f", bytes / sec / (1024 * 1024));
+    printf("\n");
+}
+
+static int
+fail(const char* what, int error)
+{
+    fprintf(stderr, "fs_perf: %s: %d\n", what, error);
+    return error ? error : EIO;
+}
+
+static void
+small_name(char* path, uint32_t i)
+{
+    sprintf(path, "/BENCH/F%05u.DAT", (unsigned)i);
+}
+
+static int
+create_small(const perf_cfg_t* cfg)
+{
+    char path[32];
+    size_t done;
+    uint32_t i;
+    int error;
+
+    perf_begin();
+    for (i = 0; i < cfg->files; i++) {
+        small_name(path, i);
+        error = fs_file_create(&volume, path);
+        if (!error)
+            error = fs_file_open(&volume, &file, path, 0);
+        if (!error)
+            error = fs_file_write(&file, buf, cfg->small_size, &done);
+        fs_file_close(&file);
+        if (error)
+            return fail(path, error);
+        ops++;
+    }
+    perf_end("create", (uint64_t)cfg->files * cfg->small_size);
+    return 0;
+}
+
+static int
+open_small(const perf_cfg_t* cfg)
+{
+    char path[32];
+    uint32_t i;
+    int error;
+
+    perf_begin();
+    for (i = 0; i < cfg->files; i++) {
+        small_name(path, cfg->files - 1 - i);
+        error = fs_file_open(&volume, &file, path, 0);
+        fs_file_close(&file);
+        if (error)
+            return fail(path, error);
+        ops++;
+    }
+    perf_end("open", 0);
+    return 0;
+}
+
+static int
+list_dir(const perf_cfg_t* cfg)
+{
+    fs_dir_entry_t entries[FS_DIR_BATCH];
+    int n, error;
+
+    perf_begin();
+    error = fs_dir_open(&volume, "/BENCH", &dir);
+    while (!error) {
+        error = fs_dir_read_entries(&dir, entries, FS_DIR_BATCH, &n);
+        if (error || n == 0)
+            break;
+        ops += n;
+    }
+    fs_dir_close(&dir);
+    if (error && error != ENOENT)
+        return fail("list", error);
+    perf_end("list", 0);
+    return 0;
+}
+
+static int
+delete_small(const perf_cfg_t* cfg)
+{
+    char path[32];
+    uint32_t i;
+    int error;
+
+    perf_begin();
+    for (i = 0; i < cfg->files; i++) {
+        small_name(path, i);
+        error = fs_file_delete(&volume, path);
+        if (error)
+            return fail(path, error);
+        ops++;
+    }
+    perf_end("delete", 0);
+    return 0;
+}
+
+static int
+seq_write(const perf_cfg_t* cfg)
+{
+    const uint64_t total = (uint64_t)cfg->seq_kb * 1024;
+    uint64_t pos;
+    size_t done;
+    int error;
+
+    error = fs_file_create(&volume, "/LARGE.DAT");
+    if (!error)
+        error = fs_file_open(&volume, &file, "/LARGE.DAT", 0);
+    if (error)
+        return fail("/LARGE.DAT", error);
+
+    perf_begin();
+    for (pos = 0; pos < total; pos += cfg->chunk) {
+        buf[0] = (uint8_t)(pos / cfg->chunk);
+        error = fs_file_write(&file, buf, cfg->chunk, &done);
+        if (error || done != cfg->chunk)
+            return fail("seq write", error);
+        ops++;
+    }
+    perf_end("seq write", total);
+    fs_file_close(&file);
+    return 0;
+}
+
+static int
+seq_read(const perf_cfg_t* cfg)
+{
+    const uint64_t total = (uint64_t)cfg->seq_kb * 1024;
+    uint64_t pos;
+    size_t done;
+    int error;
+
+    error = fs_file_open(&volume, &file, "/LARGE.DAT", 0);
+    if (error)
+        return fail("/LARGE.DAT", error);
+
+    perf_begin();
+    for (pos = 0; pos < total; pos += cfg->chunk) {
+        error = fs_file_read(&file, buf, cfg->chunk, &done);
+        if (error || done != cfg->chunk || buf[0] != (uint8_t)(pos / cfg->chunk))
+            return fail("seq read", error);
+        ops++;
+    }
+    perf_end("seq read", total);
+    fs_file_close(&file);
+    return 0;
+}
+
+static int
+rand_read(const perf_cfg_t* cfg)
+{
+    const uint32_t total = cfg->seq_kb * 1024;
+    uint32_t seed = 12345, i, offset;
+    size_t done;
+    int error;
+
+    error = fs_file_open(&volume, &file, "/LARGE.DAT", 0);
+    if (error)
+        return fail("/LARGE.DAT", error);
+
+    perf_begin();
+    for (i = 0; i < cfg->rand_reads; i++) {
+        seed = seed * 1103515245u + 12345u;
+        offset = (seed >> 8) % (total - 512);
+        error = fs_file_seek(&file, offset, SEEK_SET);
+        if (!error)
+            error = fs_file_read(&file, buf, 512, &done);
+        if (error || done != 512)
+            return fail("random read", error);
+        ops++;
+    }
+    perf_end("rand read", (uint64_t)cfg->rand_reads * 512);
+    fs_file_close(&file);
+    return 0;
+}
+
+static int
+truncate_large(const perf_cfg_t* cfg)
+{
+    int error;
+
+    error = fs_file_open(&volume, &file, "/LARGE.DAT", 0);
+    if (error)
+        return fail("/LARGE.DAT", error);
+
+    perf_begin();
+    error = fs_file_trunc(&file, 0);
+    if (error)
+        return fail("truncate", error);
+    ops++;
+    perf_end("truncate", 0);
+    fs_file_close(&file);
+    return 0;
+}
+
+static int
+remount(void)
+{
+    int error;
+
+    perf_begin();
+    error = fs_volume_close(&volume);
+    if (!error) {
+        fs_host_arena_reset();
+        memset(&volume, 0, sizeof(volume));
+        error = fs_volume_open(&media.rm.media, &volume, 0, fs_host_alloc);
+    }
+    if (error)
+        return fail("mount", error);
+    ops++;
+    perf_end("mount", 0);
+    return 0;
+}
+
+static int
+bench(const perf_cfg_t* cfg)
+{
+    int error;
+
+    perf_begin();
+    error = fs_volume_format(&media.rm.media, cfg->sectors, buf);
+    if (error)
+        return fail("format", error);
+    ops++;
+    perf_end("format", 0);
+
+    error = remount();
+    if (error)
+        return error;
+    printf("  volume FAT%d, cluster %u bytes, %u bytes of RAM\n",
+        volume.fmp.fat_type, (unsigned)volume.fmp.cluster_size,
+        (unsigned)fs_host_arena_used());
+
+    error = fs_dir_create(&volume, "/BENCH");
+    if (error)
+        return fail("/BENCH", error);
+
+    if ((error = create_small(cfg)) != 0 ||
+        (error = open_small(cfg)) != 0 ||
+        (error = list_dir(cfg)) != 0 ||
+        (error = delete_small(cfg)) != 0 ||
+        (error = seq_write(cfg)) != 0 ||
+        (error = remount()) != 0 ||
+        (error = seq_read(cfg)) != 0 ||
+        (error = rand_read(cfg)) != 0 ||
+        (error = truncate_large(cfg)) != 0)
+        return error;
+
+    return fs_volume_close(&volume);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: fs_perf [options]\n"
+        "  -n sectors   media size in %u byte sectors (1024)\n"
+        "  -f image     use mapped image file instead of memory\n"
+        "  -r us        read latency per sector (0)\n"
+        "  -w us        write latency per sector (0)\n"
+        "  -e us        erase latency per sector (0)\n"
+        "  -c count     small files (64)\n"
+        "  -z bytes     small file size (1000)\n"
+        "  -s kb        large file size (512), its truncate must fit the journal\n"
+        "  -b bytes     large file request size (4096, max %u)\n"
+        "  -q count     random 512 byte reads (1000)\n",
+        SEC_SIZE, PERF_MAX_CHUNK);
+    exit(2);
+}
+
+int
+main(int argc, char** argv)
+{
+    perf_cfg_t cfg = { 1024, NULL, 0, 0, 0, 64, 1000, 512, 4096, 1000 };
+    int i, error;
+
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == 0 || argv[i][2] != 0 || i + 1 >= argc)
+            usage();
+        switch (argv[i++][1]) {
+        case 'n': cfg.sectors = strtoul(argv[i], NULL, 0); break;
+        case 'f': cfg.image = argv[i]; break;
+        case 'r': cfg.read_us = strtoul(argv[i], NULL, 0); break;
+        case 'w': cfg.write_us = strtoul(argv[i], NULL, 0); break;
+        case 'e': cfg.erase_us = strtoul(argv[i], NULL, 0); break;
+        case 'c': cfg.files = strtoul(argv[i], NULL, 0); break;
+        case 'z': cfg.small_size = strtoul(argv[i], NULL, 0); break;
+        case 's': cfg.seq_kb = strtoul(argv[i], NULL, 0); break;
+        case 'b': cfg.chunk = strtoul(argv[i], NULL, 0); break;
+        case 'q': cfg.rand_reads = strtoul(argv[i], NULL, 0); break;
+        default: usage();
+        }
+    }
+    if (cfg.chunk == 0 || cfg.chunk > PERF_MAX_CHUNK || cfg.small_size > PERF_MAX_CHUNK ||
+        cfg.seq_kb == 0 || (cfg.seq_kb * 1024) % cfg.chunk != 0)
+        usage();
+
+    error = fs_host_media_open(&media, cfg.sectors, cfg.image);
+    if (error)
+        return fail(cfg.image ? cfg.image : "media", error);
+    fs_host_media_latency(&media, cfg.read_us, cfg.write_us, cfg.erase_us);
+    memset(buf, 0x5a, sizeof(buf));
+
+#ifdef FATFS_JOURNALING
+    printf("journaling on, ");
+#else
+    printf("journaling off, ");
+#endif
+    printf("%u sectors, latency r/w/e %u/%u/%u us\n",
+        (unsigned)cfg.sectors, (unsigned)cfg.read_us, (unsigned)cfg.write_us, (unsigned)cfg.erase_us);
+    printf("%-12s %8s %10s %8s %8s %8s %8s %8s\n",
+        "workload", "ops", "ops/s", "rd/op", "wr/op", "er/op", "req/op", "MB/s");
+
+    error = bench(&cfg);
+    fs_host_media_close(&media);
+    return error ? 1 : 0;
+}
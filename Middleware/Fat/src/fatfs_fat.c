@@ -28,76 +28,217 @@
  */
 
 #include <errno.h>
+#include <string.h>
 #include "fatfs.h"
 
 /*
- * Read the FAT entry for specified cluster.
+ * Get byte offset of the FAT entry for specified cluster.
  */
+static uint32_t
+fat_entry_pos(struct fatfs_vol *fmp, uint32_t cl)
+{
+    if (FAT32(fmp))
+        return cl * 4;
+    if (FAT16(fmp))
+        return cl * 2;
+    return cl * 3 / 2;
+}
+
+/*
+ * Setup FAT sector cache.
+ * @fmp: fat mount data
+ * @buf: backing memory, cnt * SEC_SIZE bytes
+ * @cnt: number of cache slots
+ */
+void
+fat_cache_init(struct fatfs_vol *fmp, char *buf, int cnt)
+{
+    int i;
+
+    if (cnt > FAT_CACHE_SLOTS)
+        cnt = FAT_CACHE_SLOTS;
+
+    fmp->fat_buf = buf;
+    fmp->fat_cache_cnt = cnt;
+    fmp->fat_clock = 0;
+    for (i = 0; i < cnt; i++) {
+        fmp->fat_cache[i].sec = SEC_INVAL;
+        fmp->fat_cache[i].stamp = 0;
+        fmp->fat_cache[i].dirty = 0;
+        fmp->fat_cache[i].buf = buf + i * SEC_SIZE;
+    }
+}
+
 static int
-read_fat_entry(struct fatfs_vol *fmp, uint32_t cl)
+fat_cache_writeback(struct fatfs_vol *fmp, struct fat_cache *c)
 {
-    uint32_t sec;
-    char *buf = fmp->fat_buf;
-    int error, border = 0;
-    static size_t size = SEC_SIZE;
-
-    /* Get the sector number in FAT entry. */
-    if( FAT32(fmp) ){
-        sec = (cl * 4) / SEC_SIZE;
-    } else if (FAT16(fmp)){
-        sec = (cl * 2) / SEC_SIZE;
-    } else {
-        sec = (cl * 3 / 2) / SEC_SIZE;
-        /*
-         * Check if the entry data is placed at the
-         * end of sector. If so, we have to read one
-         * more sector to get complete FAT12 entry.
-         */
-        if ((cl * 3 / 2) % SEC_SIZE == SEC_SIZE - 1)
-            border = 1;
+    uint32_t size = SEC_SIZE;
+    int error;
+
+    if (!c->dirty)
+        return 0;
+
+    error = fmp->dev->write(fmp->dev, c->buf, &size, c->sec);
+    if (error)
+        return error;
+
+    c->dirty = 0;
+    return 0;
+}
+
+/*
+ * Write all modified FAT sectors to the device.
+ */
+int
+fat_cache_flush(struct fatfs_vol *fmp)
+{
+    fs_media_iov_t iov[FAT_CACHE_SLOTS];
+    unsigned int i, cnt = 0;
+    int error;
+
+    /* All dirty sectors go to the media as one batch. */
+    for (i = 0; i < fmp->fat_cache_cnt; i++) {
+        if (!fmp->fat_cache[i].dirty)
+            continue;
+        iov[cnt].blkno = fmp->fat_cache[i].sec;
+        iov[cnt].buf = fmp->fat_cache[i].buf;
+        iov[cnt].size = SEC_SIZE;
+        cnt++;
     }
-    sec += fmp->fat_start;
+    if (cnt == 0)
+        return 0;
 
-    /* Read first sector. */
-    if ((error = fmp->dev->read(fmp->dev, buf, &size, sec)) != 0)
+    error = fs_media_writev(fmp->dev, iov, cnt);
+    if (error)
         return error;
 
-    if (!FAT12(fmp) || border == 0)
+    for (i = 0; i < fmp->fat_cache_cnt; i++)
+        fmp->fat_cache[i].dirty = 0;
+    return 0;
+}
+
+/*
+ * End an operation on a volume without journal: the FAT sectors it changed
+ * are written back. Returns status, or the write-back error.
+ */
+int
+fatfs_commit_direct(struct fatfs_vol *fmp, int status)
+{
+    int error;
+
+    fmp->gen++;
+    fat_resv_clear(fmp);
+    error = fat_cache_flush(fmp);
+    return status ? status : error;
+}
+
+/*
+ * Drop all cached FAT sectors without writing them back.
+ */
+void
+fat_cache_invalidate(struct fatfs_vol *fmp)
+{
+    int i;
+
+    for (i = 0; i < fmp->fat_cache_cnt; i++) {
+        fmp->fat_cache[i].sec = SEC_INVAL;
+        fmp->fat_cache[i].stamp = 0;
+        fmp->fat_cache[i].dirty = 0;
+    }
+}
+
+/*
+ * Get cache slot holding specified FAT sector.
+ * The least recently used slot is replaced on miss.
+ */
+static int
+fat_cache_get(struct fatfs_vol *fmp, uint32_t sec, struct fat_cache **slot)
+{
+    struct fat_cache *c, *victim;
+    uint32_t size = SEC_SIZE;
+    int i, error;
+
+    victim = &fmp->fat_cache[0];
+    for (i = 0; i < fmp->fat_cache_cnt; i++) {
+        c = &fmp->fat_cache[i];
+        if (c->sec == sec) {
+            c->stamp = ++fmp->fat_clock;
+            *slot = c;
+            return 0;
+        }
+        if (c->stamp < victim->stamp)
+            victim = c;
+    }
+
+    /* Miss: write back and reuse the oldest slot. */
+    if ((error = fat_cache_writeback(fmp, victim)) != 0)
+        return error;
+
+    victim->sec = SEC_INVAL;
+    victim->stamp = 0;
+    if ((error = fmp->dev->read(fmp->dev, victim->buf, &size, sec)) != 0)
+        return error;
+
+    victim->sec = sec;
+    victim->stamp = ++fmp->fat_clock;
+    *slot = victim;
+    return 0;
+}
+
+/*
+ * Read the raw FAT entry for specified cluster.
+ * For FAT12 the returned value is the 16-bit word containing the entry.
+ */
+static int
+read_fat_entry(struct fatfs_vol *fmp, uint32_t cl, uint32_t *val)
+{
+    struct fat_cache *c;
+    uint32_t pos, sec, offset;
+    uint8_t lo;
+    int error;
+
+    pos = fat_entry_pos(fmp, cl);
+    sec = fmp->fat_start + pos / SEC_SIZE;
+    offset = pos % SEC_SIZE;
+
+    if ((error = fat_cache_get(fmp, sec, &c)) != 0)
+        return error;
+
+    if (FAT32(fmp)) {
+        *val = *((uint32_t *)(c->buf + offset));
+        return 0;
+    }
+    if (offset != SEC_SIZE - 1) {
+        *val = *((uint16_t *)(c->buf + offset));
         return 0;
+    }
 
-    /* Read second sector for the border entry of FAT12. */
-    if ((error = fmp->dev->read(fmp->dev, buf + SEC_SIZE, &size, sec + 1)) != 0)
+    /*
+     * FAT12 entry placed at the end of sector. The high
+     * byte is stored in the first byte of next sector.
+     */
+    lo = (uint8_t)c->buf[offset];
+    if ((error = fat_cache_get(fmp, sec + 1, &c)) != 0)
         return error;
 
+    *val = lo | ((uint32_t)(uint8_t)c->buf[0] << 8);
     return 0;
 }
 
 int
 write_fat_entry_direct(struct fatfs_vol *fmp, uint32_t cl, uint32_t offset, uint32_t val)
 {
+    struct fat_cache *c;
     uint32_t sec;
-    char *buf = fmp->fat_buf;
-    int error, border = 0;
-    size_t size = SEC_SIZE;
     uint32_t tmp;
+    int error;
 
-    if ((error = read_fat_entry(fmp, cl)) != 0)
-        return error;
+    sec = fmp->fat_start + fat_entry_pos(fmp, cl) / SEC_SIZE;
 
-    /* Get the sector number in FAT entry. */
-    if(FAT32(fmp)){
-        sec = (cl * 4) / SEC_SIZE;
-        *((uint32_t *)(buf + offset)) = val;
-    } else if (FAT16(fmp)){
-        sec = (cl * 2) / SEC_SIZE;
-        *((uint16_t *)(buf + offset)) = val;
-    } else {
-        sec = (cl * 3 / 2) / SEC_SIZE;
-        /* Check if border entry for FAT12 */
-        if ((cl * 3 / 2) % SEC_SIZE == SEC_SIZE - 1)
-            border = 1;
+    if (FAT12(fmp)) {
+        if ((error = read_fat_entry(fmp, cl, &tmp)) != 0)
+            return error;
 
-        tmp = *((uint16_t *)(buf + offset));
         if (cl & 1) {
             val <<= 4;
             val |= (tmp & 0xf);
@@ -105,21 +246,25 @@ write_fat_entry_direct(struct fatfs_vol *fmp, uint32_t cl, uint32_t offset, uint
             tmp &= 0xf000;
             val |= tmp;
         }
-
-        *((uint16_t *)(buf + offset)) = val;
     }
-    sec += fmp->fat_start;
 
-    /* Write first sector. */
-    if ((error = fmp->dev->write(fmp->dev, buf, &size, sec)) != 0)
+    if ((error = fat_cache_get(fmp, sec, &c)) != 0)
         return error;
 
-    if (!FAT12(fmp) || border == 0)
-        return 0;
-
-    /* Write second sector for the border entry of FAT12. */
-    error = fmp->dev->write(fmp->dev, buf + SEC_SIZE, &size, sec + 1);
-    return error;
+    if (FAT32(fmp)) {
+        *((uint32_t *)(c->buf + offset)) = val;
+    } else if (offset != SEC_SIZE - 1) {
+        *((uint16_t *)(c->buf + offset)) = val;
+    } else {
+        /* Border entry for FAT12 spans two sectors. */
+        c->buf[offset] = (char)(val & 0xff);
+        c->dirty = 1;
+        if ((error = fat_cache_get(fmp, sec + 1, &c)) != 0)
+            return error;
+        c->buf[0] = (char)(val >> 8);
+    }
+    c->dirty = 1;
+    return 0;
 }
 
 /*
@@ -131,41 +276,133 @@ write_fat_entry_direct(struct fatfs_vol *fmp, uint32_t cl, uint32_t offset, uint
 int
 fat_next_cluster(struct fatfs_vol *fmp, uint32_t cl, uint32_t *next)
 {
-    uint32_t offset;
     uint32_t val;
     int error;
 
     /* Read FAT entry */
-    error = read_fat_entry(fmp, cl);
+    error = read_fat_entry(fmp, cl, &val);
     if (error)
         return error;
 
-    /* Get offset in buffer. */
-    if(FAT32(fmp)){
-        offset = (cl * 4) % SEC_SIZE;
-        val = *((uint32_t *)(fmp->fat_buf + offset));
-        *next = (uint32_t)val;
-    }else{
-        if (FAT16(fmp))
-            offset = (cl * 2) % SEC_SIZE;
+    /* Adjust data for FAT12 entry */
+    if (FAT12(fmp)) {
+        if (cl & 1)
+            val >>= 4;
         else
-            offset = (cl * 3 / 2) % SEC_SIZE;
+            val &= 0xfff;
+    }
+    *next = val;
+    DPRINTF(("fat_next_cluster: %d => %d\n", cl, *next));
+    return 0;
+}
 
-        val = *((uint16_t *)(fmp->fat_buf + offset));
+/*
+ * Update in-RAM free map for the cluster if the map is valid.
+ */
+static void
+fat_map_update(struct fatfs_vol *fmp, uint32_t cl, uint32_t next)
+{
+    if (!fmp->free_map_valid || cl >= fmp->last_cluster)
+        return;
 
-        /* Adjust data for FAT12 entry */
-        if (FAT12(fmp)) {
-            if (cl & 1)
-                val >>= 4;
-            else
-                val &= 0xfff;
-        }
-        *next = (uint32_t)val;
+    if (next == CL_FREE)
+        fmp->free_map[cl / 8] &= ~(1 << (cl % 8));
+    else
+        fmp->free_map[cl / 8] |= (1 << (cl % 8));
+}
+
+/*
+ * Build in-RAM free map by one pass over the FAT.
+ */
+static int
+fat_map_build(struct fatfs_vol *fmp)
+{
+    uint32_t cl, next;
+    int error;
+
+    memset(fmp->free_map, 0, FREE_MAP_SIZE(fmp));
+    for (cl = CL_FIRST; cl < fmp->last_cluster; cl++) {
+        error = fat_next_cluster(fmp, cl, &next);
+        if (error)
+            return error;
+        if (next != CL_FREE)
+            fmp->free_map[cl / 8] |= (1 << (cl % 8));
     }
-    DPRINTF(("fat_next_cluster: %d => %d\n", cl, *next));
+    fmp->free_map_valid = 1;
     return 0;
 }
 
+/*
+ * Check if the cluster is free.
+ * Uses the free map if present, FAT otherwise. Without the map
+ * the clusters reserved by the open transaction are treated as used,
+ * because with journaling their links are not in FAT yet.
+ */
+static int
+fat_cluster_free(struct fatfs_vol *fmp, uint32_t cl, int *is_free)
+{
+    uint32_t next;
+    int error;
+
+    if (fmp->free_map != NULL) {
+        if (!fmp->free_map_valid && (error = fat_map_build(fmp)) != 0)
+            return error;
+        *is_free = !(fmp->free_map[cl / 8] & (1 << (cl % 8)));
+        return 0;
+    }
+
+    if (cl >= fmp->resv_lo && cl < fmp->resv_hi) {
+        *is_free = 0;
+        return 0;
+    }
+
+    if ((error = fat_next_cluster(fmp, cl, &next)) != 0)
+        return error;
+    *is_free = (next == CL_FREE);
+    return 0;
+}
+
+/*
+ * Mark run as allocated until the transaction is committed.
+ * The free map gets the run itself, the map-less reservation grows
+ * to cover it and may hold some free clusters in between as well.
+ */
+static void
+fat_reserve_run(struct fatfs_vol *fmp, uint32_t cl, uint32_t count)
+{
+    uint32_t i;
+
+    if (fmp->free_map_valid) {
+        for (i = cl; i < cl + count; i++)
+            fmp->free_map[i / 8] |= (1 << (i % 8));
+        return;
+    }
+
+    if (fmp->resv_hi == 0) {
+        fmp->resv_lo = cl;
+        fmp->resv_hi = cl + count;
+        return;
+    }
+    if (cl < fmp->resv_lo)
+        fmp->resv_lo = cl;
+    if (cl + count > fmp->resv_hi)
+        fmp->resv_hi = cl + count;
+}
+
+/*
+ * Get FAT entry offset in sector and the value to store.
+ */
+static uint32_t
+fat_entry_val(struct fatfs_vol *fmp, uint32_t cl, uint32_t next, uint32_t *val)
+{
+    if (FAT32(fmp))
+        *val = (uint32_t)(next & fmp->fat_mask);
+    else
+        *val = (uint16_t)(next & fmp->fat_mask);
+
+    return fat_entry_pos(fmp, cl) % SEC_SIZE;
+}
+
 int
 fat_set_cluster(struct fatfs_vol *fmp, uint32_t cl, uint32_t next)
 {
@@ -173,25 +410,66 @@ fat_set_cluster(struct fatfs_vol *fmp, uint32_t cl, uint32_t next)
     int error;
     uint32_t val;
 
-    /* Get offset in buffer. */
-    if(FAT32(fmp)){
-        offset = (cl * 4) % SEC_SIZE;
-        val = (uint32_t)(next & fmp->fat_mask);
-    }else{
-        if (FAT16(fmp))
-            offset = (cl * 2) % SEC_SIZE;
-        else
-            offset = (cl * 3 / 2) % SEC_SIZE;
-
-        /* Modify FAT entry for target cluster. */
-        val = (uint16_t)(next & fmp->fat_mask);
-    }
+    offset = fat_entry_val(fmp, cl, next, &val);
 
     /* Write FAT entry */
     error = write_fat_entry(fmp, cl, offset, val);
+    if (!error)
+        fat_map_update(fmp, cl, next);
     return error;
 }
 
+/*
+ * Link run of contiguous clusters into the chain.
+ * Cluster cl + i points to cl + i + 1, the last one points to @last.
+ */
+int
+fat_link_run_direct(struct fatfs_vol *fmp, uint32_t cl, uint32_t count, uint32_t last)
+{
+    uint32_t i, offset, val, next;
+    int error;
+
+    for (i = 0; i < count; i++) {
+        next = (i == count - 1) ? last : cl + i + 1;
+        offset = fat_entry_val(fmp, cl + i, next, &val);
+        error = write_fat_entry_direct(fmp, cl + i, offset, val);
+        if (error)
+            return error;
+        fat_map_update(fmp, cl + i, next);
+    }
+    return 0;
+}
+
+/*
+ * Rewrite sector of FAT copies which differs from the first FAT.
+ * @idx: sector index in FAT
+ * @fixed: incremented for each rewritten sector
+ */
+int
+fat_mirror_sector(struct fatfs_vol *fmp, uint32_t idx, uint32_t *fixed)
+{
+    struct fat_cache *c;
+    uint32_t i, sec, size;
+    int error;
+
+    if ((error = fat_cache_get(fmp, fmp->fat_start + idx, &c)) != 0)
+        return error;
+
+    for (i = 1; i < fmp->fat_copies; i++) {
+        sec = fmp->fat_start + i * fmp->fat_sectors + idx;
+        size = SEC_SIZE;
+        if ((error = fmp->dev->read(fmp->dev, fmp->io_buf, &size, sec)) != 0)
+            return error;
+        if (memcmp(fmp->io_buf, c->buf, SEC_SIZE) == 0)
+            continue;
+        size = SEC_SIZE;
+        if ((error = fmp->dev->write(fmp->dev, c->buf, &size, sec)) != 0)
+            return error;
+        (*fixed)++;
+    }
+    return 0;
+}
+
 /*
  * Allocate free cluster in FAT chain.
  *
@@ -202,28 +480,64 @@ fat_set_cluster(struct fatfs_vol *fmp, uint32_t cl, uint32_t next)
 int
 fat_alloc_cluster(struct fatfs_vol *fmp, uint32_t scan_start, uint32_t *free)
 {
-    uint32_t cl, next;
-    int error;
+    uint32_t len;
+
+    return fat_alloc_run(fmp, scan_start, 1, free, &len);
+}
 
-    if (scan_start == 0)
-        scan_start = fmp->free_scan;
+/*
+ * Find run of free clusters (next-fit). The run is contiguous and has
+ * up to @count clusters. Clusters are reserved until commit, so runs
+ * returned within one transaction never overlap even if the FAT is
+ * not updated yet.
+ *
+ * @fmp: fat mount data
+ * @hint: cluster# to scan after. If 0, use the previous used value.
+ * @count: number of clusters wanted
+ * @first: first cluster# of the run to return
+ * @len: length of the run to return
+ */
+int
+fat_alloc_run(struct fatfs_vol *fmp, uint32_t hint, uint32_t count, uint32_t *first, uint32_t *len)
+{
+    uint32_t cl, n;
+    int error, is_free;
 
-    DPRINTF(("fat_alloc_cluster: start=%d\n", scan_start));
+    if (hint == 0)
+        hint = fmp->free_scan;
 
-    cl = scan_start + 1;
-    while (cl != scan_start) {
-        error = fat_next_cluster(fmp, cl, &next);
+    DPRINTF(("fat_alloc_run: start=%d count=%d\n", hint, count));
+
+    cl = hint + 1;
+    if (cl >= fmp->last_cluster)
+        cl = CL_FIRST;
+    while (cl != hint) {
+        error = fat_cluster_free(fmp, cl, &is_free);
         if (error)
             return error;
-        if (next == CL_FREE) {  /* free ? */
-            DPRINTF(("fat_alloc_cluster: free cluster=%d\n", cl));
-            *free = cl;
-            return 0;
-        }
+        if (is_free)
+            break;
         if (++cl >= fmp->last_cluster)
             cl = CL_FIRST;
     }
-    return ENOSPC;      /* no space */
+    if (cl == hint)
+        return ENOSPC;      /* no space */
+
+    /* Extend the run as far as possible. */
+    for (n = 1; n < count && cl + n < fmp->last_cluster; n++) {
+        error = fat_cluster_free(fmp, cl + n, &is_free);
+        if (error)
+            return error;
+        if (!is_free)
+            break;
+    }
+
+    DPRINTF(("fat_alloc_run: free cluster=%d len=%d\n", cl, n));
+    fat_reserve_run(fmp, cl, n);
+    fmp->free_scan = cl + n - 1;
+    *first = cl;
+    *len = n;
+    return 0;
 }
 
 /*
@@ -250,12 +564,6 @@ fat_free_clusters(struct fatfs_vol *fmp, uint32_t start)
             return error;
         cl = next;
     }
-    /* Clear eof */
-    if(!FAT32(fmp)){
-        error = fat_set_cluster(fmp, cl, CL_FREE);
-        if (error)
-            return error;
-    }
     return 0;
 }
 
@@ -290,6 +598,51 @@ fat_seek_cluster(struct fatfs_vol *fmp, uint32_t start, uint32_t offset, uint32_
     return 0;
 }
 
+/*
+ * Get the cluster# for the specific file offset starting from
+ * the cursor position if it is not beyond the target offset.
+ * The cursor is updated to the found cluster.
+ *
+ * @fmp: fat mount data
+ * @start: start cluster# of file.
+ * @cur: file cursor, may be NULL
+ * @offset: file offset
+ * @cl: cluster# to return
+ */
+int
+fat_seek_cursor(struct fatfs_vol *fmp, uint32_t start, struct fatfs_cursor *cur, uint32_t offset, uint32_t *cl)
+{
+    int error;
+    uint32_t c, pos, target;
+
+    if (cur == NULL)
+        return fat_seek_cluster(fmp, start, offset, cl);
+
+    target = offset - offset % fmp->cluster_size;
+    if (cur->cl >= CL_FIRST && cur->offset <= target) {
+        c = cur->cl;
+        pos = cur->offset;
+    } else {
+        c = start;
+        pos = 0;
+    }
+
+    if (c > fmp->last_cluster)
+        return EIO;
+
+    for (; pos < target; pos += fmp->cluster_size) {
+        error = fat_next_cluster(fmp, c, &c);
+        if (error)
+            return error;
+        if (IS_EOFCL(fmp, c))
+            return EIO;
+    }
+    cur->cl = c;
+    cur->offset = target;
+    *cl = c;
+    return 0;
+}
+
 /*
  * Expand file size.
  *
@@ -300,31 +653,34 @@ fat_seek_cluster(struct fatfs_vol *fmp, uint32_t start, uint32_t offset, uint32_
 int
 fat_expand_file(struct fatfs_vol *fmp, uint32_t cl, int size)
 {
-    int i, cl_len, alloc, error;
-    uint32_t next;
+    int i, cl_len, error;
+    uint32_t next, first, len, need;
 
-    alloc = 0;
     cl_len = size / fmp->cluster_size + 1;
 
-    for (i = 0; i < cl_len; i++) {
+    /* Find the last cluster of the existing chain. */
+    for (i = 1; i < cl_len; i++) {
         error = fat_next_cluster(fmp, cl, &next);
         if (error)
             return error;
-        if (alloc || next >= fmp->fat_eof) {
-            error = fat_alloc_cluster(fmp, cl, &next);
-            if (error)
-                return error;
-            alloc = 1;
-        }
-        if (alloc) {
-            error = fat_set_cluster(fmp, cl, next);
-            if (error)
-                return error;
-        }
+        if (IS_EOFCL(fmp, next))
+            break;
         cl = next;
     }
-    if (alloc)
-        fat_set_cluster(fmp, cl, fmp->fat_eof); /* add eof */
+
+    /* Allocate missing clusters by contiguous runs. */
+    for (need = cl_len - i; need > 0; need -= len) {
+        error = fat_alloc_run(fmp, cl, need, &first, &len);
+        if (error)
+            return error;
+        error = fat_link_run(fmp, first, len, fmp->fat_eof);
+        if (error)
+            return error;
+        error = fat_set_cluster(fmp, cl, first);
+        if (error)
+            return error;
+        cl = first + len - 1;
+    }
     DPRINTF(("fat_expand_file: new size=%d\n", size));
     return 0;
 }
@@ -28,6 +28,7 @@ enum
     FATFS_OP_UPDATE_DIRENT,
     FATFS_MARKER_DONE,
     FATFS_MARKER_COMMIT,
+    FATFS_OP_LINK_RUN,      /* New codes are appended to keep old logs valid. */
 };
 
 int fat_read_bpb(
@@ -72,6 +73,14 @@ struct jentry
             uint32_t cl;
         }
         fill;
+
+        struct
+        {
+            uint32_t cl;
+            uint32_t count;
+            uint32_t last;
+        }
+        run;
     }
     data;
 };
@@ -79,6 +88,7 @@ struct jentry
 struct jheader
 {
     uint32_t timestamp;
+    uint32_t tx_start;      /* Slot of last transaction start + 1, 0 if unknown. */
 };
 
 static struct jentry*
@@ -101,6 +111,62 @@ next_slot(struct fatfs_vol* fmp, uint32_t slot)
     return (slot + 1) % fmp->j_capacity;
 }
 
+/* Write buffered journal sector to the media. */
+static int
+tx_flush(struct fatfs_vol* fmp)
+{
+    uint32_t sz = SEC_SIZE;
+    int err = 0;
+
+    if (fmp->j_dirty)
+    {
+        struct jheader* header = (struct jheader*) fmp->j_buf;
+        header->tx_start = fmp->j_start + 1;
+
+        err = fmp->dev->write(
+            fmp->dev, 
+            fmp->j_buf, 
+            &sz, 
+            fmp->j_base_sec + fmp->j_buf_sec
+        );
+
+        if (!err)
+        {
+            fmp->j_dirty = 0;
+        }
+    }
+
+    return err;
+}
+
+/* Make journal sector current in the journal buffer. */
+static int
+tx_load(struct fatfs_vol* fmp, uint32_t sec)
+{
+    uint32_t sz = SEC_SIZE;
+    int err = 0;
+
+    if (fmp->j_buf_sec == sec)
+    {
+        return 0;
+    }
+
+    err = tx_flush(fmp);
+
+    if (!err)
+    {
+        fmp->j_buf_sec = SEC_INVAL;
+        err = fmp->dev->read(fmp->dev, fmp->j_buf, &sz, fmp->j_base_sec + sec);
+    }
+
+    if (!err)
+    {
+        fmp->j_buf_sec = sec;
+    }
+
+    return err;
+}
+
 /* Perform last uncommitted transaction by journal.*/
 static int 
 tx_perform(struct fatfs_vol* fmp)
@@ -110,20 +176,14 @@ tx_perform(struct fatfs_vol* fmp)
     
     for (i = fmp->j_start; i != fmp->j_end; i = next_slot(fmp, i))
     {
-        size_t size = SEC_SIZE;
         const uint32_t sec = i / JENTRY_PER_SEC;
         const uint32_t index = i % JENTRY_PER_SEC;
 
-        error = fmp->dev->read(
-            fmp->dev, 
-            fmp->io_buf, 
-            &size, 
-            fmp->j_base_sec + sec
-        );
+        error = tx_load(fmp, sec);
 
         if (!error)
         {
-            const struct jentry* e = journal_entry(fmp->io_buf, index);
+            const struct jentry* e = journal_entry(fmp->j_buf, index);
 
             switch (e->op)
             {
@@ -141,6 +201,15 @@ tx_perform(struct fatfs_vol* fmp)
                 );
                 break;
 
+            case FATFS_OP_LINK_RUN:
+                error = fat_link_run_direct(
+                    fmp, 
+                    e->data.run.cl, 
+                    e->data.run.count, 
+                    e->data.run.last
+                );
+                break;
+
             case FATFS_OP_FILL_DIRENTS:
                 error = fat_empty_dirents_direct(fmp, e->data.fill.cl);
                 break;
@@ -164,9 +233,14 @@ tx_perform(struct fatfs_vol* fmp)
     return error;
 }
 
-/* Write next journal entry to the storage media.
+/* Put next journal entry to the journal buffer.
  * When write boundary become aligned with logical sector then
  * sector timestamp is automatically emitted.
+ * Buffered entries are written to the media when the buffer moves to
+ * another sector and by DONE marker, so a whole transaction usually
+ * costs one sector write. COMMIT marker stays in the buffer and goes
+ * to the media with the next transaction: if it is lost, the already
+ * performed transaction is just redone at mount.
  */
 static int 
 tx_emit(struct fatfs_vol* fmp, const struct jentry *e)
@@ -174,24 +248,37 @@ tx_emit(struct fatfs_vol* fmp, const struct jentry *e)
     const uint32_t tail = next_slot(fmp, fmp->j_end);
     const uint32_t sec = tail / JENTRY_PER_SEC;
     const uint32_t index = tail % JENTRY_PER_SEC;
-    size_t sz = SEC_SIZE;
     int err = 0;
 
     fmp->j_end = tail;
 
-    err = fmp->dev->read(fmp->dev, fmp->io_buf, &sz, fmp->j_base_sec + sec);
-
-    if (!err)
+    if (index == 0)
     {
-        if (index == 0)
+        struct jheader* header = (struct jheader*) fmp->j_buf;
+
+        err = tx_flush(fmp);
+
+        if (!err)
         {
-            struct jheader* header = (struct jheader*) fmp->io_buf;
-            memset(fmp->io_buf, 0, SEC_SIZE);
+            memset(fmp->j_buf, 0, SEC_SIZE);
             header->timestamp = ++fmp->j_timestamp;
+            fmp->j_buf_sec = sec;
         }
+    }
+    else
+    {
+        err = tx_load(fmp, sec);
+    }
 
-        memcpy(journal_entry(fmp->io_buf, index), e, sizeof(*e));
-        err = fmp->dev->write(fmp->dev, fmp->io_buf, &sz, fmp->j_base_sec+sec);
+    if (!err)
+    {
+        memcpy(journal_entry(fmp->j_buf, index), e, sizeof(*e));
+        fmp->j_dirty = 1;
+
+        if (e->op == FATFS_MARKER_DONE)
+        {
+            err = tx_flush(fmp);
+        }
     }
 
     if (e->op == FATFS_MARKER_COMMIT)
@@ -202,6 +289,20 @@ tx_emit(struct fatfs_vol* fmp, const struct jentry *e)
     return err;
 }
 
+/* Write buffered journal entries to the media. */
+int
+fatfs_flush_journal(struct fatfs_vol* fmp)
+{
+    int error = tx_flush(fmp);
+
+    if (!error)
+    {
+        error = fat_cache_flush(fmp);
+    }
+
+    return error;
+}
+
 /* Append next entry to the journal.*/
 static int 
 fatfs_append_journal(struct fatfs_vol* fmp, const struct jentry* e)
@@ -231,11 +332,14 @@ fatfs_append_journal(struct fatfs_vol* fmp, const struct jentry* e)
     return tx_emit(fmp, e);
 }
 
-/* Perform and commit last transaction.*/
-void 
+/* Perform and commit last transaction. Returns status, or EIO if the
+ * transaction could not be committed.*/
+int 
 fatfs_commit_journal(struct fatfs_vol* fmp, int status)
 {
     int error = 0;
+
+    fmp->gen++;
    
     do
     {
@@ -256,6 +360,14 @@ fatfs_commit_journal(struct fatfs_vol* fmp, int status)
             {
                 break;
             }
+
+            /* FAT changes must reach the media before COMMIT. */
+            error = fat_cache_flush(fmp);
+
+            if (error)
+            {
+                break;
+            }
         }
 
         e.op = FATFS_MARKER_COMMIT;
@@ -267,6 +379,19 @@ fatfs_commit_journal(struct fatfs_vol* fmp, int status)
     {
         fmp->j_readonly = 1;
     }
+
+    fat_resv_clear(fmp);
+
+    /* Free map may contain changes of the dropped transaction. */
+    if (status || error)
+    {
+        fat_map_invalidate(fmp);
+        fat_index_invalidate(fmp);
+    }
+
+    if (status)
+        return status;
+    return error ? EIO : 0;
 }
 
 int
@@ -308,27 +433,67 @@ write_fat_entry_deferred(
     return fatfs_append_journal(fmp, &e);
 }
 
-/* Finds sector containing last valid timestamp. */
+int
+fat_link_run_deferred(
+    struct fatfs_vol *fmp, 
+    uint32_t cl, 
+    uint32_t count, 
+    uint32_t last)
+{
+    struct jentry e = { FATFS_OP_LINK_RUN };
+    uint32_t i;
+    int error;
+
+    e.data.run.cl = cl;
+    e.data.run.count = count;
+    e.data.run.last = last;
+
+    error = fatfs_append_journal(fmp, &e);
+
+    /* Keep free map in sync with the deferred FAT state. */
+    if (!error && fmp->free_map_valid)
+    {
+        for (i = cl; i < cl + count; ++i)
+        {
+            fmp->free_map[i / 8] |= (1 << (i % 8));
+        }
+    }
+
+    return error;
+}
+
+/* Finds sector containing last valid timestamp.
+ * Sector timestamps grow by one per sector around the circular journal,
+ * so the head is found by binary search in O(log n) sector reads.
+ */
 static int 
 find_last_timestamp(struct fatfs_vol* fmp, uint32_t* sec)
 {
-    size_t size = SEC_SIZE;
+    uint32_t size = SEC_SIZE;
     const uint32_t base = fmp->j_base_sec;
     uint32_t l = 0;
-    uint32_t r = (fmp->j_capacity / JENTRY_PER_SEC) - 1;
+    uint32_t r = fmp->j_capacity / JENTRY_PER_SEC;  /* Exclusive, so the last sector is probed too. */
+    uint32_t L = 0;
+    uint32_t wrap = 0;
 
     /* Read journal sector with highest number. */
-    int error = fmp->dev->read(fmp->dev, fmp->io_buf, &size, r + base);
+    int error = fmp->dev->read(fmp->dev, fmp->io_buf, &size, r - 1 + base);
 
-    /* Journal is overwritten at least once if last slot is not zeroed. */
-    const uint32_t wrap = journal_entry(fmp->io_buf, JENTRY_PER_SEC - 1)->op;
+    if (!error)
+    {
+        /* Journal is overwritten at least once if last slot is not zeroed. */
+        wrap = journal_entry(fmp->io_buf, JENTRY_PER_SEC - 1)->op;
+        error = fmp->dev->read(fmp->dev, fmp->io_buf, &size, l + base);
+    }
 
     if (!error)
     {
+        L = sector_timestamp(fmp->io_buf);
+
         while (r - l > 1)
         {
             const uint32_t m = (l + r) / 2;
-            uint32_t M, L, V;
+            uint32_t M, V;
             int left;
 
             error = fmp->dev->read(fmp->dev, fmp->io_buf, &size, m + base);
@@ -341,15 +506,6 @@ find_last_timestamp(struct fatfs_vol* fmp, uint32_t* sec)
             M = sector_timestamp(fmp->io_buf);
             V = journal_entry(fmp->io_buf, 0)->op;
 
-            error = fmp->dev->read(fmp->dev, fmp->io_buf, &size, l + base);
-
-            if (error)
-            {
-                break;
-            }
-
-            L = sector_timestamp(fmp->io_buf);
-
             left = wrap ? (M != (L + m - l)) : (V == 0);
 
             if (left)
@@ -359,12 +515,13 @@ find_last_timestamp(struct fatfs_vol* fmp, uint32_t* sec)
             else
             {
                 l = m;
+                L = M;
             }
         }
     }
 
     *sec = l;
-    fmp->j_timestamp = sector_timestamp(fmp->io_buf);
+    fmp->j_timestamp = L;
 
     return error;
 }
@@ -374,7 +531,7 @@ static int
 find_last_tx(struct fatfs_vol* fmp, uint32_t s, uint32_t* last_op)
 {
     int i = 0;
-    size_t sz = SEC_SIZE;
+    uint32_t sz = SEC_SIZE;
     int error = fmp->dev->read(fmp->dev, fmp->io_buf, &sz, fmp->j_base_sec + s);
 
     if (!error)
@@ -401,22 +558,40 @@ find_last_tx(struct fatfs_vol* fmp, uint32_t s, uint32_t* last_op)
     return error;
 }
 
-/* Finds start of transaction marked by j_end. */
+/* Finds start of transaction marked by j_end.
+ * Sector header of the last written sector keeps start slot of the
+ * transaction, so usually no extra reads are needed. Journals written
+ * without this field are scanned backwards for COMMIT marker.
+ */
 static int 
 find_tx_start(struct fatfs_vol* fmp)
 {
     uint32_t sz = SEC_SIZE;
     uint32_t index = fmp->j_end;
     uint32_t sec_remain = fmp->j_capacity / JENTRY_PER_SEC;
+    uint32_t s = index / JENTRY_PER_SEC;
     int found = 0;
     int error = 0;
 
-    while (!found && sec_remain--)
+    error = fmp->dev->read(fmp->dev, fmp->io_buf, &sz, s + fmp->j_base_sec);
+
+    if (!error)
+    {
+        const struct jheader* header = (const struct jheader*) fmp->io_buf;
+
+        if (header->tx_start != 0 && header->tx_start <= fmp->j_capacity)
+        {
+            fmp->j_start = header->tx_start - 1;
+            return 0;
+        }
+    }
+
+    while (!error && !found && sec_remain--)
     {
         int i = 0;
-        uint32_t s = index / JENTRY_PER_SEC;
         uint32_t offset = index % JENTRY_PER_SEC;
-        
+
+        s = index / JENTRY_PER_SEC;
         error = fmp->dev->read(fmp->dev, fmp->io_buf, &sz, s + fmp->j_base_sec);
 
         if (error)
@@ -424,25 +599,23 @@ find_tx_start(struct fatfs_vol* fmp)
             break;
         }
 
-        for (i = offset; i >= 0; i--, index--)
+        for (i = offset; i >= 0; i--)
         {
             const struct jentry* e = journal_entry(fmp->io_buf, i);
 
             if (e->op == FATFS_MARKER_COMMIT)
             {
-                fmp->j_start = i;
+                fmp->j_start = s * JENTRY_PER_SEC + i;
                 found = 1;
                 break;
             }
         }
 
-        if (index < 0)
-        {
-            index = fmp->j_capacity - 1;
-        }
+        /* Continue from the last slot of previous sector. */
+        index = (s == 0) ? fmp->j_capacity - 1 : s * JENTRY_PER_SEC - 1;
     }
 
-    if (!found)
+    if (!error && !found)
     {
         error = EBUSY;
     }
@@ -504,6 +677,8 @@ fatfs_check(struct fatfs_vol* fmp)
 
         fmp->j_base_sec = cl_to_sec(fmp, DE_CLUSTER(&j.dirent));
         fmp->j_capacity = (j.dirent.size / SEC_SIZE) * JENTRY_PER_SEC;
+        fmp->j_buf_sec = SEC_INVAL;
+        fmp->j_dirty = 0;
 
         /* Try find sector with latest timestamp. */
         error = find_last_timestamp(fmp, &last_sec);
@@ -567,10 +742,22 @@ fatfs_check(struct fatfs_vol* fmp)
             break;
         }
 
+        error = fat_cache_flush(fmp);
+
+        if (error)
+        {
+            break;
+        }
+
         error = tx_emit(fmp, &commit);
     }
     while (0);
 
+    if (!error)
+    {
+        error = tx_flush(fmp);
+    }
+
     fmp->j_readonly = (error != 0);
 
     return error;
@@ -643,17 +830,34 @@ fatfs_create_journal(fs_media_t* dev, void* buf)
     struct fatfs_vol temp_mp;
     int err = fat_read_bpb(&temp_mp, buf);
 
+    if (err)
+    {
+        return err;
+    }
+
     /* File creation uses no more than one sector buffer. */
     temp_mp.dev = dev;
     temp_mp.dir_buf = buf;
-    temp_mp.fat_buf = buf;
     temp_mp.io_buf = buf;
+    temp_mp.free_map = NULL;
+    temp_mp.free_map_valid = 0;
+    fat_index_init(&temp_mp, NULL);
+    fat_cache_init(&temp_mp, buf, 1);
 
     journal_clusters = 
         ((temp_mp.last_cluster / JOURNAL_PART) / JENTRY_PER_SEC) / 
             (temp_mp.cluster_size / SEC_SIZE);
 
-    for (i = 0; i < journal_clusters; ++i)
+    /* The buffer is cleared when the ring wraps to the next sector, so 
+     * with a single sector a transaction crossing the wrap would erase 
+     * its own entries. 
+     */
+    if (journal_clusters * temp_mp.sec_per_cl < 2)
+    {
+        journal_clusters = (2 + temp_mp.sec_per_cl - 1) / temp_mp.sec_per_cl;
+    }
+
+    for (i = 0; i < journal_clusters && !err; ++i)
     {
         const uint32_t cl = i + JOURNAL_CL;
         uint32_t offset = 0;
@@ -670,7 +874,22 @@ fatfs_create_journal(fs_media_t* dev, void* buf)
                 offset = (cl * 3 / 2) % SEC_SIZE;
         }
 
-        write_fat_entry_direct(&temp_mp, cl, offset, 0xfffffff7);
+        err = write_fat_entry_direct(&temp_mp, cl, offset, CL_BAD & temp_mp.fat_mask);
+    }
+
+    /* The cache slot shares memory with dirent buffer. 
+     * The journal chain must reach the media before the dirent refers to it.
+     */
+    if (!err)
+    {
+        err = fat_cache_flush(&temp_mp);
+    }
+
+    fat_cache_invalidate(&temp_mp);
+
+    if (err)
+    {
+        return err;
     }
 
     err = fatfs_insert_dirent(
@@ -680,14 +899,24 @@ fatfs_create_journal(fs_media_t* dev, void* buf)
         FA_HIDDEN | FA_SYSTEM
     );
 
+    if (!err)
+    {
+        err = fat_cache_flush(&temp_mp);
+    }
+
+    if (err)
+    {
+        return err;
+    }
+
     /* Fill journal with zeros and emit commit mark to indicate that no
      * pending transactions are active.
      */
     memset(buf, 0, SEC_SIZE);
 
-    for (i = 0; i < temp_mp.sec_per_cl * journal_clusters; ++i)
+    for (i = 0; i < temp_mp.sec_per_cl * journal_clusters && !err; ++i)
     {
-        size_t size = SEC_SIZE;
+        uint32_t size = SEC_SIZE;
         const uint32_t sec = cl_to_sec((&temp_mp), CL_FIRST + 1);
         journal_entry(buf, 0)->op = (i == 0) ? FATFS_MARKER_COMMIT : FATFS_NOOP;
         err = dev->write(dev, buf, &size, sec + i);
@@ -58,6 +58,110 @@ round_sectors(size_t bytes)
     return (bytes + SEC_SIZE - 1) / SEC_SIZE;
 }
 
+/*
+ * Write one sector. Sectors known to be erased are programmed 
+ * without erase when the media supports it.
+ */
+static int 
+write_sector(fs_media_t* dev, void* buf, uint32_t sec, int blank)
+{
+    uint32_t len = SEC_SIZE;
+
+    if (blank && dev->program)
+    {
+        return dev->program(dev, buf, &len, sec);
+    }
+
+    return dev->write(dev, buf, &len, sec);
+}
+
+/*
+ * Check if the sector is erased (all bytes are 0xff).
+ */
+static int 
+sector_is_blank(const void* buf)
+{
+    const uint32_t* p = buf;
+    uint32_t i;
+
+    for (i = 0; i < SEC_SIZE / sizeof(uint32_t); ++i)
+    {
+        if (p[i] != 0xffffffff)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Erase sectors run, by one request if the media supports it.
+ */
+static int 
+erase_run(fs_media_t* dev, uint32_t base_sec, uint32_t count, void* buf)
+{
+    uint32_t i;
+    uint32_t len = SEC_SIZE;
+
+    if (dev->erase_range)
+    {
+        return dev->erase_range(dev, base_sec, count) ? EIO : 0;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        if (dev->sector_erase(dev, buf, &len, base_sec + i))
+        {
+            return EIO;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Make sectors blank. Sectors which are already erased are skipped, 
+ * others are erased by runs.
+ */
+static int 
+blank_sectors(fs_media_t* dev, uint32_t base_sec, uint32_t count, void* buf)
+{
+    uint32_t i;
+    uint32_t run = 0;
+    uint32_t len = SEC_SIZE;
+    int error = 0;
+
+    for (i = 0; i < count && !error; ++i)
+    {
+        error = dev->read(dev, buf, &len, base_sec + i);
+
+        if (error)
+        {
+            return EIO;
+        }
+
+        if (!sector_is_blank(buf))
+        {
+            ++run;
+            continue;
+        }
+
+        if (run)
+        {
+            error = erase_run(dev, base_sec + i - run, run, buf);
+            run = 0;
+        }
+    }
+
+    if (!error && run)
+    {
+        error = erase_run(dev, base_sec + count - run, run, buf);
+    }
+
+    return error;
+}
+
 /*
  * Copies "count" sectors from source to destination.
  */
@@ -67,7 +171,8 @@ copy_sectors(
     uint32_t from, 
     uint32_t to, 
     uint32_t count, 
-    void* buf)
+    void* buf,
+    int blank)
 {
     uint32_t i;
     uint32_t len = SEC_SIZE;
@@ -82,7 +187,7 @@ copy_sectors(
             return EIO;
         }
 
-        error = dev->write(dev, buf, &len, to);
+        error = write_sector(dev, buf, to, blank);
 
         if (error)
         {
@@ -201,17 +306,17 @@ setup_bpb(
     fs_media_t* dev, 
     uint32_t sect_num, 
     const fatfs_layout_t* layout, 
-    void* sec_buf)
+    void* sec_buf,
+    int blank)
 {
     uint8_t* bytes = sec_buf;
     struct fat_bpb* bpb = sec_buf;
-    uint32_t len = SEC_SIZE;
 
     memset(bytes, 0, SEC_SIZE);
 
     bpb->jmp_instruction = 0xfeeb;
     bpb->nop_instruction = 0x90;
-    memcpy(bpb->oem_id, "JFAT    ", 11);
+    memcpy(bpb->oem_id, "JFAT    ", sizeof(bpb->oem_id));
     bpb->bytes_per_sector = SEC_SIZE;
     bpb->sectors_per_cluster = 1 << layout->log2_sec_per_cluster;
     bpb->reserved_sectors = FAT32(layout) ? 32 : 1;
@@ -240,7 +345,7 @@ setup_bpb(
 
 	bytes[0x1fe] = 0x55;
 	bytes[0x1ff] = 0xaa;
-    return dev->write(dev, bytes, &len, 0);
+    return write_sector(dev, bytes, 0, blank);
 }
 
 /*
@@ -270,11 +375,10 @@ fat12_cl_set(uint8_t* buf, int bit_offset)
  * invalid (ff7 code).
  */
 static int 
-init_fat12(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
+init_fat12(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf, int blank)
 {
     uint8_t* buf = sec_buf;
     uint8_t i = 0;
-    uint32_t len = SEC_SIZE;
     uint16_t j = 0;
     const uint16_t last_fat_sec = (layout->clusters_num*12) / BITS_PER_SECTOR;
     int error = 0;
@@ -310,7 +414,7 @@ init_fat12(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
             }
         }
 
-        error = dev->write(dev, buf, &len, i + 1);
+        error = write_sector(dev, buf, i + 1, blank);
 
         if (error)
         {
@@ -321,11 +425,12 @@ init_fat12(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
     if (!error)
     {
         error = copy_sectors(
-            dev, 1, layout->sec_per_fat + 1, layout->sec_per_fat, buf
+            dev, 1, layout->sec_per_fat + 1, layout->sec_per_fat, buf, blank
         );
     }
 
-    if (!error)
+    /* Erased sectors are valid empty directory already. */
+    if (!error && !blank)
     {
         error = erase_sectors(
             dev, 
@@ -343,11 +448,10 @@ init_fat12(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
  * invalid (fff7 code).
  */
 static int 
-init_fat16(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
+init_fat16(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf, int blank)
 {
     uint16_t* buf = sec_buf;
     uint32_t i = 0;
-    uint32_t len = SEC_SIZE;
     const uint32_t last_fat_sec = layout->clusters_num / FAT16_CL_PER_SEC;
     int error = 0;
 
@@ -374,7 +478,7 @@ init_fat16(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
             }
         }
 
-        error = dev->write(dev, buf, &len, i + 1);
+        error = write_sector(dev, buf, i + 1, blank);
 
         if (error)
         {
@@ -385,11 +489,12 @@ init_fat16(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
     if (!error)
     {
         error = copy_sectors(
-            dev, 1, layout->sec_per_fat + 1, layout->sec_per_fat, buf
+            dev, 1, layout->sec_per_fat + 1, layout->sec_per_fat, buf, blank
         );
     }
 
-    if (!error)
+    /* Erased sectors are valid empty directory already. */
+    if (!error && !blank)
     {
         error = erase_sectors(
             dev, 
@@ -407,11 +512,10 @@ init_fat16(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
  * invalid (fffffff7 code).
  */
 static int 
-init_fat32(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
+init_fat32(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf, int blank)
 {
     uint32_t* buf = sec_buf;
     uint32_t i = 0;
-    uint32_t len = SEC_SIZE;
     const uint32_t last_fat_sec = layout->clusters_num / FAT32_CL_PER_SEC;
     int error = 0;
 
@@ -439,7 +543,7 @@ init_fat32(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
             }
         }
 
-        error = dev->write(dev, buf, &len, i + 32);
+        error = write_sector(dev, buf, i + 32, blank);
 
         if (error)
         {
@@ -450,11 +554,12 @@ init_fat32(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
     if (!error)
     {
         error = copy_sectors(
-            dev, 32, layout->sec_per_fat + 32, layout->sec_per_fat, buf
+            dev, 32, layout->sec_per_fat + 32, layout->sec_per_fat, buf, blank
         );
     }
 
-    if (!error)
+    /* Erased sectors are valid empty directory already. */
+    if (!error && !blank)
     {
         error = erase_sectors(
             dev, 
@@ -474,11 +579,11 @@ init_fat32(fs_media_t* dev, const fatfs_layout_t* layout, void* sec_buf)
         buf[FSINFO_NEXT_FREE] = 2;
         buf[0x1fc / 4] = 0xaa550000;
 
-        error = dev->write(dev, buf, &len, FSINFO_SEC);
+        error = write_sector(dev, buf, FSINFO_SEC, blank);
 
         if (!error)
         {
-            error = dev->write(dev, buf, &len, BACKUP_SEC);
+            error = write_sector(dev, buf, BACKUP_SEC, blank);
         }
     }
 
@@ -493,27 +598,43 @@ fatfs_format(fs_media_t* dev, uint32_t nblk, void* sec_buf)
 {
     fatfs_layout_t layout;
     int error = calculate_layout(&layout, nblk);
+    int blank = 0;
 
     memset(sec_buf, 0, SEC_SIZE + 1);
+
+    /*
+     * Fast format: if the media can program erased sectors, erase only 
+     * dirty sectors of metadata area and then write them without erase.
+     */
+    if (!error && dev->program)
+    {
+        const uint32_t meta_sec = FAT32(&layout) ?
+            32 + layout.sec_per_fat * FAT_COPY + (1 << layout.log2_sec_per_cluster) :
+            1 + layout.sec_per_fat * FAT_COPY + ROOTDIR_SIZE / SEC_SIZE;
+
+        error = blank_sectors(dev, 0, meta_sec, sec_buf);
+        blank = !error;
+        memset(sec_buf, 0, SEC_SIZE + 1);
+    }
     
     if (!error)
     {
         if (FAT12(&layout))
         {
-            error = init_fat12(dev, &layout, sec_buf);
+            error = init_fat12(dev, &layout, sec_buf, blank);
         }
         else if (FAT16(&layout))
         {
-            error = init_fat16(dev, &layout, sec_buf);
+            error = init_fat16(dev, &layout, sec_buf, blank);
         }
         else
         {
-            error = init_fat32(dev, &layout, sec_buf);
+            error = init_fat32(dev, &layout, sec_buf, blank);
         }
 
         if (!error)
         {
-            error = setup_bpb(dev, nblk, &layout, sec_buf);
+            error = setup_bpb(dev, nblk, &layout, sec_buf, blank);
         }
 
         if (!error)
@@ -29,6 +29,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 #include "fatfs.h"
 
 /*
@@ -37,7 +38,7 @@
 int
 fat_read_dirent(struct fatfs_vol *fmp, uint32_t sec)
 {
-    size_t size = SEC_SIZE;
+    uint32_t size = SEC_SIZE;
     int error;
 
     if ((error = fmp->dev->read(fmp->dev, fmp->dir_buf, &size, sec)) != 0)
@@ -51,7 +52,7 @@ fat_read_dirent(struct fatfs_vol *fmp, uint32_t sec)
 int 
 fat_write_dirent_direct(struct fatfs_vol *fmp, const struct fat_dirent* de, uint32_t sec, uint32_t offset)
 {
-    size_t size = SEC_SIZE;
+    uint32_t size = SEC_SIZE;
     int error = fmp->dev->read(fmp->dev, fmp->dir_buf, &size, sec);
 
     if (error)
@@ -67,7 +68,7 @@ fat_empty_dirents_direct(struct fatfs_vol *fmp, uint32_t cl)
     uint32_t i;
     int error;
     uint32_t sec = cl_to_sec(fmp, cl);
-    size_t size = SEC_SIZE;
+    uint32_t size = SEC_SIZE;
 
     /* Initialize free cluster. */
     memset(fmp->dir_buf, 0, SEC_SIZE);
@@ -122,6 +123,285 @@ fat_lookup_dirent(struct fatfs_vol *fmp, uint32_t sec, char *name, struct fatfs_
     return EAGAIN;
 }
 
+#if FAT_DIR_INDEX_DIRS > 0
+
+#define DIR_INDEX_MASK  (FAT_DIR_INDEX_SLOTS - 1)
+#define DIR_INDEX_MAX   (FAT_DIR_INDEX_SLOTS * 3 / 4)
+
+/*
+ * Hash of 8.3 name, case insensitive as fat_compare_name.
+ */
+static uint16_t
+fat_name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < 11; i++) {
+        h ^= (uint8_t)toupper((int)name[i]);
+        h *= 16777619u;
+    }
+    return (uint16_t)(h ^ (h >> 16));
+}
+
+static struct fat_dir_index *
+dir_index_find(struct fatfs_vol *fmp, uint32_t cl)
+{
+    int i;
+
+    for (i = 0; i < FAT_DIR_INDEX_DIRS; i++) {
+        struct fat_dir_index *idx = &fmp->dir_index[i];
+        if (idx->stamp != 0 && idx->slot != NULL && idx->cl == cl)
+            return idx;
+    }
+    return NULL;
+}
+
+static int
+dir_index_insert(struct fat_dir_index *idx, uint16_t tag, uint32_t sec, uint32_t offset)
+{
+    struct fat_dir_slot *s;
+    int i;
+
+    if (idx->count >= DIR_INDEX_MAX) {
+        idx->overflow = 1;
+        return ENOSPC;
+    }
+
+    /* Linear probing, removed slots are reused. */
+    for (i = tag & DIR_INDEX_MASK; ; i = (i + 1) & DIR_INDEX_MASK) {
+        s = &idx->slot[i];
+        if (s->sec == 0 || s->sec == SEC_INVAL)
+            break;
+    }
+    if (s->sec == 0)
+        idx->count++;
+
+    s->sec = sec;
+    s->offset = (uint16_t)offset;
+    s->tag = tag;
+    return 0;
+}
+
+/*
+ * Put all entries of directory sector to the index.
+ * Returns ENOENT at the end of directory, EAGAIN to continue.
+ */
+static int
+dir_index_scan(struct fatfs_vol *fmp, struct fat_dir_index *idx, uint32_t sec)
+{
+    struct fat_dirent *de;
+    int error, i;
+
+    error = fat_read_dirent(fmp, sec);
+    if (error)
+        return error;
+
+    de = (struct fat_dirent *)fmp->dir_buf;
+    for (i = 0; i < DIR_PER_SEC; i++, de++) {
+        if (IS_EMPTY(de))
+            return ENOENT;
+        if (IS_DELETED(de) || IS_VOL(de))
+            continue;
+        error = dir_index_insert(idx, fat_name_hash((char *)de->name), sec,
+            sizeof(struct fat_dirent) * i);
+        if (error)
+            return error;
+    }
+    return EAGAIN;
+}
+
+/*
+ * Build name index by one pass over the directory.
+ */
+static int
+dir_index_build(struct fatfs_vol *fmp, struct fat_dir_index *idx, uint32_t cl)
+{
+    uint32_t sec;
+    unsigned int i;
+    int error = EAGAIN;
+
+    memset(idx->slot, 0, FAT_DIR_INDEX_SLOTS * sizeof(struct fat_dir_slot));
+    idx->count = 0;
+    idx->overflow = 0;
+
+    if (cl == CL_ROOT && !(FAT32(fmp)) ) {
+        for (sec = fmp->root_start; sec < fmp->data_start; sec++) {
+            error = dir_index_scan(fmp, idx, sec);
+            if (error != EAGAIN)
+                break;
+        }
+    } else {
+        if (cl == CL_ROOT)
+            cl = fmp->root_start;
+        while (error == EAGAIN && !IS_EOFCL(fmp, cl)) {
+            sec = cl_to_sec(fmp, cl);
+            for (i = 0; i < fmp->sec_per_cl; i++) {
+                error = dir_index_scan(fmp, idx, sec);
+                if (error != EAGAIN)
+                    break;
+                sec++;
+            }
+            if (error == EAGAIN)
+                error = fat_next_cluster(fmp, cl, &cl) ? EIO : EAGAIN;
+        }
+    }
+
+    /* Too big directories are marked and looked up by scan. */
+    if (error == ENOENT || error == EAGAIN || error == ENOSPC)
+        return 0;
+    return error;
+}
+
+/*
+ * Find entry by the directory index.
+ * Returns EAGAIN if the index can not be used and the directory
+ * has to be scanned.
+ */
+static int
+fat_index_lookup(struct fatfs_vol *fmp, uint32_t cl, char *name, struct fatfs_node *np)
+{
+    struct fat_dir_index *idx;
+    struct fat_dir_slot *s;
+    struct fat_dirent *de;
+    uint16_t tag;
+    int i, n, error;
+
+    idx = dir_index_find(fmp, cl);
+    if (idx == NULL) {
+        /* Replace least recently used index. */
+        idx = &fmp->dir_index[0];
+        if (idx->slot == NULL)
+            return EAGAIN;
+        for (i = 1; i < FAT_DIR_INDEX_DIRS; i++) {
+            if (fmp->dir_index[i].stamp < idx->stamp)
+                idx = &fmp->dir_index[i];
+        }
+        idx->cl = cl;
+        idx->stamp = 0;
+        if ((error = dir_index_build(fmp, idx, cl)) != 0)
+            return error;
+    }
+    idx->stamp = ++fmp->dir_clock;
+    if (idx->overflow)
+        return EAGAIN;
+
+    tag = fat_name_hash(name);
+    i = tag & DIR_INDEX_MASK;
+    for (n = 0; n < FAT_DIR_INDEX_SLOTS; n++, i = (i + 1) & DIR_INDEX_MASK) {
+        s = &idx->slot[i];
+        if (s->sec == 0)
+            break;
+        if (s->sec == SEC_INVAL || s->tag != tag)
+            continue;
+
+        if ((error = fat_read_dirent(fmp, s->sec)) != 0)
+            return error;
+
+        de = (struct fat_dirent *)(fmp->dir_buf + s->offset);
+        if (IS_EMPTY(de) || IS_DELETED(de) || IS_VOL(de) ||
+            fat_name_hash((char *)de->name) != tag) {
+            /* Index does not match media, drop it and scan. */
+            idx->stamp = 0;
+            return EAGAIN;
+        }
+        if (!fat_compare_name((char *)de->name, name)) {
+            np->dirent = *de;
+            np->sector = s->sec;
+            np->offset = s->offset;
+            return 0;
+        }
+    }
+    return ENOENT;
+}
+
+#endif /* FAT_DIR_INDEX_DIRS > 0 */
+
+/*
+ * Setup directory indexes.
+ * @mem: FAT_DIR_INDEX_SIZE bytes or NULL to disable indexing
+ */
+void
+fat_index_init(struct fatfs_vol *fmp, void *mem)
+{
+#if FAT_DIR_INDEX_DIRS > 0
+    struct fat_dir_slot *slot = mem;
+    int i;
+
+    fmp->dir_clock = 0;
+    for (i = 0; i < FAT_DIR_INDEX_DIRS; i++) {
+        fmp->dir_index[i].cl = CL_ROOT;
+        fmp->dir_index[i].stamp = 0;
+        fmp->dir_index[i].count = 0;
+        fmp->dir_index[i].overflow = 0;
+        fmp->dir_index[i].slot = slot ? slot + i * FAT_DIR_INDEX_SLOTS : NULL;
+    }
+#endif
+}
+
+/*
+ * New entry is written to directory of cluster cl.
+ */
+void
+fat_index_add(struct fatfs_vol *fmp, uint32_t cl, const struct fat_dirent *de, uint32_t sec, uint32_t offset)
+{
+#if FAT_DIR_INDEX_DIRS > 0
+    struct fat_dir_index *idx = dir_index_find(fmp, cl);
+
+    if (idx != NULL && !idx->overflow)
+        dir_index_insert(idx, fat_name_hash((char *)de->name), sec, offset);
+#endif
+}
+
+/*
+ * Existing entry is rewritten: renamed, removed or changed.
+ */
+void
+fat_index_update(struct fatfs_vol *fmp, const struct fat_dirent *de, uint32_t sec, uint32_t offset)
+{
+#if FAT_DIR_INDEX_DIRS > 0
+    struct fat_dir_index *idx;
+    struct fat_dir_slot *s;
+    int i, j;
+
+    for (i = 0; i < FAT_DIR_INDEX_DIRS; i++) {
+        idx = &fmp->dir_index[i];
+        if (idx->stamp == 0 || idx->slot == NULL || idx->overflow)
+            continue;
+        for (j = 0; j < FAT_DIR_INDEX_SLOTS; j++) {
+            s = &idx->slot[j];
+            if (s->sec != sec || s->offset != offset)
+                continue;
+            s->sec = SEC_INVAL;
+            if (!IS_DELETED(de))
+                dir_index_insert(idx, fat_name_hash((char *)de->name), sec, offset);
+            break;
+        }
+    }
+
+    /* Clusters of removed directory may be reused. */
+    if (IS_DELETED(de) && IS_DIR(de)) {
+        idx = dir_index_find(fmp, DE_CLUSTER(de));
+        if (idx != NULL)
+            idx->stamp = 0;
+    }
+#endif
+}
+
+/*
+ * Drop all directory indexes.
+ */
+void
+fat_index_invalidate(struct fatfs_vol *fmp)
+{
+#if FAT_DIR_INDEX_DIRS > 0
+    int i;
+
+    for (i = 0; i < FAT_DIR_INDEX_DIRS; i++)
+        fmp->dir_index[i].stamp = 0;
+#endif
+}
+
 /*
  * Find directory entry for specified name in directory.
  * The fat vnode data is filled if success.
@@ -147,6 +427,12 @@ fatfs_lookup_node(struct fatfs_vol * dvp, char *name, struct fatfs_node *np, uin
     fat_convert_name(name, fat_name);
     *(fat_name + 11) = '\0';
 
+#if FAT_DIR_INDEX_DIRS > 0
+    error = fat_index_lookup(fmp, cl, fat_name, np);
+    if (error != EAGAIN)
+        return error;
+#endif
+
     if (cl == CL_ROOT && !(FAT32(fmp)) ) {
         /* Search entry in root directory */
         sec_start = fmp->root_start;
@@ -263,15 +549,122 @@ fatfs_get_node(struct fatfs_vol * dvp, int index, struct fatfs_node *np, uint32_
     return ENOENT;
 }
 
+/*
+ * Move directory cursor to the next sector.
+ * Returns ENOENT at the end of directory.
+ */
+static int
+fat_dir_cursor_next(struct fatfs_vol *fmp, struct fatfs_dir_cursor *cur)
+{
+    int error;
+
+    cur->slot = 0;
+    if (cur->cl == CL_ROOT && !(FAT32(fmp)) ) {
+        if (++cur->sec >= fmp->data_start)
+            return ENOENT;
+        return 0;
+    }
+
+    if (++cur->sec_idx < fmp->sec_per_cl) {
+        cur->sec++;
+        return 0;
+    }
+
+    error = fat_next_cluster(fmp, cur->cl, &cur->cl);
+    if (error)
+        return error;
+    if (IS_EOFCL(fmp, cur->cl))
+        return ENOENT;
+
+    cur->sec = cl_to_sec(fmp, cur->cl);
+    cur->sec_idx = 0;
+    return 0;
+}
+
+/*
+ * Read directory entries starting from the cursor position.
+ * Entries are taken from one sector per call, so a whole directory
+ * is read in one pass. The cursor is advanced past returned entries.
+ *
+ * @fmp: fatfs mount point
+ * @cur: directory cursor, zeroed to start from the first entry
+ * @cl: cluster# of directory
+ * @np: array of fat nodes to fill
+ * @max: size of the array
+ * @count: number of filled nodes to return
+ *
+ * Returns ENOENT if there are no more entries.
+ */
+int
+fatfs_read_nodes(struct fatfs_vol *fmp, struct fatfs_dir_cursor *cur, uint32_t cl, struct fatfs_node *np, int max, int *count)
+{
+    struct fat_dirent *de;
+    int error, n = 0;
+
+    *count = 0;
+
+    /* Setup cursor at the first directory sector. */
+    if (cur->sec == 0) {
+        if (cl == CL_ROOT && !(FAT32(fmp)) ) {
+            cur->cl = CL_ROOT;
+            cur->sec = fmp->root_start;
+        } else {
+            cur->cl = (cl == CL_ROOT) ? fmp->root_start : cl;
+            cur->sec = cl_to_sec(fmp, cur->cl);
+        }
+        cur->sec_idx = 0;
+        cur->slot = 0;
+    }
+
+    if (cur->sec == SEC_INVAL)
+        return ENOENT;
+
+    while (n == 0) {
+        if (cur->slot >= DIR_PER_SEC) {
+            error = fat_dir_cursor_next(fmp, cur);
+            if (error)
+                goto end;
+        }
+
+        error = fat_read_dirent(fmp, cur->sec);
+        if (error)
+            return error;
+
+        de = (struct fat_dirent *)fmp->dir_buf + cur->slot;
+        for (; cur->slot < DIR_PER_SEC && n < max; cur->slot++, de++) {
+            if (IS_EMPTY(de)) {
+                error = ENOENT;
+                goto end;
+            }
+            if (IS_DELETED(de) || IS_VOL(de))
+                continue;
+            np[n].dirent = *de;
+            np[n].sector = cur->sec;
+            np[n].offset = sizeof(struct fat_dirent) * cur->slot;
+            n++;
+        }
+    }
+    *count = n;
+    return 0;
+
+ end:
+    /* Remember the end of directory, return what is found. */
+    if (error == ENOENT)
+        cur->sec = SEC_INVAL;
+    *count = n;
+    return (n > 0 && error == ENOENT) ? 0 : error;
+}
+
 /*
  * Find empty directory entry and put new entry on it.
  *
  * @fmp: fatfs mount point
  * @sec: sector#
  * @np: pointer to fat node
+ * @dir_cl: cluster# of directory
  */
 static int
-fat_add_dirent(struct fatfs_vol *fmp, uint32_t sec, struct fatfs_node *np)
+fat_add_dirent(struct fatfs_vol *fmp, uint32_t sec, struct fatfs_node *np, uint32_t dir_cl)
 {
     struct fat_dirent *de;
     int error, i;
@@ -294,6 +687,8 @@ fat_add_dirent(struct fatfs_vol *fmp, uint32_t sec, struct fatfs_node *np)
  found:
     DPRINTF(("fat_add_dirent: found. sec=%d\n", sec));
     error = fat_write_dirent(fmp, &np->dirent, sec, offset);
+    if (!error)
+        fat_index_add(fmp, dir_cl, &np->dirent, sec, offset);
     return error;
 }
 
@@ -310,9 +705,10 @@ fatfs_add_node(struct fatfs_vol *dvp, struct fatfs_node *np, uint32_t cl)
     uint32_t sec,sec_start;
     int error;
     unsigned i;
-    uint32_t next;
+    uint32_t next, dir_cl;
 
     fmp = (struct fatfs_vol *)dvp;
+    dir_cl = cl;
 
     DPRINTF(("fatfs_add_node: cl=%d\n", cl));
 
@@ -320,7 +716,7 @@ fatfs_add_node(struct fatfs_vol *dvp, struct fatfs_node *np, uint32_t cl)
         /* Add entry in root directory */
         sec_start = fmp->root_start;
         for (sec = sec_start; sec < fmp->data_start; sec++) {
-            error = fat_add_dirent(fmp, sec, np);
+            error = fat_add_dirent(fmp, sec, np, dir_cl);
             if (error != ENOENT)
                 return error;
         }
@@ -331,7 +727,7 @@ fatfs_add_node(struct fatfs_vol *dvp, struct fatfs_node *np, uint32_t cl)
         while (!IS_EOFCL(fmp, cl)) {
             sec = cl_to_sec(fmp, cl);
             for (i = 0; i < fmp->sec_per_cl; i++) {
-                error = fat_add_dirent(fmp, sec, np);
+                error = fat_add_dirent(fmp, sec, np, dir_cl);
                 if (error != ENOENT)
                     return error;
                 sec++;
@@ -353,7 +749,7 @@ fatfs_add_node(struct fatfs_vol *dvp, struct fatfs_node *np, uint32_t cl)
 
         /* Try again */
         sec = cl_to_sec(fmp, next);
-        error = fat_add_dirent(fmp, sec, np);
+        error = fat_add_dirent(fmp, sec, np, dir_cl);
         return error;
     }
     return ENOENT;
@@ -374,6 +770,8 @@ fatfs_put_node(struct fatfs_vol *fmp, struct fatfs_node *np)
         return error;
 
     error = fat_write_dirent(fmp, &np->dirent, np->sector, np->offset);
+    if (!error)
+        fat_index_update(fmp, &np->dirent, np->sector, np->offset);
     return error;
 }
 
@@ -0,0 +1,209 @@
+/**
+  ******************************************************************************
+  *  @file   fatfs_scan.c
+  *  @brief  Incremental volume consistency check.
+  ******************************************************************************
+  *  Copyright (C) JSC EREMEX, 2008-2020.
+  *  $$LICENSE$
+  *****************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+#include "fatfs.h"
+
+#define SCAN_BATCH  8           /* directory entries read at once */
+
+#define map_test(scan, cl)  ((scan)->map[(cl) / 8] & (1 << ((cl) % 8)))
+#define map_set(scan, cl)   ((scan)->map[(cl) / 8] |= (1 << ((cl) % 8)))
+
+#define IS_BADCL(fmp, cl)   (((cl) & (fmp)->fat_mask) == (CL_BAD & (fmp)->fat_mask))
+
+/*
+ * Mark clusters of the chain. Reserved clusters (the journal) end it.
+ */
+static int
+scan_mark_chain(struct fatfs_vol *fmp, struct fatfs_scan *scan, uint32_t cl)
+{
+    uint32_t next;
+    int error;
+
+    for (;;) {
+        if (cl < CL_FIRST || cl >= fmp->last_cluster) {
+            scan->bad_chains++;
+            return 0;
+        }
+        if (map_test(scan, cl)) {
+            scan->crossed++;
+            return 0;
+        }
+        map_set(scan, cl);
+
+        error = fat_next_cluster(fmp, cl, &next);
+        if (error)
+            return error;
+        if (IS_EOFCL(fmp, next) || IS_BADCL(fmp, next))
+            return 0;
+        cl = next;
+    }
+}
+
+/*
+ * Start the directory tree walk from the root.
+ */
+static int
+scan_start_tree(struct fatfs_vol *fmp, struct fatfs_scan *scan)
+{
+    memset(scan->map, 0, FREE_MAP_SIZE(fmp));
+    scan->phase = FAT_SCAN_TREE;
+    scan->pos = 0;
+    scan->total = 0;
+    scan->gen = fmp->gen;
+    scan->lost = 0;
+    scan->crossed = 0;
+    scan->bad_chains = 0;
+    scan->skipped = 0;
+
+    scan->depth = 1;
+    scan->dir_cl[0] = CL_ROOT;
+    fat_dir_cursor_reset(&scan->dir[0]);
+
+    /* FAT32 root directory is a cluster chain too. */
+    if (FAT32(fmp))
+        return scan_mark_chain(fmp, scan, fmp->root_start);
+    return 0;
+}
+
+static int
+scan_mirror(struct fatfs_vol *fmp, struct fatfs_scan *scan, int *budget)
+{
+    int error;
+
+    while (*budget > 0 && scan->pos < scan->total) {
+        error = fat_mirror_sector(fmp, scan->pos, &scan->mirror_fixed);
+        if (error)
+            return error;
+        scan->pos++;
+        (*budget)--;
+    }
+    if (scan->pos >= scan->total)
+        return scan_start_tree(fmp, scan);
+    return 0;
+}
+
+static int
+scan_tree(struct fatfs_vol *fmp, struct fatfs_scan *scan, int *budget)
+{
+    struct fatfs_node np[SCAN_BATCH];
+    struct fat_dirent *de;
+    int i, d, count, error;
+
+    while (*budget > 0 && scan->depth > 0) {
+        d = scan->depth - 1;
+        error = fatfs_read_nodes(fmp, &scan->dir[d], scan->dir_cl[d], np, SCAN_BATCH, &count);
+        if (error == ENOENT) {
+            scan->depth--;
+            continue;
+        }
+        if (error)
+            return error;
+
+        for (i = 0; i < count; i++) {
+            de = &np[i].dirent;
+            if (de->name[0] == '.')
+                continue;
+            error = scan_mark_chain(fmp, scan, DE_CLUSTER(de));
+            if (error)
+                return error;
+            if (!IS_DIR(de))
+                continue;
+            if (scan->depth < FAT_SCAN_DEPTH) {
+                scan->dir_cl[scan->depth] = DE_CLUSTER(de);
+                fat_dir_cursor_reset(&scan->dir[scan->depth]);
+                scan->depth++;
+            } else {
+                scan->skipped++;
+            }
+        }
+        scan->pos += count;
+        *budget -= (count > 0) ? count : 1;
+    }
+    if (scan->depth == 0) {
+        scan->phase = FAT_SCAN_LOST;
+        scan->pos = CL_FIRST;
+        scan->total = fmp->last_cluster;
+    }
+    return 0;
+}
+
+static int
+scan_lost(struct fatfs_vol *fmp, struct fatfs_scan *scan, int *budget)
+{
+    uint32_t next;
+    int error;
+
+    while (*budget > 0 && scan->pos < scan->total) {
+        error = fat_next_cluster(fmp, scan->pos, &next);
+        if (error)
+            return error;
+        if (next != CL_FREE && !IS_BADCL(fmp, next) && !map_test(scan, scan->pos))
+            scan->lost++;
+        scan->pos++;
+        (*budget)--;
+    }
+    if (scan->pos >= scan->total)
+        scan->phase = FAT_SCAN_DONE;
+    return 0;
+}
+
+/*
+ * Prepare the volume scan.
+ * @map: buffer of FREE_MAP_SIZE(fmp) bytes owned by the scan
+ */
+void
+fatfs_scan_init(struct fatfs_vol *fmp, struct fatfs_scan *scan, uint8_t *map)
+{
+    memset(scan, 0, sizeof(*scan));
+    scan->map = map;
+    scan->phase = FAT_SCAN_MIRROR;
+    scan->total = (fmp->fat_copies > 1) ? fmp->fat_sectors : 0;
+}
+
+/*
+ * Do next part of the volume scan: refresh FAT copies, then find lost,
+ * cross-linked and broken chains. Nothing but FAT copies is repaired,
+ * the findings are counted in the scan object.
+ *
+ * @budget: units of work, each unit is one FAT sector, directory entry
+ *          or cluster
+ *
+ * Returns 0 when the scan is complete, EAGAIN if there is more to do.
+ */
+int
+fatfs_scan(struct fatfs_vol *fmp, struct fatfs_scan *scan, int budget)
+{
+    int error = 0;
+
+    /* Tree changed under the walk, results would be wrong. */
+    if ((scan->phase == FAT_SCAN_TREE || scan->phase == FAT_SCAN_LOST) &&
+        scan->gen != fmp->gen) {
+        scan->restarts++;
+        error = scan_start_tree(fmp, scan);
+    }
+
+    while (!error && budget > 0 && scan->phase != FAT_SCAN_DONE) {
+        switch (scan->phase) {
+        case FAT_SCAN_MIRROR:
+            error = scan_mirror(fmp, scan, &budget);
+            break;
+        case FAT_SCAN_TREE:
+            error = scan_tree(fmp, scan, &budget);
+            break;
+        case FAT_SCAN_LOST:
+            error = scan_lost(fmp, scan, &budget);
+            break;
+        }
+    }
+    if (error)
+        return error;
+    return (scan->phase == FAT_SCAN_DONE) ? 0 : EAGAIN;
+}
@@ -48,7 +48,7 @@ static int
 fat_read_cluster(struct fatfs_vol *fmp, uint32_t cluster)
 {
     uint32_t sec;
-    size_t size;
+    uint32_t size;
 
     sec = cl_to_sec(fmp, cluster);
     size = fmp->sec_per_cl * SEC_SIZE;
@@ -62,13 +62,67 @@ static int
 fat_write_cluster(struct fatfs_vol *fmp, uint32_t cluster)
 {
     uint32_t sec;
-    size_t size;
+    uint32_t size;
 
     sec = cl_to_sec(fmp, cluster);
     size = fmp->sec_per_cl * SEC_SIZE;
     return fmp->dev->write(fmp->dev, fmp->io_buf, &size, sec);
 }
 
+/*
+ * Transfer run of contiguous clusters directly from/to user buffer.
+ */
+static int
+fat_io_clusters(struct fatfs_vol *fmp, uint32_t cluster, uint32_t count, void *buf, int write)
+{
+    uint32_t sec;
+    uint32_t size;
+
+    sec = cl_to_sec(fmp, cluster);
+    size = count * fmp->cluster_size;
+    if (write)
+        return fmp->dev->write(fmp->dev, buf, &size, sec);
+    return fmp->dev->read(fmp->dev, buf, &size, sec);
+}
+
+/*
+ * Get number of physically contiguous clusters in chain starting
+ * from the cluster, up to @max.
+ * @len: run length to return
+ * @next: cluster# following the run
+ */
+static int
+fat_contig_run(struct fatfs_vol *fmp, uint32_t cl, uint32_t max, uint32_t *len, uint32_t *next)
+{
+    uint32_t n;
+    int error;
+
+    for (n = 1; ; n++, cl++) {
+        error = fat_next_cluster(fmp, cl, next);
+        if (error)
+            return error;
+        if (n >= max || *next != cl + 1)
+            break;
+    }
+    *len = n;
+    return 0;
+}
+
+/*
+ * Max number of clusters transferred by one media request.
+ */
+static uint32_t
+fat_io_max_clusters(struct fatfs_vol *fmp, size_t size)
+{
+    uint32_t max = FAT_IO_MAX_SECS / fmp->sec_per_cl;
+
+    if (max == 0)
+        max = 1;
+    if (size / fmp->cluster_size < max)
+        max = size / fmp->cluster_size;
+    return max;
+}
+
 /*
  * Lookup vnode for the specified file/directory.
  * The vnode data will be set properly.
@@ -98,17 +152,24 @@ fatfs_lookup(
     return 0;
 }
 
+/*
+ * Read file data. Called with the volume locked, the lock is dropped while
+ * whole clusters are transferred to the caller's buffer. A commit in that
+ * window may have freed and reused the clusters, then the cluster is looked
+ * up again and the run is read once more with the lock held.
+ */
 int
 fatfs_read(
     struct fatfs_vol *fmp, 
     struct fatfs_node *np, 
     uint32_t* f_offset, 
+    struct fatfs_cursor *cur, 
     void *buf, 
     size_t size, 
     size_t *result)
 {
-    int nr_read, nr_copy, buf_pos, error;
-    uint32_t cl, file_pos;
+    int nr_read, nr_copy, buf_pos, error, locked_io = 0;
+    uint32_t cl, next, run, file_pos, gen;
     struct fat_dirent* de = &np->dirent;
 
     DPRINTF(("fatfs_read: vp=%x\n", vp));
@@ -128,39 +189,81 @@ fatfs_read(
         size = de->size - file_pos;
 
     /* Seek to the cluster for the file offset */
-    error = fat_seek_cluster(fmp, DE_CLUSTER(de) , file_pos, &cl);
+    error = fat_seek_cursor(fmp, DE_CLUSTER(de), cur, file_pos, &cl);
     if (error)
         goto out;
 
     /* Read and copy data */
     nr_read = 0;
     buf_pos = file_pos % fmp->cluster_size;
-    do {
-        if (fat_read_cluster(fmp, cl)) {
-            error = EIO;
-            goto out;
+    for (;;) {
+        if (buf_pos == 0 && size >= fmp->cluster_size) {
+            /* Whole clusters are read directly to the user buffer. */
+            error = fat_contig_run(fmp, cl, fat_io_max_clusters(fmp, size), &run, &next);
+            if (error)
+                goto out;
+            /*
+             * The transfer uses neither FAT nor volume buffers, so other
+             * threads may work with the volume meanwhile.
+             */
+            gen = fmp->gen;
+            if (!locked_io)
+                fs_media_unlock(fmp->dev);
+            error = fat_io_clusters(fmp, cl, run, buf, 0);
+            if (!locked_io)
+                fs_media_lock(fmp->dev);
+            if (error) {
+                error = EIO;
+                goto out;
+            }
+            if (gen != fmp->gen) {
+                /* Chain may have changed, the cursor is not trusted. */
+                locked_io = 1;
+                if (cur != NULL)
+                    fat_cursor_reset(cur);
+                error = fat_seek_cursor(fmp, DE_CLUSTER(de), cur, file_pos, &cl);
+                if (error)
+                    goto out;
+                continue;
+            }
+            nr_copy = run * fmp->cluster_size;
+        } else {
+            /* Partial cluster is staged through the local buffer. */
+            if (fat_read_cluster(fmp, cl)) {
+                error = EIO;
+                goto out;
+            }
+            nr_copy = fmp->cluster_size - buf_pos;
+            if (size < nr_copy)
+                nr_copy = size;
+            memcpy(buf, fmp->io_buf + buf_pos, nr_copy);
+            next = CL_FREE;
         }
 
-        nr_copy = fmp->cluster_size;
-        if (buf_pos > 0)
-            nr_copy -= buf_pos;
-        if (buf_pos + size < fmp->cluster_size)
-            nr_copy = size;
-        memcpy(buf, fmp->io_buf + buf_pos, nr_copy);
-
         file_pos += nr_copy;
         nr_read += nr_copy;
         size -= nr_copy;
         if (size <= 0)
             break;
 
-        error = fat_next_cluster(fmp, cl, &cl);
-        if (error)
-            goto out;
+        if (next == CL_FREE) {
+            error = fat_next_cluster(fmp, cl, &next);
+            if (error)
+                goto out;
+        }
+        cl = next;
+        if (IS_EOFCL(fmp, cl))
+            break;
 
-        buf = (void *)((uint32_t)buf + nr_copy);
+        /* Remember the cluster boundary we just crossed. */
+        if (cur != NULL) {
+            cur->cl = cl;
+            cur->offset = file_pos;
+        }
+
+        buf = (char *)buf + nr_copy;
         buf_pos = 0;
-    } while (!IS_EOFCL(fmp, cl));
+    }
 
     *f_offset = file_pos;
     *result = nr_read;
@@ -169,20 +272,65 @@ fatfs_read(
     return error;
 }
 
+/*
+ * Get the cluster following @cl of the file being written. At the end of
+ * the chain up to @need clusters are allocated as a run and linked. With
+ * journaling the link is not in FAT until commit, so clusters of the runs
+ * allocated by the write are followed by @run_end (0 if none yet).
+ */
+static int
+fat_write_next(struct fatfs_vol *fmp, uint32_t cl, uint32_t need, uint32_t *run_end, uint32_t *next)
+{
+    uint32_t first, len;
+    int error;
+
+    if (*run_end != 0) {
+        if (cl + 1 < *run_end) {
+            *next = cl + 1;
+            return 0;
+        }
+    } else {
+        error = fat_next_cluster(fmp, cl, next);
+        if (error || !IS_EOFCL(fmp, *next))
+            return error;
+    }
+
+    error = fat_alloc_run(fmp, cl, need, &first, &len);
+    if (error)
+        return error;
+    error = fat_link_run(fmp, first, len, fmp->fat_eof);
+    if (error)
+        return error;
+    error = fat_set_cluster(fmp, cl, first);
+    if (error)
+        return error;
+    *next = first;
+    *run_end = first + len;
+    return 0;
+}
+
+/*
+ * Write file data. Data is written in place before any metadata: clusters
+ * are allocated when the data reaches the end of the chain, and the new
+ * chain and size are recorded after the data. With journaling the write
+ * thus commits as one small metadata transaction after its data is on
+ * the media (ordered data mode).
+ */
 int
 fatfs_write(
     struct fatfs_vol *fmp, 
     struct fatfs_node *np, 
     uint32_t* f_offset, 
+    struct fatfs_cursor *cur, 
     void *buf, 
     size_t size, 
     size_t *result, 
     int append)
 {
     struct fat_dirent *de = &np->dirent;
-    int nr_copy, nr_write, buf_pos, i, cl_size, error;
-    uint32_t file_pos, end_pos;
-    uint32_t cl;
+    int nr_copy, nr_write, buf_pos, error;
+    uint32_t file_pos, end_pos, pos;
+    uint32_t cl, next, run, run_end;
 
     DPRINTF(("fatfs_write: vp=%x\n", vp));
 
@@ -194,49 +342,64 @@ fatfs_write(
     /* Check if file position exceeds the end of file. */
     end_pos = de->size;
     file_pos = (append) ? end_pos : *f_offset;
-    if (file_pos + size > end_pos) {
-        /* Expand the file size before writing to it */
+    pos = (file_pos < end_pos) ? file_pos : end_pos;
+    if (file_pos + size > end_pos)
         end_pos = file_pos + size;
-        error = fat_expand_file(fmp, DE_CLUSTER(de), end_pos);
-        if (error) {
-            error = EIO;
-            goto out;
-        }
 
-        /* Update directory entry */
-        de->size = end_pos;
-        error = fatfs_put_node(fmp, np);
+    /* Seek to the cluster for the file offset, or to the last one. */
+    error = fat_seek_cursor(fmp, DE_CLUSTER(de), cur, pos, &cl);
+    if (error)
+        goto out;
+    pos -= pos % fmp->cluster_size;
+    run_end = 0;
+
+    /* Allocate the hole between end of file and the file offset. */
+    while (pos + fmp->cluster_size <= file_pos) {
+        error = fat_write_next(fmp, cl, (end_pos - pos) / fmp->cluster_size, &run_end, &cl);
         if (error)
             goto out;
+        pos += fmp->cluster_size;
     }
 
-    /* Seek to the cluster for the file offset */
-    error = fat_seek_cluster(fmp, DE_CLUSTER(de), file_pos, &cl);
-    if (error)
-        goto out;
-
     buf_pos = file_pos % fmp->cluster_size;
-    cl_size = size / fmp->cluster_size + 1;
     nr_write = 0;
-    i = 0;
-    do {
-        /* First and last cluster must be read before write */
-        if (i == 0 || i == cl_size) {
-            if (fat_read_cluster(fmp, cl)) {
+    for (;;) {
+        if (buf_pos == 0 && size >= fmp->cluster_size) {
+            /* Whole clusters are written directly from the user buffer. */
+            if (run_end != 0) {
+                run = fat_io_max_clusters(fmp, size);
+                if (run > run_end - cl)
+                    run = run_end - cl;
+                next = CL_FREE;
+            } else {
+                error = fat_contig_run(fmp, cl, fat_io_max_clusters(fmp, size), &run, &next);
+                if (error)
+                    goto out;
+            }
+            if (fat_io_clusters(fmp, cl, run, buf, 1)) {
                 error = EIO;
                 goto out;
             }
-        }
-        nr_copy = fmp->cluster_size;
-        if (buf_pos > 0)
-            nr_copy -= buf_pos;
-        if (buf_pos + size < fmp->cluster_size)
-            nr_copy = size;
-        memcpy(fmp->io_buf + buf_pos, buf, nr_copy);
-
-        if (fat_write_cluster(fmp, cl)) {
-            error = EIO;
-            goto out;
+            nr_copy = run * fmp->cluster_size;
+            cl += run - 1;
+        } else {
+            /* Partial cluster must be read before write, unless it is new. */
+            if (run_end != 0)
+                memset(fmp->io_buf, 0, fmp->cluster_size);
+            else if (fat_read_cluster(fmp, cl)) {
+                error = EIO;
+                goto out;
+            }
+            nr_copy = fmp->cluster_size - buf_pos;
+            if (size < nr_copy)
+                nr_copy = size;
+            memcpy(fmp->io_buf + buf_pos, buf, nr_copy);
+
+            if (fat_write_cluster(fmp, cl)) {
+                error = EIO;
+                goto out;
+            }
+            next = CL_FREE;
         }
         file_pos += nr_copy;
         nr_write += nr_copy;
@@ -244,14 +407,36 @@ fatfs_write(
         if (size <= 0)
             break;
 
-        error = fat_next_cluster(fmp, cl, &cl);
-        if (error)
-            goto out;
+        if (next == CL_FREE || IS_EOFCL(fmp, next)) {
+            error = fat_write_next(fmp, cl, (end_pos - file_pos) / fmp->cluster_size + 1, &run_end, &next);
+            if (error)
+                goto out;
+        }
+        cl = next;
+
+        if (cur != NULL) {
+            cur->cl = cl;
+            cur->offset = file_pos;
+        }
 
-        buf = (void *)((uint32_t)buf + nr_copy);
+        buf = (char *)buf + nr_copy;
         buf_pos = 0;
-        i++;
-    } while (!IS_EOFCL(fmp, cl));
+    }
+
+    if (end_pos > de->size) {
+        /* The chain keeps one cluster beyond the data ending on a cluster boundary. */
+        if (end_pos % fmp->cluster_size == 0) {
+            error = fat_write_next(fmp, cl, 1, &run_end, &next);
+            if (error)
+                goto out;
+        }
+
+        /* Update directory entry */
+        de->size = end_pos;
+        error = fatfs_put_node(fmp, np);
+        if (error)
+            goto out;
+    }
 
     *f_offset = file_pos;
 
@@ -265,7 +450,10 @@ fatfs_write(
     *result = nr_write;
     error = 0;
 out:
-    fatfs_commit(fmp, error);
+    error = fatfs_commit(fmp, error);
+    /* Cursor may point to clusters of the dropped allocation. */
+    if (error && cur != NULL)
+        fat_cursor_reset(cur);
     return error;
 }
 
@@ -307,8 +495,7 @@ fatfs_create(
         goto out;
     error = fat_set_cluster(fmp, cl, fmp->fat_eof);
 out:
-    fatfs_commit(fmp, error);
-    return error;
+    return fatfs_commit(fmp, error);
 }
 
 static int
@@ -350,8 +537,7 @@ int
 fatfs_remove(struct fatfs_vol *fmp, struct fatfs_node *np, char *name)
 {
     int error = _fatfs_remove(fmp, np, name);
-    fatfs_commit(fmp, error);
-    return error;
+    return fatfs_commit(fmp, error);
 }
 
 int
@@ -459,8 +645,7 @@ fatfs_rename(
         }
     }
 out:
-    fatfs_commit(fmp, error);
-    return error;
+    return fatfs_commit(fmp, error);
 }
 
 int
@@ -527,8 +712,7 @@ fatfs_mkdir(
     /* Add eof */
     error = fat_set_cluster(fmp, cl, fmp->fat_eof);
 out:
-    fatfs_commit(fmp, error);
-    return error;
+    return fatfs_commit(fmp, error);
 }
 
 /*
@@ -571,21 +755,29 @@ int
 fatfs_rmdir(struct fatfs_vol *fmp, struct fatfs_node *dp, char *name)
 {
     int error = _fatfs_rmdir(fmp, dp, name);
-    fatfs_commit(fmp, error);
-    return error;
+    return fatfs_commit(fmp, error);
 }
 
 int
 fatfs_truncate(struct fatfs_vol *fmp, struct fatfs_node *np, uint32_t length)
 {
     struct fat_dirent *de = &np->dirent;
+    uint32_t next;
     int error;
 
     if (length == 0) {
-        /* Remove clusters */
-        error = fat_free_clusters(fmp, DE_CLUSTER(de));
+        /* Remove clusters, the first one stays allocated to the entry. */
+        error = fat_next_cluster(fmp, DE_CLUSTER(de), &next);
         if (error)
             goto out;
+        if (!IS_EOFCL(fmp, next)) {
+            error = fat_free_clusters(fmp, next);
+            if (error)
+                goto out;
+            error = fat_set_cluster(fmp, DE_CLUSTER(de), fmp->fat_eof);
+            if (error)
+                goto out;
+        }
     } else if (length > de->size) {
         error = fat_expand_file(fmp, DE_CLUSTER(de), length);
         if (error) {
@@ -600,8 +792,7 @@ fatfs_truncate(struct fatfs_vol *fmp, struct fatfs_node *np, uint32_t length)
     if (error)
         goto out;
 out:
-    fatfs_commit(fmp, error);
-    return error;
+    return fatfs_commit(fmp, error);
 }
 
 /*
@@ -624,6 +815,8 @@ fat_read_bpb(struct fatfs_vol *fmp, void* bpb_buf)
     if (fatsize == 0) 
         fatsize = bpb32->sectors_per_fat32;
 
+    fmp->fat_sectors = fatsize;
+    fmp->fat_copies = bpb->num_of_fats;
     fatsize *= bpb->num_of_fats;
     fmp->fat_start = bpb->hidden_sectors + bpb->reserved_sectors;
 
@@ -662,6 +855,7 @@ fat_read_bpb(struct fatfs_vol *fmp, void* bpb_buf)
 
     fmp->last_cluster = (totalsect - fmp->data_start) / bpb->sectors_per_cluster + CL_FIRST;
     fmp->free_scan = CL_FIRST;
+    fat_resv_clear(fmp);
 
     DPRINTF(("----- FAT info ----- \n"));
 
@@ -698,7 +892,7 @@ fatfs_init(
     void* (*io_mem_alloc)(size_t))
 {   
     int error = ENOMEM;
-    size_t size = SEC_SIZE;
+    uint32_t size = SEC_SIZE;
     void* temp_buf = NULL; 
     void* io_buf = NULL;
     void* fat_buf = NULL;
@@ -731,17 +925,37 @@ fatfs_init(
             break;
         }
 
-        fat_buf = io_mem_alloc(SEC_SIZE * 2);
+        fat_buf = io_mem_alloc(SEC_SIZE * FAT_CACHE_SLOTS);
 
         if (fat_buf == NULL) {
             error = ENOMEM;
             break;
         }
 
+#ifdef FATFS_JOURNALING
+        fmp->j_buf = io_mem_alloc(SEC_SIZE);
+
+        if (fmp->j_buf == NULL) {
+            error = ENOMEM;
+            break;
+        }
+
+        fmp->j_buf_sec = SEC_INVAL;
+        fmp->j_dirty = 0;
+#endif
+
         fmp->dev = dev;
+        fmp->gen = 0;
         fmp->io_buf = io_buf;
-        fmp->fat_buf = fat_buf;
         fmp->dir_buf = temp_buf;
+        fat_cache_init(fmp, fat_buf, FAT_CACHE_SLOTS);
+
+        /* Free map is optional, FAT is scanned without it. */
+        fmp->free_map = io_mem_alloc(FREE_MAP_SIZE(fmp));
+        fmp->free_map_valid = 0;
+
+        /* Directory indexes are optional too. */
+        fat_index_init(fmp, FAT_DIR_INDEX_SIZE ? io_mem_alloc(FAT_DIR_INDEX_SIZE) : NULL);
     }
     while (0);
 
@@ -1,8 +1,125 @@
+#include <errno.h>
 #include "fs_media.h"
-#include "spi_flash.h"
 
-void fs_media_lock(fs_media_t* media){}
-void fs_media_unlock(fs_media_t* media){}
+#ifndef FS_MEDIA_NO_LOCK
+
+/*
+ * Recursive mutex, waiters are woken in priority order.
+ */
+int fs_lock_init(fs_lock_t* lock)
+{
+    return fx_mutex_init(lock, FS_LOCK_CEILING, FX_SYNC_POLICY_PRIO) == FX_MUTEX_OK ? 0 : EINVAL;
+}
+
+void fs_lock_deinit(fs_lock_t* lock)
+{
+    fx_mutex_deinit(lock);
+}
+
+void fs_lock(fs_lock_t* lock)
+{
+    fx_mutex_acquire(lock, NULL);
+}
+
+void fs_unlock(fs_lock_t* lock)
+{
+    fx_mutex_release(lock);
+}
+
+#else
+
+int fs_lock_init(fs_lock_t* lock)
+{
+    *lock = 0;
+    return 0;
+}
+
+void fs_lock_deinit(fs_lock_t* lock){}
+void fs_lock(fs_lock_t* lock){}
+void fs_unlock(fs_lock_t* lock){}
+
+#endif
+
+int fs_media_init(fs_media_t* media)
+{
+    return fs_lock_init(&media->lock);
+}
+
+void fs_media_lock(fs_media_t* media)
+{
+    fs_lock(&media->lock);
+}
+
+void fs_media_unlock(fs_media_t* media)
+{
+    fs_unlock(&media->lock);
+}
+
+/*
+ * Read list of segments.
+ */
+int fs_media_readv(fs_media_t* media, fs_media_iov_t* iov, unsigned int iovcnt)
+{
+    unsigned int i;
+    uint32_t size;
+    int error;
+
+    if ((media->caps & FS_MEDIA_CAP_VECTOR) && media->readv)
+        return media->readv(media, iov, iovcnt);
+
+    for (i = 0; i < iovcnt; i++) {
+        size = iov[i].size;
+        if ((error = media->read(media, iov[i].buf, &size, iov[i].blkno)) != 0)
+            return error;
+    }
+    return 0;
+}
+
+/*
+ * Write list of segments.
+ */
+int fs_media_writev(fs_media_t* media, fs_media_iov_t* iov, unsigned int iovcnt)
+{
+    unsigned int i;
+    uint32_t size;
+    int error;
+
+    if ((media->caps & FS_MEDIA_CAP_VECTOR) && media->writev)
+        return media->writev(media, iov, iovcnt);
+
+    for (i = 0; i < iovcnt; i++) {
+        size = iov[i].size;
+        if ((error = media->write(media, iov[i].buf, &size, iov[i].blkno)) != 0)
+            return error;
+    }
+    return 0;
+}
+
+/*
+ * Start request. Without async support the request is done here.
+ */
+int fs_media_submit(fs_media_t* media, fs_media_req_t* req)
+{
+    if ((media->caps & FS_MEDIA_CAP_ASYNC) && media->submit && media->complete)
+        return media->submit(media, req);
+
+    if (req->op == FS_MEDIA_OP_WRITE)
+        req->status = fs_media_writev(media, req->iov, req->iovcnt);
+    else
+        req->status = fs_media_readv(media, req->iov, req->iovcnt);
+    return 0;
+}
+
+/*
+ * Wait for request completion and get its status.
+ */
+int fs_media_complete(fs_media_t* media, fs_media_req_t* req)
+{
+    if ((media->caps & FS_MEDIA_CAP_ASYNC) && media->submit && media->complete)
+        return media->complete(media, req);
+
+    return req->status;
+}
 
 
 
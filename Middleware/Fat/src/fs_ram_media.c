@@ -0,0 +1,170 @@
+/*
+ * fs_ram_media.c
+ *
+ * RAM backed media with access statistics and power cut simulation.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include "fs_ram_media.h"
+
+/*
+ * Check request range and get number of sectors.
+ */
+static int
+ram_range(fs_ram_media_t* rm, uint32_t size, uint32_t blkno, uint32_t* count)
+{
+    *count = (size + SEC_SIZE - 1) / SEC_SIZE;
+
+    if (blkno >= rm->sec_count || *count > rm->sec_count - blkno)
+        return EIO;
+
+    rm->nrequests++;
+    return 0;
+}
+
+static void
+ram_delay(fs_ram_media_t* rm, uint32_t latency, uint32_t count)
+{
+    if (rm->delay && latency)
+        rm->delay(latency * count);
+}
+
+static int
+ram_read(fs_media_t* media, void* buf, uint32_t* size, uint32_t blkno)
+{
+    fs_ram_media_t* rm = (fs_ram_media_t*) media;
+    uint32_t count;
+
+    if (ram_range(rm, *size, blkno, &count))
+        return EIO;
+
+    memcpy(buf, rm->mem + blkno * SEC_SIZE, *size);
+    rm->nreads += count;
+    ram_delay(rm, rm->read_latency, count);
+    return 0;
+}
+
+/*
+ * Store data, simulating power cut after configured number of sectors.
+ */
+static int
+ram_store(fs_ram_media_t* rm, const void* buf, uint32_t size, uint32_t blkno, uint32_t count)
+{
+    uint32_t i, len;
+
+    for (i = 0; i < count; i++) {
+        len = (size - i * SEC_SIZE < SEC_SIZE) ? size - i * SEC_SIZE : SEC_SIZE;
+
+        if (rm->powered_off)
+            return EIO;
+
+        if (rm->cut_after && --rm->cut_after == 0) {
+            /* Power is lost during this sector write. The flash sector
+             * is erased before programming, so a torn one holds the first
+             * half of new data and the rest is erased. */
+            rm->powered_off = 1;
+            if (rm->torn) {
+                memset(rm->mem + (blkno + i) * SEC_SIZE, 0xff, SEC_SIZE);
+                if (buf)
+                    memcpy(rm->mem + (blkno + i) * SEC_SIZE, (const uint8_t*) buf + i * SEC_SIZE, len / 2);
+            }
+            return EIO;
+        }
+
+        if (buf)
+            memcpy(rm->mem + (blkno + i) * SEC_SIZE, (const uint8_t*) buf + i * SEC_SIZE, len);
+        else
+            memset(rm->mem + (blkno + i) * SEC_SIZE, 0xff, SEC_SIZE);
+    }
+    return 0;
+}
+
+static int
+ram_write(fs_media_t* media, void* buf, uint32_t* size, uint32_t blkno)
+{
+    fs_ram_media_t* rm = (fs_ram_media_t*) media;
+    uint32_t count;
+    int error;
+
+    if (ram_range(rm, *size, blkno, &count))
+        return EIO;
+
+    error = ram_store(rm, buf, *size, blkno, count);
+    rm->nwrites += count;
+    ram_delay(rm, rm->write_latency, count);
+    return error;
+}
+
+static int
+ram_erase_range(fs_media_t* media, uint32_t blkno, uint32_t count)
+{
+    fs_ram_media_t* rm = (fs_ram_media_t*) media;
+    uint32_t n;
+    int error;
+
+    if (ram_range(rm, count * SEC_SIZE, blkno, &n))
+        return EIO;
+
+    error = ram_store(rm, NULL, count * SEC_SIZE, blkno, count);
+    rm->nerases += count;
+    ram_delay(rm, rm->erase_latency, count);
+    return error;
+}
+
+static int
+ram_sector_erase(fs_media_t* media, void* buf, uint32_t* size, uint32_t blkno)
+{
+    return ram_erase_range(media, blkno, 1);
+}
+
+/*
+ * Initialize RAM media over given memory of sec_count sectors.
+ */
+void
+fs_ram_media_init(fs_ram_media_t* rm, void* mem, uint32_t sec_count)
+{
+    memset(rm, 0, sizeof(*rm));
+    rm->media.read = ram_read;
+    rm->media.write = ram_write;
+    rm->media.sector_erase = ram_sector_erase;
+    rm->media.erase_range = ram_erase_range;
+    rm->media.program = ram_write;
+    rm->mem = mem;
+    rm->sec_count = sec_count;
+    fs_media_init(&rm->media);
+}
+
+/*
+ * Clear access counters.
+ */
+void
+fs_ram_media_reset_stats(fs_ram_media_t* rm)
+{
+    rm->nreads = 0;
+    rm->nwrites = 0;
+    rm->nerases = 0;
+    rm->nrequests = 0;
+}
+
+/*
+ * Lose power after given number of sector writes. If torn is set, the
+ * interrupted sector keeps the first half of new data and the rest is
+ * erased, otherwise the sector is left intact.
+ */
+void
+fs_ram_media_power_cut(fs_ram_media_t* rm, uint32_t writes, int torn)
+{
+    rm->cut_after = writes;
+    rm->torn = torn;
+}
+
+/*
+ * Restore power, the media content stays as it was at power cut.
+ */
+void
+fs_ram_media_power_on(fs_ram_media_t* rm)
+{
+    rm->cut_after = 0;
+    rm->powered_off = 0;
+}
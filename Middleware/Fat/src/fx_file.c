@@ -19,7 +19,7 @@ int
 fs_volume_open(fs_media_t* media, fs_vol_t* volume, uintptr_t part, void* (*mem_alloc)(size_t))
 {
     int error = EIO;
-    size_t nbytes = SEC_SIZE;
+    uint32_t nbytes = SEC_SIZE;
     char mbr[SEC_SIZE];
     uint32_t part_base;
     uint32_t part_size;
@@ -46,6 +46,15 @@ fs_volume_open(fs_media_t* media, fs_vol_t* volume, uintptr_t part, void* (*mem_
 
         /* Try initialize FAT volume. */
         error = fatfs_init(&volume->fmp, media, part_base, mem_alloc);
+        if (error) break;
+
+        /*
+         * Only the interrupted transaction is redone here, so mount time
+         * does not depend on volume size. Other checks are done later
+         * by fs_volume_scan().
+         */
+        error = fatfs_chk(&volume->fmp);
+        if (!error) volume->media = media;
     }
     while (0);
 
@@ -54,13 +63,54 @@ fs_volume_open(fs_media_t* media, fs_vol_t* volume, uintptr_t part, void* (*mem_
 }
 
 /*
- * No actions required when FAT volume is being closed.
+ * Start background check of the volume.
+ * @map: buffer of FS_SCAN_MAP_SIZE(volume) bytes used until the scan is done
+ */
+int
+fs_volume_scan_init(fs_vol_t* volume, fs_scan_t* scan, uint8_t* map)
+{
+    if(!volume || !scan || !map) return EINVAL;
+
+    fs_media_lock(volume->media);
+    fatfs_scan_init(&volume->fmp, scan, map);
+    fs_media_unlock(volume->media);
+    return 0;
+}
+
+/*
+ * Continue background check, intended to be called from a low priority
+ * thread. The volume is locked for one call only, so @budget bounds the
+ * time other threads may wait. Returns 0 when the check is complete and
+ * EAGAIN when more calls are needed. Progress is given by scan phase and
+ * pos/total, findings by the scan counters.
+ */
+int
+fs_volume_scan(fs_vol_t* volume, fs_scan_t* scan, int budget)
+{
+    int error;
+
+    if(!volume || !scan) return EINVAL;
+
+    fs_media_lock(volume->media);
+    error = fatfs_scan(&volume->fmp, scan, budget);
+    fs_media_unlock(volume->media);
+    return error;
+}
+
+/*
+ * Write buffered metadata when FAT volume is being closed.
  */
 int 
 fs_volume_close(fs_vol_t* volume)
 {
+    int error;
+
     if(!volume) return EINVAL;
-    return 0;
+
+    fs_media_lock(volume->media);
+    error = fatfs_sync(&volume->fmp);
+    fs_media_unlock(volume->media);
+    return error;
 }
 
 /*
@@ -154,6 +204,7 @@ fs_dir_open(fs_vol_t* volume, char* directory_name, fs_dir_t *dir)
                 memcpy(&dir->dirnode, &dirnode, sizeof(dir->dirnode));
                 dir->fmp = &volume->fmp;
                 dir->index = 0;
+                fat_dir_cursor_reset(&dir->cursor);
             }
         }
     }
@@ -183,9 +234,7 @@ int
 fs_dir_read_next_entry(fs_dir_t *dir, char* entry)
 {
     struct fatfs_node temp;
-    struct fat_dirent *de = &dir->dirnode.dirent;
-    int error;
-
+    int error, count;
     fs_media_t* media;
 
     if (!dir || !dir->fmp || !entry)
@@ -195,17 +244,47 @@ fs_dir_read_next_entry(fs_dir_t *dir, char* entry)
 
     fs_media_lock(media);
 
-    error = fatfs_get_node(dir->fmp, dir->index, &temp, DE_CLUSTER(de));
-    if (error)
-        goto out;
-    de = &temp.dirent;
-    fat_restore_name((char *)&de->name, entry);
+    error = fatfs_read_nodes(dir->fmp, &dir->cursor, DE_CLUSTER(&dir->dirnode.dirent), &temp, 1, &count);
+    if (!error) {
+        fat_restore_name((char *)&temp.dirent.name, entry);
+        dir->index++;
+    }
 
     fs_media_unlock(media);
+    return error;
+}
+
+/*
+ * Read up to max directory entries (at most FS_DIR_BATCH) with one media access.
+ * ENOENT is returned when there are no more entries.
+ */
+int 
+fs_dir_read_entries(fs_dir_t *dir, fs_dir_entry_t* entries, int max, int* count)
+{
+    struct fatfs_node temp[FS_DIR_BATCH];
+    int error, i;
+    fs_media_t* media;
+
+    if (!dir || !dir->fmp || !entries || !count || max <= 0)
+        return EINVAL;
 
-    dir->index++;
-    error = 0;
-out:
+    if (max > FS_DIR_BATCH)
+        max = FS_DIR_BATCH;
+
+    media = dir->fmp->dev;
+
+    fs_media_lock(media);
+
+    error = fatfs_read_nodes(dir->fmp, &dir->cursor, DE_CLUSTER(&dir->dirnode.dirent), temp, max, count);
+    for (i = 0; !error && i < *count; i++) {
+        fat_restore_name((char *)&temp[i].dirent.name, entries[i].name);
+        entries[i].attr = temp[i].dirent.attr;
+        entries[i].size = temp[i].dirent.size;
+    }
+    if (!error)
+        dir->index += *count;
+
+    fs_media_unlock(media);
     return error;
 }
 
@@ -215,8 +294,12 @@ out:
 int
 fs_dir_read_first_entry(fs_dir_t *dir, char* entry)
 {
+    if (!dir)
+        return EINVAL;
+
     /* Reset dir entry iterator. */
     dir->index = 0;
+    fat_dir_cursor_reset(&dir->cursor);
     return fs_dir_read_next_entry(dir, entry);
 }
 
@@ -337,6 +420,9 @@ fs_file_open(fs_vol_t* volume, fs_file_t* file_ptr, char* file_name, int open_ty
     if(!volume || !file_ptr || !file_name)
         return EINVAL;
 
+    /* Closing a file that failed to open does nothing. */
+    file_ptr->fmp = NULL;
+
     fs_media_lock(volume->media);
 
     do {
@@ -346,10 +432,13 @@ fs_file_open(fs_vol_t* volume, fs_file_t* file_ptr, char* file_name, int open_ty
 
         /* Get file node. */
         error = fatfs_lookup(&volume->fmp, &file_ptr->parent_dir, filename, &file_ptr->file_node);
+        if (!error)
+            error = fs_lock_init(&file_ptr->lock);
         if (!error)
         {
             file_ptr->fmp = &volume->fmp;
             file_ptr->offset = 0;
+            fat_cursor_reset(&file_ptr->cursor);
         }
     }
     while (0);
@@ -359,15 +448,16 @@ fs_file_open(fs_vol_t* volume, fs_file_t* file_ptr, char* file_name, int open_ty
 }
 
 /*
- * No actions required in order to close file.
+ * Close file: the file lock made by fs_file_open() is released.
  */
 int 
 fs_file_close(fs_file_t *file_ptr)
 {
-    if(!file_ptr)
+    if(!file_ptr || !file_ptr->fmp)
         return EINVAL;
 
-    /* Nothing to do. */
+    fs_lock_deinit(&file_ptr->lock);
+    file_ptr->fmp = NULL;
     return 0;
 }
 
@@ -382,6 +472,7 @@ fs_file_seek(fs_file_t *file_ptr, uint32_t byte_offset, int method)
     if(!file_ptr || !file_ptr->fmp)
         return EINVAL;
 
+    fs_lock(&file_ptr->lock);
     size = file_ptr->file_node.dirent.size;
 
     switch(method)
@@ -396,9 +487,11 @@ fs_file_seek(fs_file_t *file_ptr, uint32_t byte_offset, int method)
         file_ptr->offset = size - byte_offset;
         break; 
     default:
+        fs_unlock(&file_ptr->lock);
         return EINVAL;
     }
 
+    fs_unlock(&file_ptr->lock);
     return 0;
 }
 
@@ -416,9 +509,12 @@ fs_file_trunc(fs_file_t *file_ptr, uint32_t size)
 
     media = file_ptr->fmp->dev;
 
+    fs_lock(&file_ptr->lock);
     fs_media_lock(media);
     error = fatfs_truncate(file_ptr->fmp, &file_ptr->file_node, size);
+    fat_cursor_reset(&file_ptr->cursor);
     fs_media_unlock(media);
+    fs_unlock(&file_ptr->lock);
     return error;
 }
 
@@ -436,17 +532,20 @@ fs_file_read(fs_file_t *file_ptr, void* buffer_ptr, uint32_t request_size, size_
 
     media = file_ptr->fmp->dev;
 
+    fs_lock(&file_ptr->lock);
     fs_media_lock(media);
     error = fatfs_read(
         file_ptr->fmp, 
         &file_ptr->file_node, 
         &file_ptr->offset, 
+        &file_ptr->cursor, 
         buffer_ptr, 
         request_size, 
         actual_size
     );
 
     fs_media_unlock(media);
+    fs_unlock(&file_ptr->lock);
     return error;
 }
 
@@ -464,12 +563,14 @@ fs_file_write(fs_file_t *file_ptr, void* buffer_ptr, uint32_t request_size, size
 
     media = file_ptr->fmp->dev;
 
+    fs_lock(&file_ptr->lock);
     fs_media_lock(media);
 
     error = fatfs_write(
         file_ptr->fmp, 
         &file_ptr->file_node, 
         &file_ptr->offset, 
+        &file_ptr->cursor, 
         buffer_ptr, 
         request_size, 
         size, 
@@ -477,5 +578,6 @@ fs_file_write(fs_file_t *file_ptr, void* buffer_ptr, uint32_t request_size, size
     );
 
     fs_media_unlock(media);
+    fs_unlock(&file_ptr->lock);
     return error;
 }
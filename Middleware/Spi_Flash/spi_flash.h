@@ -29,6 +29,8 @@
 #define SPI_FLASH_WRITE_STATUS_2 0x31
 #define SPI_FLASH_WRITE_STATUS_3 0x11
 #define SPI_FLASH_SECTOR_ERASE 0x20
+#define SPI_FLASH_BLOCK_ERASE 0xD8
+#define SPI_FLASH_SEC_PER_BLOCK 16
 #define SPI_FLASH_VOLITILE_STATUS 0x50
 #define FLASH_CS_ENABLED	HAL_GPIO_WritePin(nCS_GPIO_Port, nCS_Pin, GPIO_PIN_RESET)
 #define FLASH_CS_DISABLED	HAL_GPIO_WritePin(nCS_GPIO_Port, nCS_Pin, GPIO_PIN_SET)
@@ -63,7 +65,18 @@ typedef struct spi_flash
 	//fx_mutex_t
 } spi_flash_t;
 
+/* Flash operation counters, shared by all file systems on the chip. */
+typedef struct flash_stats
+{
+	uint32_t reads;			/* read requests */
+	uint32_t read_bytes;
+	uint32_t programs;		/* programmed pages */
+	uint32_t erases;		/* erased sectors */
+	uint32_t block_erases;	/* 64K block erase commands */
+} flash_stats_t;
+
 void fx_spi_Erase_Sector(uint32_t blkno);
+void fx_spi_Erase_Block(uint32_t blkno);
 int fx_spi_chip_erase();
 void fx_spi_Set_Block_Protect(uint8_t blkno);
 void fx_spi_Wait_Write_End(void);
@@ -76,8 +89,12 @@ void fx_init_spi_flash(int (*r)(uint8_t*, uint16_t),
 void * fs_mem_alloc(size_t size);
 void fx_spi_flash_Reset (void);
 int fx_flash_write(void* buf, uint32_t* nbyte, uint32_t blkno);
+int fx_flash_program(void* buf, uint32_t* nbyte, uint32_t blkno);
+int fx_flash_erase_range(uint32_t blkno, uint32_t count);
 int fx_flash_read(void* buf, uint32_t* nbyte, uint32_t blkno);
 extern void HAL_Delay(uint32_t delay);
 
 void fx_spi_flash_get_info(flash_info_t* fi);
+void fx_flash_get_stats(flash_stats_t* st);
+void fx_flash_reset_stats(void);
 #endif /* FX_SPI_FLASH_H_ */
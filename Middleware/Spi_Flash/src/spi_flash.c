@@ -1,7 +1,9 @@
+#include <string.h>
 #include "spi_flash.h"
 
 static spi_flash_rw_t rw_funcs;
 static spi_flash_cs_t cs;
+static flash_stats_t stats;
 //unsigned char zero_arr[256];
 
 void fx_init_spi_flash(int (*r)(uint8_t*, uint16_t), 
@@ -140,6 +142,26 @@ void fx_spi_Erase_Sector(uint32_t blkno)
   fx_spi_write_disable();
   fx_spi_Wait_Write_End();
   fx_spi_Set_Block_Protect(0x0F);
+  stats.erases++;
+}
+
+void fx_spi_Erase_Block(uint32_t blkno)
+{
+  fx_spi_Wait_Write_End();
+
+  uint32_t offset = SPI_FLASH_SEC_SIZE * blkno;
+  uint8_t buf[4] = {SPI_FLASH_BLOCK_ERASE, (offset >> 16) & 0xff, (offset >> 8) & 0xff, offset & 0xff};
+
+  fx_spi_Set_Block_Protect(0x00);
+  fx_spi_write_enable();
+  cs.enable();
+  rw_funcs.write(buf, 4);
+  cs.disable();
+  fx_spi_write_disable();
+  fx_spi_Wait_Write_End();
+  fx_spi_Set_Block_Protect(0x0F);
+  stats.erases += SPI_FLASH_SEC_PER_BLOCK;
+  stats.block_erases++;
 }
 
 int fx_spi_chip_erase()
@@ -169,7 +191,9 @@ int fx_flash_read(void* buf, uint32_t* nbyte, uint32_t blkno)
     rw_funcs.write(data, 4);
     rw_funcs.read(buf, *nbyte);
     cs.disable();
-    
+
+	stats.reads++;
+	stats.read_bytes += *nbyte;
 	return 0;
 }
 
@@ -187,6 +211,7 @@ int fx_flash_write_page(void* buf, uint32_t* nbyte, uint32_t blkno)
 	cs.disable();
 
 	fx_spi_write_disable();
+	stats.programs++;
 	return 1;
 }
 
@@ -199,14 +224,13 @@ int fx_flash_write_fat_sec(void* buf, uint32_t* nbyte, uint32_t blkno)
 	return 1;
 }
 
-int fx_flash_write(void* buf, uint32_t* nbyte, uint32_t blkno)
+/* Program already erased sectors, no erase is done. */
+int fx_flash_program(void* buf, uint32_t* nbyte, uint32_t blkno)
 {
-
 	uint32_t offset = SPI_FLASH_SEC_SIZE * blkno;
 	uint8_t data[4] = {SPI_FLASH_CMD_Write, (offset >> 16) & 0xff, (offset >> 8) & 0xff, offset & 0xff};
 	uint32_t data_size;
 	size_t full_size = *nbyte;
-	fx_spi_Erase_Sector(blkno);
 	fx_spi_Set_Block_Protect(0x00);
 	for (size_t i = 0; i < full_size; i += SPI_FLASH_PAGE_SIZE)
 	{
@@ -220,13 +244,14 @@ int fx_flash_write(void* buf, uint32_t* nbyte, uint32_t blkno)
     	cs.disable();
 
 		fx_spi_write_disable();
+		stats.programs++;
 
 		offset += SPI_FLASH_PAGE_SIZE;
 		data[1] = (offset >> 16) & 0xff;
 		data[2] = (offset >> 8) & 0xff;
 		data[3] =  offset & 0xff;
 		buf += SPI_FLASH_PAGE_SIZE;
-		*nbyte -= SPI_FLASH_PAGE_SIZE;
+		*nbyte -= data_size;
 
 		fx_spi_Wait_Write_End();
 	}
@@ -235,3 +260,41 @@ int fx_flash_write(void* buf, uint32_t* nbyte, uint32_t blkno)
     return 0;
 }
 
+/* Erase sectors range using 64K block erase where it is aligned. */
+int fx_flash_erase_range(uint32_t blkno, uint32_t count)
+{
+	while (count)
+	{
+		if ((blkno % SPI_FLASH_SEC_PER_BLOCK) == 0 && count >= SPI_FLASH_SEC_PER_BLOCK)
+		{
+			fx_spi_Erase_Block(blkno);
+			blkno += SPI_FLASH_SEC_PER_BLOCK;
+			count -= SPI_FLASH_SEC_PER_BLOCK;
+		}
+		else
+		{
+			fx_spi_Erase_Sector(blkno);
+			blkno++;
+			count--;
+		}
+	}
+	return 0;
+}
+
+int fx_flash_write(void* buf, uint32_t* nbyte, uint32_t blkno)
+{
+	/* Each sector covered by the request is erased before programming. */
+	fx_flash_erase_range(blkno, (*nbyte + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE);
+	return fx_flash_program(buf, nbyte, blkno);
+}
+
+
+void fx_flash_get_stats(flash_stats_t* st)
+{
+	*st = stats;
+}
+
+void fx_flash_reset_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}